@@ -0,0 +1,233 @@
+// Reproducible micro-benchmarks for the index model and version ordering,
+// built and run by `make bench` (never installed):
+//   cpk-bench index [lines]     load a synthetic CPKINDEX into the index model,
+//                               report operator new calls, load time and peak RSS
+//   cpk-bench versions [pairs]  per million random x.y.z-r pairs: the former
+//                               istringstream/stoi comparator, compare_versions()
+//                               and precomputed cpk_version_key() comparison
+#include "cpk.h"
+#include "utils.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
+
+const std::string CPK_VERSION = "bench";
+
+std::string CPK_CONF_FILE = "/dev/null";
+std::string CPK_REPO_URL = "file:///nonexistent";
+std::string CPK_HOME_DIR = "/tmp";
+std::string CPK_INSTALL_ROOT = "/";
+std::string CPK_PKGMK_CMD = "pkgmk";
+std::string CPK_PKGADD_CMD = "pkgadd";
+std::string CPK_PKGRM_CMD = "pkgrm";
+std::string CPK_PKGINFO_CMD = "pkginfo";
+
+bool CPK_COLOR_MODE = false;
+bool CPK_VERBOSE = false;
+bool CPK_NATIVE_INSTALL = false;
+
+// Every C++ allocation of the process goes through these
+static std::atomic<unsigned long long> g_new_calls{0};
+
+void* operator new(size_t size) {
+    g_new_calls.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    std::free(p);
+}
+
+// Fixed-seed generator, so every run sees the same index and pairs
+static unsigned long long g_seed = 0x9e3779b97f4a7c15ULL;
+
+static unsigned next_random(unsigned bound) {
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 7;
+    g_seed ^= g_seed << 17;
+    return static_cast<unsigned>(g_seed % bound);
+}
+
+static std::string random_version() {
+    return std::to_string(next_random(20)) + "." + std::to_string(next_random(40)) + "." +
+           std::to_string(next_random(100)) + "-" + std::to_string(1 + next_random(12));
+}
+
+static long max_rss_kb() {
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// "port#version-release.arch.cpk: deps" lines: every port once or twice
+// (two revisions), up to five dependencies on other ports
+static bool write_index(const std::string& path, size_t lines) {
+    FILE* out = std::fopen(path.c_str(), "w");
+    if (out == nullptr) {
+        return false;
+    }
+    const size_t ports = lines * 2 / 3 + 1;
+    size_t written = 0;
+    for (size_t port = 0; written < lines; ++port) {
+        const size_t revisions = port % 2 == 0 ? 2 : 1;
+        for (size_t r = 0; r < revisions && written < lines; ++r, ++written) {
+            std::fprintf(out, "port%zu#%s.x86_64.cpk:", port % ports, random_version().c_str());
+            const unsigned deps = next_random(6);
+            for (unsigned d = 0; d < deps; ++d) {
+                std::fprintf(out, " port%u", next_random(static_cast<unsigned>(ports)));
+            }
+            std::fputc('\n', out);
+        }
+    }
+    return std::fclose(out) == 0;
+}
+
+static int bench_index(size_t lines) {
+    char dir[] = "/tmp/cpk-bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    CPK_HOME_DIR = dir;
+    const std::string index = get_cpkindex_path();
+    if (!write_index(index, lines)) {
+        std::perror(index.c_str());
+        return 1;
+    }
+    std::error_code ec;
+    const auto size = fs::file_size(index, ec);
+
+    const long rss_before = max_rss_kb();
+    const unsigned long long calls_before = g_new_calls.load();
+    const auto start = std::chrono::steady_clock::now();
+    cpk_preload_index_deps_cache();
+    const double load_ms = ms_since(start);
+    const unsigned long long load_calls = g_new_calls.load() - calls_before;
+    const long rss_after = max_rss_kb();
+
+    const unsigned long long free_before = g_new_calls.load();
+    const auto free_start = std::chrono::steady_clock::now();
+    cpk_invalidate_cpkindex_deps_cache();
+    const double free_ms = ms_since(free_start);
+
+    // Only plain printf formatting, so the program also builds against older trees
+    std::printf("index: %zu lines, %.1f MiB\n", lines, ec ? 0.0 : size / 1048576.0);
+    std::printf("  load:        %10.1f ms, %llu operator new calls\n", load_ms, load_calls);
+    std::printf("  invalidate:  %10.1f ms, %llu operator new calls\n", free_ms, g_new_calls.load() - free_before);
+    std::printf("  peak RSS:    %10.1f MiB before load, %.1f MiB after\n", rss_before / 1024.0, rss_after / 1024.0);
+
+    fs::remove_all(dir, ec);
+    return 0;
+}
+
+// compare_versions() as it was before version keys: numeric dot fields of
+// the version only, release ignored
+static int legacy_compare_versions(const std::string& v1, const std::string& v2) {
+    std::vector<int> ver1, ver2;
+    std::string token;
+    std::istringstream iss1(v1.substr(0, v1.find('-')));
+    while (std::getline(iss1, token, '.')) {
+        try {
+            ver1.push_back(std::stoi(token));
+        } catch (const std::exception&) {
+            ver1.push_back(0);
+        }
+    }
+    std::istringstream iss2(v2.substr(0, v2.find('-')));
+    while (std::getline(iss2, token, '.')) {
+        try {
+            ver2.push_back(std::stoi(token));
+        } catch (const std::exception&) {
+            ver2.push_back(0);
+        }
+    }
+    const size_t max_len = std::max(ver1.size(), ver2.size());
+    for (size_t i = 0; i < max_len; i++) {
+        const int a = i < ver1.size() ? ver1[i] : 0;
+        const int b = i < ver2.size() ? ver2[i] : 0;
+        if (a != b) {
+            return a < b ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static int bench_versions(size_t pairs) {
+    std::vector<std::string> left, right, left_keys, right_keys;
+    for (size_t i = 0; i < pairs; ++i) {
+        left.push_back(random_version());
+        right.push_back(random_version());
+        left_keys.push_back(cpk_version_key(left.back()));
+        right_keys.push_back(cpk_version_key(right.back()));
+    }
+    const double scale = 1e6 / static_cast<double>(pairs);
+    long checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < pairs; ++i) {
+        checksum += legacy_compare_versions(left[i], right[i]);
+    }
+    const double legacy_ms = ms_since(start) * scale;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < pairs; ++i) {
+        checksum += compare_versions(left[i], right[i]);
+    }
+    const double current_ms = ms_since(start) * scale;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < pairs; ++i) {
+        checksum += left_keys[i].compare(right_keys[i]) < 0;
+    }
+    const double keys_ms = ms_since(start) * scale;
+
+    std::printf("versions: %zu random x.y.z-r pairs, per million comparisons\n", pairs);
+    std::printf("  istringstream + stoi (former):  %10.1f ms\n", legacy_ms);
+    std::printf("  compare_versions (two keys):    %10.1f ms\n", current_ms);
+    std::printf("  precomputed keys:               %10.1f ms\n", keys_ms);
+    std::printf("  (checksum %ld)\n", checksum);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    const std::string mode = argc > 1 ? argv[1] : "";
+    const size_t count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 0;
+    if (mode == "index") {
+        return bench_index(count ? count : 600000);
+    }
+    if (mode == "versions") {
+        return bench_versions(count ? count : 1000000);
+    }
+    std::fprintf(stderr, "Usage: cpk-bench index [lines] | versions [pairs]\n");
+    return 2;
+}
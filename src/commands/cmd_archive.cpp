@@ -4,19 +4,151 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <stdexcept>
+#include <sstream>
+#include <map>
+#include <sys/stat.h>
 
 static bool ends_with(const std::string& str, const std::string& suffix) {
     return str.size() >= suffix.size() &&
            str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
 }
 
+// Inputs recorded per pkg tarball in <repo>/.cpk-archive-manifest, one
+// tab-separated line: "<pkg path> <cpk> <size> <mtime> <Pkgfile> <.footprint> <.signature>"
+// (sha256 of the port files, "-" when a file is absent)
+struct ArchiveInputs {
+    std::string cpk_filename;
+    std::string pkg_size;
+    std::string pkg_mtime;
+    std::string pkgfile_sha256;
+    std::string footprint_sha256;
+    std::string signature_sha256;
+
+    bool same_inputs(const ArchiveInputs& other) const {
+        return pkg_size == other.pkg_size && pkg_mtime == other.pkg_mtime &&
+               pkgfile_sha256 == other.pkgfile_sha256 &&
+               footprint_sha256 == other.footprint_sha256 &&
+               signature_sha256 == other.signature_sha256;
+    }
+};
+
+static const char* ARCHIVE_MANIFEST = ".cpk-archive-manifest";
+
+static std::map<std::string, ArchiveInputs> load_archive_manifest(const fs::path& output_dir) {
+    std::map<std::string, ArchiveInputs> manifest;
+    std::ifstream in(output_dir / ARCHIVE_MANIFEST);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        ArchiveInputs inputs;
+        if (std::getline(fields, key, '\t') &&
+            std::getline(fields, inputs.cpk_filename, '\t') &&
+            std::getline(fields, inputs.pkg_size, '\t') &&
+            std::getline(fields, inputs.pkg_mtime, '\t') &&
+            std::getline(fields, inputs.pkgfile_sha256, '\t') &&
+            std::getline(fields, inputs.footprint_sha256, '\t') &&
+            std::getline(fields, inputs.signature_sha256)) {
+            manifest[key] = inputs;
+        }
+    }
+    return manifest;
+}
+
+static void save_archive_manifest(const fs::path& output_dir, const std::map<std::string, ArchiveInputs>& manifest) {
+    const fs::path tmp = output_dir / (std::string(ARCHIVE_MANIFEST) + ".tmp");
+    std::ofstream out(tmp);
+    for (const auto& entry : manifest) {
+        const ArchiveInputs& inputs = entry.second;
+        out << entry.first << '\t' << inputs.cpk_filename << '\t' << inputs.pkg_size << '\t'
+            << inputs.pkg_mtime << '\t' << inputs.pkgfile_sha256 << '\t'
+            << inputs.footprint_sha256 << '\t' << inputs.signature_sha256 << '\n';
+    }
+    out.close();
+    if (!out) {
+        print_message("Failed to write " + tmp.string(), RED);
+        fs::remove(tmp);
+        return;
+    }
+    fs::rename(tmp, output_dir / ARCHIVE_MANIFEST);
+}
+
+static std::string port_file_sha256(const fs::path& path) {
+    const std::string checksum = calculate_sha256(path.string());
+    return checksum.empty() ? "-" : checksum;
+}
+
+static ArchiveInputs read_archive_inputs(const fs::path& package_path, const std::string& cpk_filename) {
+    ArchiveInputs inputs;
+    const fs::path package_dir = package_path.parent_path();
+    inputs.cpk_filename = cpk_filename;
+    struct stat st;
+    if (stat(package_path.c_str(), &st) == 0) {
+        inputs.pkg_size = std::to_string(static_cast<long long>(st.st_size));
+        inputs.pkg_mtime = std::to_string(static_cast<long long>(st.st_mtime));
+    }
+    inputs.pkgfile_sha256 = port_file_sha256(package_dir / "Pkgfile");
+    inputs.footprint_sha256 = port_file_sha256(package_dir / ".footprint");
+    inputs.signature_sha256 = port_file_sha256(package_dir / ".signature");
+    return inputs;
+}
+
+static bool parse_int_option(const std::string& arg, const std::string& prefix, int& value) {
+    try {
+        value = std::stoi(arg.substr(prefix.size()));
+    } catch (const std::exception& e) {
+        print_message("Invalid value for " + prefix.substr(0, prefix.size() - 1) + ": " + arg.substr(prefix.size()), RED);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_archive_flags(const std::vector<std::string>& args,
+                                std::vector<std::string>& positional,
+                                CpkArchiveOptions& options,
+                                bool& rebuild_stale) {
+    positional.clear();
+    rebuild_stale = false;
+    for (const auto& a : args) {
+        if (a.rfind("--compress=", 0) == 0) {
+            options.compress = a.substr(11);
+            if (!cpk_archive_compress_supported(options.compress)) {
+                print_message("Unsupported compression: " + options.compress + " (use none, zstd or xz)", RED);
+                return false;
+            }
+        } else if (a.rfind("--level=", 0) == 0) {
+            if (!parse_int_option(a, "--level=", options.level)) {
+                return false;
+            }
+        } else if (a.rfind("--threads=", 0) == 0) {
+            if (!parse_int_option(a, "--threads=", options.threads)) {
+                return false;
+            }
+        } else if (a == "--reproducible") {
+            options.reproducible = true;
+        } else if (a == "--rebuild-stale") {
+            rebuild_stale = true;
+        } else {
+            positional.push_back(a);
+        }
+    }
+    return true;
+}
+
 void cmd_archive(const std::vector<std::string>& args) {
-    if (args.size() != 2) {
-        print_message("Usage: cpk archive <prtdir> <repo>", YELLOW);
+    std::vector<std::string> positional;
+    CpkArchiveOptions options;
+    bool rebuild_stale = false;
+    if (!parse_archive_flags(args, positional, options, rebuild_stale)) {
+        return;
+    }
+    if (positional.size() != 2) {
+        print_message("Usage: cpk archive [--compress=none|zstd|xz] [--level=N] [--threads=N] [--reproducible] [--rebuild-stale] <prtdir> <repo>", YELLOW);
         return;
     }
-    fs::path ports_dir = args[0];
-    fs::path output_dir = args[1];
+    fs::path ports_dir = positional[0];
+    fs::path output_dir = positional[1];
     ensure_directory(output_dir);
 
     std::string arch = get_system_architecture();
@@ -30,6 +162,11 @@ void cmd_archive(const std::vector<std::string>& args) {
         return;
     }
 
+    // Ports whose recorded inputs still match are skipped without reading their Pkgfile
+    std::map<std::string, ArchiveInputs> manifest = load_archive_manifest(output_dir);
+    int unchanged = 0;
+    int stale = 0;
+
     // Iterate over port directories
     for (const auto &entry : fs::recursive_directory_iterator(ports_dir)) {
         //if (entry.path().extension().string().find(".pkg.") != std::string::npos) {
@@ -41,13 +178,35 @@ void cmd_archive(const std::vector<std::string>& args) {
 
         // Detect known compressed pkg formats
         if ((ends_with(package, ".pkg.tar.gz") || ends_with(package, ".pkg.tar.bz2") || ends_with(package, ".pkg.tar.xz"))) {
-            if (CPK_VERBOSE) {
-                print_message("Processing package file: " + entry.path().string());
-            }
-
             // Get port source directory and read Pkgfile
             std::string package_prefix = package.substr(0, package.find(".pkg."));
             fs::path package_dir = package_path.parent_path();
+
+            const std::string manifest_key = fs::absolute(package_path).string();
+            const ArchiveInputs inputs = read_archive_inputs(package_path, package_prefix + "." + arch + ".cpk");
+            const auto recorded = manifest.find(manifest_key);
+            const fs::path recorded_cpk = output_dir / inputs.cpk_filename;
+            if (recorded != manifest.end() && recorded->second.cpk_filename == inputs.cpk_filename &&
+                fs::exists(recorded_cpk) && fs::exists(recorded_cpk.string() + ".info")) {
+                if (recorded->second.same_inputs(inputs)) {
+                    ++unchanged;
+                    continue;
+                }
+                // Same version-release but different Pkgfile, footprint, signature or
+                // pkg tarball: the published .cpk no longer matches the port
+                ++stale;
+                if (!rebuild_stale) {
+                    print_message("Stale " + recorded_cpk.string() + " (port inputs changed without a version bump)", YELLOW);
+                    continue;
+                }
+                print_message("Rebuilding stale " + recorded_cpk.string(), YELLOW);
+                fs::remove(recorded_cpk);
+                fs::remove(recorded_cpk.string() + ".info");
+            }
+
+            if (CPK_VERBOSE) {
+                print_message("Processing package file: " + entry.path().string());
+            }
             fs::path pkgfile_path = package_dir / "Pkgfile";
             std::ifstream pkgfile(pkgfile_path);
             if (!pkgfile) continue;
@@ -98,7 +257,10 @@ void cmd_archive(const std::vector<std::string>& args) {
                     auto local_files = get_local_files(sources);
                     copy_files(package_dir, basedir, local_files);
                     fs::copy(package_path, basedir / package, fs::copy_options::overwrite_existing);
-                    package_files(name, version, release, arch, output_dir);
+                    if (!package_files(name, version, release, arch, output_dir, options)) {
+                        print_message("Failed to create " + cpk_path.string(), RED);
+                        continue;
+                    }
                 }
 
                 // Generate .cpk.info file (only if .cpk file exists)
@@ -134,8 +296,21 @@ void cmd_archive(const std::vector<std::string>& args) {
                         print_message("Skipping " + info_path.string() + " (already exists)");
                     }
                 }
+
+                if (fs::exists(cpk_path) && fs::exists(info_path)) {
+                    manifest[manifest_key] = inputs;
+                }
             }
         }
     }
+
+    save_archive_manifest(output_dir, manifest);
+
+    if (CPK_VERBOSE) {
+        print_message("Unchanged ports skipped: " + std::to_string(unchanged));
+    }
+    if (stale > 0 && !rebuild_stale) {
+        print_message(std::to_string(stale) + " stale package(s); rerun with --rebuild-stale to regenerate them", YELLOW);
+    }
     return;
 }
@@ -0,0 +1,325 @@
+#include "../cpk.h"
+#include "../utils.h"
+#include "../fs_compat.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// One .footprint line: "<mode>\t<owner>/<group>\t<path>[ -> <target>]"
+struct FootprintEntry {
+    mode_t mode = 0;
+    std::string owner;
+    std::string group;
+    std::string target;  // symlinks only
+};
+
+struct AuditFinding {
+    enum Kind { Missing, Modified, Permissions } kind;
+    std::string path;
+    std::string detail;
+};
+
+// Work item for one installed package
+struct PackageAudit {
+    const CpkInstalledPackage* package = nullptr;
+    size_t checked = 0;
+    bool has_footprint = false;
+    bool has_archive = false;
+    std::vector<AuditFinding> findings;
+};
+
+// Name -> id from the target root's /etc/passwd or /etc/group, so audits of
+// an alternative root use its accounts rather than the host's
+static std::unordered_map<std::string, unsigned long> read_ids(const std::string& path) {
+    std::unordered_map<std::string, unsigned long> ids = {{"root", 0}};
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t name_end = line.find(':');
+        const size_t id_begin = line.find(':', name_end + 1);
+        if (name_end == std::string::npos || id_begin == std::string::npos) {
+            continue;
+        }
+        ids[line.substr(0, name_end)] = std::strtoul(line.c_str() + id_begin + 1, nullptr, 10);
+    }
+    return ids;
+}
+
+// "-rwsr-xr-x" -> file type and permission bits
+static bool parse_mode(std::string_view text, mode_t& mode) {
+    if (text.size() != 10) {
+        return false;
+    }
+    switch (text[0]) {
+    case '-': mode = S_IFREG; break;
+    case 'd': mode = S_IFDIR; break;
+    case 'l': mode = S_IFLNK; break;
+    case 'c': mode = S_IFCHR; break;
+    case 'b': mode = S_IFBLK; break;
+    case 'p': mode = S_IFIFO; break;
+    case 's': mode = S_IFSOCK; break;
+    default: return false;
+    }
+    static const mode_t bits[9] = {S_IRUSR, S_IWUSR, S_IXUSR, S_IRGRP, S_IWGRP, S_IXGRP, S_IROTH, S_IWOTH, S_IXOTH};
+    static const mode_t special[3] = {S_ISUID, S_ISGID, S_ISVTX};
+    for (int i = 0; i < 9; ++i) {
+        const char c = text[1 + i];
+        if (i % 3 == 2 && (c == 's' || c == 't' || c == 'S' || c == 'T')) {
+            mode |= special[i / 3] | (c == 's' || c == 't' ? bits[i] : 0);
+        } else if (c != '-') {
+            mode |= bits[i];
+        }
+    }
+    return true;
+}
+
+static std::string mode_string(mode_t mode) {
+    std::string text = S_ISDIR(mode) ? "d" : S_ISLNK(mode) ? "l" : S_ISCHR(mode) ? "c" : S_ISBLK(mode) ? "b"
+                     : S_ISFIFO(mode) ? "p" : S_ISSOCK(mode) ? "s" : "-";
+    static const char letters[] = "rwxrwxrwx";
+    static const mode_t bits[9] = {S_IRUSR, S_IWUSR, S_IXUSR, S_IRGRP, S_IWGRP, S_IXGRP, S_IROTH, S_IWOTH, S_IXOTH};
+    for (int i = 0; i < 9; ++i) {
+        text += (mode & bits[i]) ? letters[i] : '-';
+    }
+    if (mode & S_ISUID) text[3] = (mode & S_IXUSR) ? 's' : 'S';
+    if (mode & S_ISGID) text[6] = (mode & S_IXGRP) ? 's' : 'S';
+    if (mode & S_ISVTX) text[9] = (mode & S_IXOTH) ? 't' : 'T';
+    return text;
+}
+
+static bool read_footprint(const std::string& path, std::unordered_map<std::string, FootprintEntry>& entries) {
+    CpkFileBuffer buffer;
+    if (!buffer.open(path)) {
+        return false;
+    }
+    const std::string_view text(buffer.data, buffer.size);
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        const std::string_view line = text.substr(pos, end - pos);
+        pos = end + 1;
+        const size_t tab1 = line.find('\t');
+        const size_t tab2 = tab1 == std::string_view::npos ? tab1 : line.find('\t', tab1 + 1);
+        FootprintEntry entry;
+        if (tab2 == std::string_view::npos || !parse_mode(line.substr(0, tab1), entry.mode)) {
+            continue;
+        }
+        const std::string_view owner = line.substr(tab1 + 1, tab2 - tab1 - 1);
+        const size_t slash = owner.find('/');
+        entry.owner.assign(owner.substr(0, slash));
+        entry.group.assign(slash == std::string_view::npos ? std::string_view() : owner.substr(slash + 1));
+        std::string_view file = line.substr(tab2 + 1);
+        if (S_ISLNK(entry.mode)) {
+            const size_t arrow = file.find(" -> ");
+            if (arrow != std::string_view::npos) {
+                entry.target.assign(file.substr(arrow + 4));
+                file = file.substr(0, arrow);
+            }
+        }
+        entries.emplace(std::string(file), std::move(entry));
+    }
+    return true;
+}
+
+static std::string type_name(mode_t mode) {
+    return S_ISDIR(mode) ? "directory" : S_ISLNK(mode) ? "symlink" : S_ISREG(mode) ? "file" : "special file";
+}
+
+// Metadata of every file the database lists against the package's footprint,
+// then (with hash) file contents against the members of its pkg.tar.*
+static void audit_package(PackageAudit& audit, int root_fd, bool hash,
+                          const std::unordered_map<std::string, unsigned long>& users,
+                          const std::unordered_map<std::string, unsigned long>& groups) {
+    const CpkInstalledPackage& package = *audit.package;
+    const std::string port = resolve_package_extract_dir(package.name, package.version);
+    std::unordered_map<std::string, FootprintEntry> footprint;
+    audit.has_footprint = read_footprint(port + "/.footprint", footprint);
+    std::unordered_map<std::string, std::string> digests;
+    if (hash) {
+        const std::string archive = find_pkg_file(port, package.name, package.version);
+        audit.has_archive = !archive.empty() && cpk_archive_member_sha256(archive, digests);
+    }
+
+    for (const auto& file : package.files) {
+        std::string rel = file;
+        if (rel.size() > 1 && rel.back() == '/') {
+            rel.pop_back();
+        }
+        ++audit.checked;
+        struct stat st;
+        if (fstatat(root_fd, rel.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno == ENOENT || errno == ENOTDIR) {
+                audit.findings.push_back({AuditFinding::Missing, file, ""});
+            } else {
+                audit.findings.push_back({AuditFinding::Modified, file, std::strerror(errno)});
+            }
+            continue;
+        }
+        const auto it = footprint.find(file);
+        if (it != footprint.end()) {
+            const FootprintEntry& expected = it->second;
+            if ((st.st_mode & S_IFMT) != (expected.mode & S_IFMT)) {
+                audit.findings.push_back({AuditFinding::Modified, file,
+                                          type_name(st.st_mode) + ", expected " + type_name(expected.mode)});
+                continue;
+            }
+            if (S_ISLNK(st.st_mode)) {
+                char target[4096];
+                const ssize_t n = readlinkat(root_fd, rel.c_str(), target, sizeof(target));
+                if (n >= 0 && !expected.target.empty() && std::string(target, static_cast<size_t>(n)) != expected.target) {
+                    audit.findings.push_back({AuditFinding::Modified, file,
+                                              "points to " + std::string(target, static_cast<size_t>(n)) +
+                                              ", expected " + expected.target});
+                }
+                continue;
+            }
+            const auto uid = users.find(expected.owner);
+            const auto gid = groups.find(expected.group);
+            const bool mode_drift = (st.st_mode & 07777) != (expected.mode & 07777);
+            const bool owner_drift = (uid != users.end() && st.st_uid != uid->second) ||
+                                     (gid != groups.end() && st.st_gid != gid->second);
+            if (mode_drift || owner_drift) {
+                audit.findings.push_back({AuditFinding::Permissions, file,
+                                          mode_string(st.st_mode) + " " + std::to_string(st.st_uid) + "/" +
+                                          std::to_string(st.st_gid) + ", expected " + mode_string(expected.mode) +
+                                          " " + expected.owner + "/" + expected.group});
+            }
+        }
+        const auto digest = audit.has_archive ? digests.find(file) : digests.end();
+        if (digest == digests.end()) {
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            audit.findings.push_back({AuditFinding::Modified, file, type_name(st.st_mode) + ", expected file"});
+        } else if (calculate_sha256_at(root_fd, rel) != digest->second) {
+            audit.findings.push_back({AuditFinding::Modified, file, "contents differ from the package"});
+        }
+    }
+}
+
+void cmd_audit(const std::vector<std::string>& args) {
+    bool hash = false;
+    long jobs = static_cast<long>(std::thread::hardware_concurrency());
+    std::unordered_set<std::string> wanted;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (a == "--hash") {
+            hash = true;
+        } else if (a == "-j" && i + 1 < args.size()) {
+            jobs = std::strtol(args[++i].c_str(), nullptr, 10);
+        } else if (a.rfind("-j", 0) == 0 && a.size() > 2) {
+            jobs = std::strtol(a.c_str() + 2, nullptr, 10);
+        } else if (a.rfind("--jobs=", 0) == 0) {
+            jobs = std::strtol(a.c_str() + 7, nullptr, 10);
+        } else {
+            wanted.insert(a);
+        }
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    std::string root = CPK_INSTALL_ROOT;
+    if (root.empty() || root.back() != '/') {
+        root += '/';
+    }
+    std::vector<CpkInstalledPackage> db;
+    if (!cpk_read_pkg_db(root, db)) {
+        print_message("Failed to read package database " + root + "var/lib/pkg/db", RED);
+        return;
+    }
+    std::vector<PackageAudit> audits;
+    for (const auto& package : db) {
+        if (wanted.empty() || wanted.erase(package.name)) {
+            PackageAudit audit;
+            audit.package = &package;
+            audits.push_back(std::move(audit));
+        }
+    }
+    for (const auto& name : wanted) {
+        print_message("Package not installed: " + name, RED);
+    }
+    if (audits.empty()) {
+        return;
+    }
+    std::sort(audits.begin(), audits.end(), [](const PackageAudit& a, const PackageAudit& b) {
+        return a.package->name < b.package->name;
+    });
+
+    const int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        print_message("Failed to open " + root, RED);
+        return;
+    }
+    const auto users = read_ids(root + "etc/passwd");
+    const auto groups = read_ids(root + "etc/group");
+    // Packages are independent; stats and hashes of one run while others wait on I/O
+    cpk_parallel_for_each(audits, static_cast<size_t>(jobs), [&](PackageAudit& audit) {
+        audit_package(audit, root_fd, hash, users, groups);
+    });
+    close(root_fd);
+
+    size_t files = 0, missing = 0, modified = 0, drifted = 0;
+    std::vector<std::string> no_footprint, no_archive;
+    std::string out;
+    for (const auto& audit : audits) {
+        files += audit.checked;
+        if (!audit.has_footprint) {
+            no_footprint.push_back(audit.package->name);
+        }
+        if (hash && !audit.has_archive) {
+            no_archive.push_back(audit.package->name);
+        }
+        for (const auto& finding : audit.findings) {
+            const char* label = "MISSING   ";
+            if (finding.kind == AuditFinding::Missing) {
+                ++missing;
+            } else if (finding.kind == AuditFinding::Modified) {
+                ++modified;
+                label = "MODIFIED  ";
+            } else {
+                ++drifted;
+                label = "PERMS     ";
+            }
+            out += label + audit.package->name + ": /" + finding.path;
+            out += finding.detail.empty() ? "\n" : " (" + finding.detail + ")\n";
+        }
+    }
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    std::fflush(stdout);
+
+    if (!no_footprint.empty()) {
+        print_message(std::to_string(no_footprint.size()) + " package(s) without a cached port footprint "
+                      "(only checked for missing files)", YELLOW);
+    }
+    if (!no_archive.empty()) {
+        print_message(std::to_string(no_archive.size()) + " package(s) without a cached package archive "
+                      "(contents not hashed)", YELLOW);
+    }
+    if (CPK_VERBOSE) {
+        for (const auto& name : no_footprint) {
+            print_message("  no footprint: " + name);
+        }
+        for (const auto& name : no_archive) {
+            print_message("  no archive: " + name);
+        }
+    }
+    const bool clean = missing + modified + drifted == 0;
+    print_message("Audited " + std::to_string(files) + " file(s) in " + std::to_string(audits.size()) +
+                  " package(s): " + std::to_string(missing) + " missing, " + std::to_string(modified) +
+                  " modified, " + std::to_string(drifted) + " with permission drift", clean ? GREEN : RED);
+}
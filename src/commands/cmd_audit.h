@@ -0,0 +1,9 @@
+#ifndef CMD_AUDIT_H
+#define CMD_AUDIT_H
+
+#include <vector>
+#include <string>
+
+void cmd_audit(const std::vector<std::string>& args);
+
+#endif
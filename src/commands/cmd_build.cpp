@@ -1,52 +1,735 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "../fs_compat.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <string>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// One port of the build plan
+struct BuildPort {
+    std::string name;
+    std::string package;   // .cpk listed in the index
+    std::string pkgver;
+    std::string source;    // extracted port directory; pkgmk runs there
+    bool install = false;  // another port of the plan builds against it
+};
+
+// A strongly connected component of the plan: a single port, or the
+// members of a dependency cycle built one after another
+struct BuildUnit {
+    std::vector<size_t> ports;
+    size_t next = 0;                // member to build next
+    size_t waiting = 0;             // dependency units not finished yet
+    bool blocked = false;           // a dependency unit failed
+    std::vector<size_t> dependents; // units waiting for this one
+};
+
+// What one port's pkgmk runs cost, appended to the build log
+struct BuildStats {
+    double download = 0;      // wall seconds of the -do phase
+    double wall = 0;          // wall seconds of the build itself
+    double user = 0;
+    double sys = 0;
+    long max_rss_kb = 0;
+    unsigned long long output_bytes = 0;  // both phases, from pkgmk.log or the forwarded pipe
+    bool output_known = false;            // output_bytes could be measured
+};
+
+// A pkgmk process in flight
+struct PkgmkRun {
+    size_t unit;
+    bool download;      // the -do phase; the build proper follows it
+    std::chrono::steady_clock::time_point start;
+    int output = -1;    // read end of pkgmk's output when it is forwarded
+    unsigned long long output_bytes = 0;
+};
+
+static void parse_build_flags(const std::vector<std::string>& args, std::vector<std::string>& ports,
+                              bool& with_deps, bool& use_cache, bool& stats, long& jobs) {
+    with_deps = false;
+    use_cache = true;
+    stats = false;
+    jobs = 1;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (a == "--with-deps") {
+            with_deps = true;
+        } else if (a == "--no-cache") {
+            use_cache = false;
+        } else if (a == "--stats") {
+            stats = true;
+        } else if (a == "-j" && i + 1 < args.size()) {
+            jobs = std::strtol(args[++i].c_str(), nullptr, 10);
+        } else if (a.rfind("-j", 0) == 0 && a.size() > 2) {
+            jobs = std::strtol(a.c_str() + 2, nullptr, 10);
+        } else if (a.rfind("--jobs=", 0) == 0) {
+            jobs = std::strtol(a.c_str() + 7, nullptr, 10);
+        } else {
+            ports.push_back(a);
+        }
+    }
+}
+
+// Start "pkgmk <option>" in dir without touching our own working directory.
+// With a log path, output goes there (appended after the first phase) and
+// stdin is /dev/null so concurrent builds never compete for the terminal;
+// otherwise pkgmk keeps the terminal's stdin, as a single build always has,
+// and its output comes back through a pipe in *output for forward_output().
+static pid_t spawn_pkgmk(const std::string& dir, const std::string& option, const std::string& log_path,
+                         bool append, int* output) {
+    const std::string command = CPK_PKGMK_CMD + " " + option;
+    int pipe_fds[2] = {-1, -1};
+    if (log_path.empty() && pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    std::cout << std::flush;
+    const pid_t pid = fork();
+    if (pid != 0) {
+        if (pipe_fds[0] >= 0) {
+            close(pipe_fds[1]);
+            if (pid < 0) {
+                close(pipe_fds[0]);
+            } else {
+                *output = pipe_fds[0];
+            }
+        }
+        return pid;
+    }
+    if (chdir(dir.c_str()) != 0) {
+        _exit(127);
+    }
+    if (pipe_fds[1] >= 0) {
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        dup2(pipe_fds[1], STDERR_FILENO);
+    }
+    if (!log_path.empty()) {
+        const int log = open(log_path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        const int null = open("/dev/null", O_RDONLY);
+        if (log < 0 || null < 0) {
+            _exit(127);
+        }
+        dup2(null, STDIN_FILENO);
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        close(log);
+        close(null);
+    }
+    execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+    _exit(127);
+}
+
+// Copy a single build's output to the terminal until pkgmk closes the pipe;
+// returns the number of bytes seen
+static unsigned long long forward_output(int fd) {
+    unsigned long long total = 0;
+    char buffer[65536];
+    for (;;) {
+        const ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += static_cast<unsigned long long>(n);
+        std::fwrite(buffer, 1, static_cast<size_t>(n), stdout);
+        std::fflush(stdout);
+    }
+    close(fd);
+    return total;
+}
+
+// Ports to build: the requested ones plus, with --with-deps, every dependency
+// in their closure that is not installed yet. Edges point at dependencies;
+// requested ports that depend on each other are ordered with or without it.
+static bool plan_build(const std::vector<std::string>& requested, bool with_deps,
+                       const std::unordered_map<std::string, std::string>& installed,
+                       std::vector<BuildPort>& ports, std::vector<std::vector<size_t>>& edges) {
+    std::unordered_map<std::string, size_t> ids;
+    for (const auto& spec : requested) {
+        BuildPort port;
+        std::string pkgarch;
+        if (!find_package(spec, port.package, port.name, port.pkgver, pkgarch, true)) {
+            return false;
+        }
+        if (ids.emplace(port.name, ports.size()).second) {
+            ports.push_back(port);
+            edges.emplace_back();
+        }
+    }
+    cpk_preload_index_deps_cache();
+    std::vector<std::string> deps;
+    for (size_t id = 0; id < ports.size(); ++id) {
+        if (!lookup_cpkindex_deps_by_port(ports[id].name, deps)) {
+            continue;
+        }
+        for (const auto& dep : deps) {
+            auto it = ids.find(dep);
+            if (it == ids.end()) {
+                if (!with_deps || installed.count(dep)) {
+                    continue;
+                }
+                // Same revision find_package() resolves, so the deps walked
+                // next belong to the package that gets built
+                CpkIndexRevision revision;
+                if (!cpk_index_selected_revision(dep, revision)) {
+                    print_message("Warning: dependency \"" + dep + "\" is not in the package index (skipping)", YELLOW);
+                    continue;
+                }
+                it = ids.emplace(dep, ports.size()).first;
+                BuildPort port;
+                port.name = dep;
+                port.package.assign(revision.package);
+                port.pkgver.assign(revision.version);
+                ports.push_back(port);
+                edges.emplace_back();
+            }
+            edges[id].push_back(it->second);
+            ports[it->second].install = true;
+        }
+    }
+    for (auto& port : ports) {
+        port.source = CPK_HOME_DIR + "/" + port.name + "/" + port.pkgver;
+    }
+    return true;
+}
+
+// Download and extract a port's sources into CPK_HOME_DIR unless present
+static bool fetch_port_source(const BuildPort& port) {
+    if (fs::is_directory(port.source)) {
+        return true;
+    }
+    const std::string package_url = cpk_repo_join(url_encode(port.package));
+    const std::string package_path = CPK_HOME_DIR + "/" + port.package;
+    return download_file(package_url, package_path) && extract_package(package_path, CPK_HOME_DIR);
+}
+
+static bool install_built_port(const BuildPort& port, std::unordered_map<std::string, std::string>& installed) {
+    const std::string package_file = find_pkg_file(port.source, port.name, port.pkgver);
+    if (package_file.empty()) {
+        print_message("Built package file not found for " + port.name, RED);
+        return false;
+    }
+    std::vector<std::string> pkgadd_args = { "-r", CPK_INSTALL_ROOT };
+    if (installed.count(port.name)) {
+        pkgadd_args.push_back("-u");
+    }
+    pkgadd_args.push_back(package_file);
+    std::string pkgadd_output;
+    if (shellcmd(CPK_PKGADD_CMD, pkgadd_args, &pkgadd_output, false) != 0) {
+        print_message("Failed to install " + port.name + ":\n" + pkgadd_output, RED);
+        return false;
+    }
+    installed[port.name] = port.pkgver;
+    return true;
+}
+
+// Build cache: CPK_HOME_DIR/buildcache/<key>/<name#version.pkg.tar.*>
+static std::string build_cache_dir(const std::string& key) {
+    return CPK_HOME_DIR + "/buildcache/" + key;
+}
+
+// What a pkgmk run depends on: the Pkgfile, the footprint, the source
+// checksums (which cover local patches too) and the versions of the port's
+// dependencies installed at the time it starts. Empty when there is no Pkgfile.
+static std::string build_cache_key(const BuildPort& port, const std::unordered_map<std::string, std::string>& installed) {
+    std::string material = "cpk-build 1\n" + port.name + " " + port.pkgver + " " + get_system_architecture() + "\n";
+    for (const char* file : {"Pkgfile", ".footprint", ".signature", ".md5sum"}) {
+        const std::string path = port.source + "/" + file;
+        if (!fs::exists(path)) {
+            if (file == std::string("Pkgfile")) {
+                return "";
+            }
+            continue;
+        }
+        const std::string digest = calculate_sha256(path);
+        if (digest.empty()) {
+            return "";
+        }
+        material += std::string(file) + " " + digest + "\n";
+    }
+    std::vector<std::string> deps;
+    if (lookup_cpkindex_deps_by_port(port.name, deps)) {
+        std::sort(deps.begin(), deps.end());
+        for (const auto& dep : deps) {
+            const auto it = installed.find(dep);
+            material += "dep " + dep + " " + (it == installed.end() ? std::string("-") : it->second) + "\n";
+        }
+    }
+    return sha256_hex(material);
+}
+
+// Copy a cached package into the port directory, where install and the user
+// expect pkgmk's output; false on a miss
+static bool restore_cached_build(const BuildPort& port, const std::string& key) {
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(build_cache_dir(key), ec)) {
+        const std::string file = entry.path().filename().string();
+        if (file.rfind(port.name + "#" + port.pkgver + ".pkg.tar.", 0) != 0) {
+            continue;
+        }
+        fs::copy_file(entry.path(), port.source + "/" + file, fs::copy_options::overwrite_existing, ec);
+        return !ec;
+    }
+    return false;
+}
+
+// Store a fresh build under its key; written to a temporary name and renamed
+// so an interrupted copy is never taken for a hit
+static void store_cached_build(const BuildPort& port, const std::string& key) {
+    const std::string package_file = find_pkg_file(port.source, port.name, port.pkgver);
+    if (package_file.empty()) {
+        return;
+    }
+    const std::string dir = build_cache_dir(key);
+    const std::string target = dir + "/" + fs::path(package_file).filename().string();
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    fs::copy_file(package_file, target + ".part", fs::copy_options::overwrite_existing, ec);
+    if (!ec) {
+        fs::rename(target + ".part", target, ec);
+    }
+    if (ec) {
+        fs::remove(target + ".part", ec);
+        if (CPK_VERBOSE) {
+            print_message("Warning: could not cache the build of " + port.name, YELLOW);
+        }
+    }
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string build_log_path() {
+    return CPK_HOME_DIR + "/CPKBUILD.log";
+}
+
+// One JSON object per pkgmk run; output_bytes only when it could be measured
+static void append_build_log(const BuildPort& port, bool ok, long jobs, const BuildStats& stats) {
+    std::string line = "{\"port\": ";
+    cpk_append_json_string(line, port.name);
+    line += ", \"version\": ";
+    cpk_append_json_string(line, port.pkgver);
+    char numbers[384];
+    std::snprintf(numbers, sizeof(numbers),
+                  ", \"time\": %lld, \"status\": \"%s\", \"jobs\": %ld, \"download\": %.3f, \"wall\": %.3f"
+                  ", \"user\": %.3f, \"sys\": %.3f, \"max_rss_kb\": %ld",
+                  static_cast<long long>(std::time(nullptr)), ok ? "ok" : "failed", jobs, stats.download,
+                  stats.wall, stats.user, stats.sys, stats.max_rss_kb);
+    line += numbers;
+    if (stats.output_known) {
+        line += ", \"output_bytes\": " + std::to_string(stats.output_bytes);
+    }
+    line += "}\n";
+    std::ofstream log(build_log_path(), std::ios::app);
+    log << line;
+}
+
+// Value of "key" in a build log line: the raw number, or the string unquoted
+static bool build_log_field(std::string_view line, std::string_view key, std::string& value) {
+    const std::string needle = "\"" + std::string(key) + "\": ";
+    size_t pos = line.find(needle);
+    if (pos == std::string_view::npos) {
+        return false;
+    }
+    pos += needle.size();
+    value.clear();
+    if (pos < line.size() && line[pos] == '"') {
+        for (++pos; pos < line.size() && line[pos] != '"'; ++pos) {
+            if (line[pos] == '\\' && pos + 1 < line.size()) {
+                ++pos;
+            }
+            value += line[pos];
+        }
+        return true;
+    }
+    const size_t end = line.find_first_of(",}", pos);
+    value.assign(line.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+    return !value.empty();
+}
+
+// cpk build --stats: successful pkgmk runs from the build log averaged per
+// port, slowest first
+static void print_build_stats(size_t limit) {
+    struct PortTotals {
+        size_t runs = 0;
+        double wall = 0, cpu = 0, download = 0, last_wall = 0;
+        long max_rss_kb = 0;
+        unsigned long long output_bytes = 0;
+        bool output_known = false;  // some run logged its output size
+    };
+    std::ifstream log(build_log_path());
+    if (!log.is_open()) {
+        print_message("No builds recorded yet (" + build_log_path() + ")");
+        return;
+    }
+    std::unordered_map<std::string, PortTotals> totals;
+    std::string line, port, status, field;
+    size_t failed_runs = 0;
+    while (std::getline(log, line)) {
+        if (!build_log_field(line, "port", port) || !build_log_field(line, "status", status)) {
+            continue;
+        }
+        if (status != "ok") {
+            ++failed_runs;
+            continue;
+        }
+        PortTotals& t = totals[port];
+        auto number = [&](const char* key) {
+            return build_log_field(line, key, field) ? std::strtod(field.c_str(), nullptr) : 0.0;
+        };
+        ++t.runs;
+        t.last_wall = number("wall");
+        t.wall += t.last_wall;
+        t.cpu += number("user") + number("sys");
+        t.download += number("download");
+        t.max_rss_kb = std::max(t.max_rss_kb, static_cast<long>(number("max_rss_kb")));
+        if (build_log_field(line, "output_bytes", field)) {
+            t.output_bytes = std::strtoull(field.c_str(), nullptr, 10);
+            t.output_known = true;
+        }
+    }
+    if (totals.empty()) {
+        print_message("No successful builds recorded yet");
+        return;
+    }
+
+    std::vector<std::pair<std::string, PortTotals>> rows(totals.begin(), totals.end());
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+        const double wa = a.second.wall / a.second.runs, wb = b.second.wall / b.second.runs;
+        return wa != wb ? wa > wb : a.first < b.first;
+    });
+    if (rows.size() > limit) {
+        rows.resize(limit);
+    }
+    std::string out;
+    char row[256];
+    std::snprintf(row, sizeof(row), "%-32s %5s %10s %10s %10s %10s %10s %10s\n", "PORT", "RUNS", "WALL", "LAST",
+                  "CPU", "MAX RSS", "OUTPUT", "DOWNLOAD");
+    out += row;
+    for (const auto& [name, t] : rows) {
+        std::snprintf(row, sizeof(row), "%-32s %5zu %9.1fs %9.1fs %9.1fs %10s %10s %9.1fs\n", name.c_str(), t.runs,
+                      t.wall / t.runs, t.last_wall, t.cpu / t.runs,
+                      cpk_format_bytes(static_cast<unsigned long long>(t.max_rss_kb) * 1024).c_str(),
+                      t.output_known ? cpk_format_bytes(t.output_bytes).c_str() : "-", t.download / t.runs);
+        out += row;
+    }
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    if (CPK_VERBOSE && failed_runs) {
+        print_message(std::to_string(failed_runs) + " failed run(s) not counted");
+    }
+}
 
 void cmd_build(const std::vector<std::string>& args) {
-    if (args.empty()) {
+    std::vector<std::string> requested;
+    bool with_deps = false;
+    bool use_cache = true;
+    bool show_stats = false;
+    long jobs = 1;
+    parse_build_flags(args, requested, with_deps, use_cache, show_stats, jobs);
+
+    if (show_stats) {
+        // Optional count of ports to list: cpk build --stats 50
+        const long limit = requested.empty() ? 20 : std::strtol(requested[0].c_str(), nullptr, 10);
+        print_build_stats(limit > 0 ? static_cast<size_t>(limit) : 20);
+        return;
+    }
+
+    if (requested.empty()) {
         print_message("Package name is required", RED);
         return;
     }
+    if (jobs < 1) {
+        print_message("-j expects a positive number of jobs", RED);
+        return;
+    }
 
     if (!cpk_is_privileged_process()) {
         print_message("cpk build must be run as root.", RED);
         return;
     }
 
-    std::string package, pkgname, pkgver, pkgarch;
-    if (!find_package(args[0], package, pkgname, pkgver, pkgarch, true)) return;
-
-    std::string package_url = cpk_repo_join(url_encode(package));
-    std::string package_source = CPK_HOME_DIR + "/" + pkgname + "/" + pkgver;
-    std::string package_path = CPK_HOME_DIR + "/" + package;
+    // Installed name -> version: the plan skips installed dependencies and
+    // cache keys record the versions a port is built against
+    std::vector<std::string> pkginfo_args = { "-i" };
+    std::string installed_packages;
+    shellcmd(CPK_PKGINFO_CMD, pkginfo_args, &installed_packages, false);
+    std::unordered_map<std::string, std::string> installed;
+    std::string installed_pkgname, installed_pkgver;
+    std::istringstream installed_stream(installed_packages);
+    while (installed_stream >> installed_pkgname >> installed_pkgver) {
+        installed[installed_pkgname] = installed_pkgver;
+    }
+    std::vector<BuildPort> ports;
+    std::vector<std::vector<size_t>> edges;
+    if (!plan_build(requested, with_deps, installed, ports, edges)) {
+        return;
+    }
 
-    if (!fs::is_directory(package_source)) {
-        if (!download_file(package_url, package_path) || !extract_package(package_path, CPK_HOME_DIR)) {
-            print_message("Failed to retrieve package info", RED);
-            return;
+    // Condense cycles; units come out dependencies first
+    std::vector<size_t> component;
+    const std::vector<std::vector<size_t>> components = cpk_graph_components(edges, component);
+    std::vector<BuildUnit> units(components.size());
+    for (size_t c = 0; c < components.size(); ++c) {
+        units[c].ports = components[c];
+        std::unordered_set<size_t> deps;
+        for (size_t v : components[c]) {
+            for (size_t w : edges[v]) {
+                if (component[w] != c && deps.insert(component[w]).second) {
+                    units[component[w]].dependents.push_back(c);
+                }
+            }
         }
+        units[c].waiting = deps.size();
+        if (components[c].size() > 1) {
+            std::string text = "Warning: dependency cycle:";
+            for (size_t v : components[c]) {
+                text += " " + ports[v].name;
+            }
+            print_message(text + " (building in discovery order)", YELLOW);
+        }
+    }
+    if (CPK_VERBOSE && ports.size() > 1) {
+        print_message("Building " + std::to_string(ports.size()) + " port(s) with up to " + std::to_string(jobs) + " job(s)");
     }
 
-    // Change to the package source directory
-    if (!change_directory(package_source)) {
-        print_message("Failed to change directory to: " + package_source, RED);
-        return;
+    // Sources first, serially: downloads and extraction are not pkgmk's job
+    std::vector<bool> failed(ports.size(), false);
+    for (size_t v = 0; v < ports.size(); ++v) {
+        if (!fetch_port_source(ports[v])) {
+            print_message("Failed to retrieve package info for " + ports[v].name, RED);
+            failed[v] = true;
+        }
     }
 
-    // Build the package
-    std::vector<std::string> pkgmk_args = { "-d" };
-    std::string pkgmk_output;
-    if (CPK_VERBOSE) {
-        print_header("Running '" + CPK_PKGMK_CMD + "' in " + package_source);
+    // Ready-queue scheduler: a unit starts once every unit it depends on has
+    // been built and installed; a failure skips everything that needs it
+    const bool log_to_files = jobs > 1;
+    std::deque<size_t> ready;
+    for (size_t c = 0; c < units.size(); ++c) {
+        if (units[c].waiting == 0) {
+            ready.push_back(c);
+        }
     }
-    int ret = shellcmd(CPK_PKGMK_CMD, pkgmk_args, &pkgmk_output, true);
+    std::unordered_map<pid_t, PkgmkRun> running;
+    size_t built = 0;
+    size_t reused = 0;
+    std::vector<std::string> keys(ports.size());  // build cache key per port, once computed
+    std::vector<BuildStats> stats_of(ports.size());
+    std::vector<std::string> failures;
+    std::vector<std::string> skipped;
 
-    if (ret != 0) {
-        print_message("Failed to build package", RED);
-        return;
+    auto finish_unit = [&](size_t c, bool ok) {
+        std::vector<size_t> stack = {c};
+        std::vector<bool> unit_ok = {ok};
+        while (!stack.empty()) {
+            const size_t u = stack.back();
+            const bool u_ok = unit_ok.back();
+            stack.pop_back();
+            unit_ok.pop_back();
+            for (size_t d : units[u].dependents) {
+                units[d].blocked = units[d].blocked || !u_ok;
+                if (--units[d].waiting > 0) {
+                    continue;
+                }
+                if (units[d].blocked) {
+                    for (size_t v : units[d].ports) {
+                        skipped.push_back(ports[v].name);
+                    }
+                    stack.push_back(d);
+                    unit_ok.push_back(false);
+                } else {
+                    ready.push_back(d);
+                }
+            }
+        }
+    };
+    // A port is done: install it when others build against it, then count it
+    auto complete_port = [&](const BuildPort& port, bool from_cache) {
+        if (port.install && !install_built_port(port, installed)) {
+            return false;
+        }
+        ++built;
+        if (from_cache) {
+            ++reused;
+        }
+        const std::string how = from_cache ? " (cached)" : "";
+        print_message(ports.size() > 1 ? "Built " + port.name + how : "Package built successfully" + how);
+        return true;
+    };
+    // Run one pkgmk phase for the unit's current member: sources (-do), then the build (-d)
+    auto start_phase = [&](size_t c, bool download) {
+        const size_t v = units[c].ports[units[c].next];
+        const std::string log_path = log_to_files ? ports[v].source + "/pkgmk.log" : std::string();
+        PkgmkRun run{c, download, std::chrono::steady_clock::now()};
+        const pid_t pid = spawn_pkgmk(ports[v].source, download ? "-do" : "-d", log_path, !download, &run.output);
+        if (pid < 0) {
+            print_message("Failed to start " + CPK_PKGMK_CMD + " for " + ports[v].name, RED);
+            failed[v] = true;
+            return false;
+        }
+        running.emplace(pid, run);
+        return true;
+    };
+    // Start the next member of a unit, taking members found in the build
+    // cache as built on the way; Started while pkgmk runs for one
+    enum class Step { Started, Done, Failed };
+    auto start_next = [&](size_t c) {
+        BuildUnit& unit = units[c];
+        while (unit.next < unit.ports.size()) {
+            const size_t v = unit.ports[unit.next];
+            const BuildPort& port = ports[v];
+            if (failed[v]) {
+                return Step::Failed;
+            }
+            keys[v] = build_cache_key(port, installed);
+            if (use_cache && !keys[v].empty() && restore_cached_build(port, keys[v])) {
+                if (CPK_VERBOSE) {
+                    print_message("Reusing cached build of " + port.name + " (" + keys[v].substr(0, 12) + ")");
+                }
+                if (!complete_port(port, true)) {
+                    return Step::Failed;
+                }
+                ++unit.next;
+                continue;
+            }
+            const std::string log_path = log_to_files ? port.source + "/pkgmk.log" : std::string();
+            if (log_to_files || CPK_VERBOSE) {
+                print_message("Building " + port.name + (log_to_files ? " (log: " + log_path + ")" : std::string()));
+            }
+            if (CPK_VERBOSE) {
+                print_header("Running '" + CPK_PKGMK_CMD + "' in " + port.source);
+            }
+            return start_phase(c, true) ? Step::Started : Step::Failed;
+        }
+        return Step::Done;
+    };
+    auto fail_unit = [&](size_t c) {
+        for (size_t i = units[c].next; i < units[c].ports.size(); ++i) {
+            (i == units[c].next ? failures : skipped).push_back(ports[units[c].ports[i]].name);
+        }
+        finish_unit(c, false);
+    };
+    auto advance = [&](size_t c) {
+        const Step step = start_next(c);
+        if (step == Step::Done) {
+            finish_unit(c, true);
+        } else if (step == Step::Failed) {
+            fail_unit(c);
+        }
+    };
+
+    while (!ready.empty() || !running.empty()) {
+        while (!ready.empty() && running.size() < static_cast<size_t>(jobs)) {
+            const size_t c = ready.front();
+            ready.pop_front();
+            advance(c);
+        }
+        if (running.empty()) {
+            continue;
+        }
+        // Only a single job forwards its output, so draining it here blocks nothing else
+        for (auto& entry : running) {
+            if (entry.second.output >= 0) {
+                entry.second.output_bytes = forward_output(entry.second.output);
+                entry.second.output = -1;
+            }
+        }
+        int status = 0;
+        struct rusage usage = {};
+        const pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0) {
+            break;
+        }
+        const auto it = running.find(pid);
+        if (it == running.end()) {
+            continue;
+        }
+        const PkgmkRun run = it->second;
+        running.erase(it);
+        const size_t c = run.unit;
+        BuildUnit& unit = units[c];
+        const size_t v = unit.ports[unit.next];
+        const BuildPort& port = ports[v];
+        BuildStats& stats = stats_of[v];
+        const bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (run.download) {
+            stats = BuildStats();
+            stats.download = seconds_since(run.start);
+            stats.output_bytes = run.output_bytes;
+            if (ok) {
+                if (!start_phase(c, false)) {
+                    fail_unit(c);
+                }
+                continue;
+            }
+        } else {
+            stats.wall = seconds_since(run.start);
+            stats.user = static_cast<double>(usage.ru_utime.tv_sec) + usage.ru_utime.tv_usec / 1e6;
+            stats.sys = static_cast<double>(usage.ru_stime.tv_sec) + usage.ru_stime.tv_usec / 1e6;
+            stats.max_rss_kb = usage.ru_maxrss;
+            stats.output_bytes += run.output_bytes;
+        }
+        if (log_to_files) {
+            std::error_code ec;
+            const auto size = fs::file_size(port.source + "/pkgmk.log", ec);
+            stats.output_bytes = ec ? 0 : static_cast<unsigned long long>(size);
+            stats.output_known = !ec;
+        } else {
+            stats.output_known = true;
+        }
+        append_build_log(port, ok, jobs, stats);
+        if (!ok) {
+            print_message("Failed to " + std::string(run.download ? "download sources for " : "build package ") +
+                          port.name + (log_to_files ? " (see " + port.source + "/pkgmk.log)" : std::string()), RED);
+            fail_unit(c);
+            continue;
+        }
+        if (CPK_VERBOSE) {
+            char line[160];
+            std::snprintf(line, sizeof(line), "%.1fs wall, %.1fs user, %.1fs sys, %s max RSS, sources %.1fs",
+                          stats.wall, stats.user, stats.sys,
+                          cpk_format_bytes(static_cast<unsigned long long>(stats.max_rss_kb) * 1024).c_str(),
+                          stats.download);
+            print_message("  " + port.name + ": " + line);
+        }
+        if (!keys[v].empty()) {
+            store_cached_build(port, keys[v]);
+        }
+        if (!complete_port(port, false)) {
+            fail_unit(c);
+            continue;
+        }
+        // Next member of a cycle keeps this unit's job slot
+        ++unit.next;
+        advance(c);
     }
 
-    print_message("Package built successfully");
+    if (ports.size() > 1) {
+        print_message("Built " + std::to_string(built) + " of " + std::to_string(ports.size()) + " port(s)" +
+                      (reused ? " (" + std::to_string(reused) + " from cache)" : std::string()),
+                      built == ports.size() ? GREEN : YELLOW);
+        for (const auto& name : failures) {
+            print_message("  failed: " + name, RED);
+        }
+        for (const auto& name : skipped) {
+            print_message("  skipped (dependency failed): " + name, YELLOW);
+        }
+    }
 }
@@ -4,7 +4,7 @@
 
 void cmd_clean(const std::vector<std::string>& args) {
 
-    // As root: clean system cpk home except CPKINDEX; otherwise clean user cache only.
+    // As root: clean system cpk home except the index files (CPKINDEX, CPKINDEX.arch, CPKPACK.idx, CPKDESC, CPKSEARCH.idx, CPKCLOSURE.idx) and the build log; otherwise clean user cache only.
     std::string cache_dir = cpk_is_privileged_process() ? CPK_HOME_DIR : get_cache_dir();
 
     if (CPK_VERBOSE) {
@@ -14,7 +14,9 @@ void cmd_clean(const std::vector<std::string>& args) {
     if (fs::exists(cache_dir) && fs::is_directory(cache_dir)) {
         // Iterate over directory contents and remove them
         for (const auto& entry : fs::directory_iterator(cache_dir)) {
-            if (entry.path().filename() == "CPKINDEX") {
+            const std::string name = entry.path().filename().string();
+            if (name == "CPKINDEX" || name == "CPKINDEX.arch" || name == "CPKPACK.idx" || name == "CPKDESC" ||
+                name == "CPKSEARCH.idx" || name == "CPKCLOSURE.idx" || name == "CPKBUILD.log") {
                 continue;
             }
             fs::remove_all(entry);
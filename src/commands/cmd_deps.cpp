@@ -1,16 +1,164 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "cmd_info.h"
+#include <algorithm>
+#include <cstdio>
+#include <unordered_set>
 #include <vector>
 #include <string>
 
+// Transitive dependencies of a port (never the port itself) walked over the
+// in-memory index, for when the closure cache is not available (very large indexes)
+static std::vector<std::string> walk_closure(const std::string& port) {
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> queue;
+    std::vector<std::string> deps;
+    if (lookup_cpkindex_deps_by_port(port, deps)) {
+        queue = deps;
+    }
+    std::vector<std::string> closure;
+    while (!queue.empty()) {
+        std::string name = std::move(queue.back());
+        queue.pop_back();
+        if (!seen.insert(name).second) {
+            continue;
+        }
+        if (lookup_cpkindex_deps_by_port(name, deps)) {
+            queue.insert(queue.end(), deps.begin(), deps.end());
+        }
+        if (name != port) {
+            closure.push_back(std::move(name));
+        }
+    }
+    std::sort(closure.begin(), closure.end());
+    return closure;
+}
+
+static bool known_port(const std::string& port) {
+    std::vector<std::string> deps;
+    if (lookup_cpkindex_deps_by_port(port, deps)) {
+        return true;
+    }
+    print_message("Package not in index: " + port, RED);
+    cpk_print_did_you_mean(port);
+    return false;
+}
+
 void cmd_deps(const std::vector<std::string>& args) {
-    if (args.empty()) {
+    bool recursive = false;
+    bool missing = false;
+    std::string depends_on;
+    std::vector<std::string> packages;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--recursive") {
+            recursive = true;
+        } else if (args[i] == "--missing") {
+            missing = true;
+        } else if (args[i] == "--depends-on") {
+            if (i + 1 == args.size()) {
+                print_message("Usage: cpk deps --depends-on <dependency> <package>...", YELLOW);
+                return;
+            }
+            depends_on = args[++i];
+        } else {
+            packages.push_back(args[i]);
+        }
+    }
+    if (packages.empty()) {
         print_message("Package name is required", RED);
         return;
     }
-    
-    // Call cmd_info with --dependencies flag
-    std::vector<std::string> info_args = {args[0], "--dependencies"};
-    cmd_info(info_args);
+
+    if (!recursive && depends_on.empty()) {
+        if (missing) {
+            print_message("--missing requires --recursive", RED);
+            return;
+        }
+        // Call cmd_info with --dependencies flag
+        std::vector<std::string> info_args = {packages[0], "--dependencies"};
+        cmd_info(info_args);
+        return;
+    }
+
+    cpk_preload_index_deps_cache();
+    std::vector<std::string> ports;
+    for (const auto& package : packages) {
+        if (known_port(package)) {
+            ports.push_back(package);
+        }
+    }
+    if (ports.empty()) {
+        return;
+    }
+    CpkClosureIndex index;
+    const bool cached = index.open();
+
+    // "Does A depend on B" for each named package
+    if (!depends_on.empty()) {
+        size_t dep_id = 0;
+        const bool dep_known = cached && index.find(depends_on, dep_id);
+        for (const auto& port : ports) {
+            bool depends = false;
+            size_t id;
+            if (cached) {
+                depends = dep_known && index.find(port, id) && index.depends_on(id, dep_id);
+            } else {
+                const std::vector<std::string> closure = walk_closure(port);
+                depends = std::binary_search(closure.begin(), closure.end(), depends_on);
+            }
+            print_message(port + (depends ? " depends on " : " does not depend on ") + depends_on);
+        }
+        return;
+    }
+
+    // Union of the closures (minus installed packages with --missing), sorted
+    std::unordered_set<std::string> installed;
+    if (missing) {
+        for (const auto& p : get_installed_packages()) {
+            installed.insert(p);
+        }
+    }
+    std::string out;
+    if (cached) {
+        std::vector<uint64_t> all(index.words, 0);
+        std::vector<uint64_t> bits;
+        size_t id;
+        for (const auto& port : ports) {
+            if (index.find(port, id)) {
+                index.closure(id, bits);
+                for (size_t i = 0; i < bits.size(); ++i) {
+                    all[i] |= bits[i];
+                }
+            }
+        }
+        if (missing) {
+            const std::vector<uint64_t> drop = index.name_set(std::vector<std::string>(installed.begin(), installed.end()));
+            for (size_t i = 0; i < all.size(); ++i) {
+                all[i] &= ~drop[i];
+            }
+        }
+        for (size_t i = 0; i < all.size(); ++i) {
+            uint64_t word = all[i];
+            while (word) {
+                const size_t v = i * 64 + static_cast<size_t>(__builtin_ctzll(word));
+                word &= word - 1;
+                out.append(index.name(v)).append(1, '\n');
+            }
+        }
+    } else {
+        std::vector<std::string> all;
+        for (const auto& port : ports) {
+            const std::vector<std::string> closure = walk_closure(port);
+            all.insert(all.end(), closure.begin(), closure.end());
+        }
+        std::sort(all.begin(), all.end());
+        all.erase(std::unique(all.begin(), all.end()), all.end());
+        for (const auto& name : all) {
+            if (!missing || !installed.count(name)) {
+                out.append(name).append(1, '\n');
+            }
+        }
+    }
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    std::fflush(stdout);
 }
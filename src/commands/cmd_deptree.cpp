@@ -1,65 +1,284 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "cmd_deptree.h"
-#include <iostream>
-#include <set>
-#include <sstream>
+#include <cstdint>
+#include <cstdio>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
-static void deptree_format_line(const std::string& mark, int depth, const std::string& pkg,
-                                bool cycle, std::ostringstream& out) {
-    out << mark << ' ' << std::string(static_cast<std::size_t>(2 * depth), ' ') << pkg;
-    if (cycle) {
-        out << " -->";
+// Dependency closure of the root (node 0); edges point from a package to its
+// dependencies, names missing from the index are unresolved leaves
+struct DeptreeGraph {
+    std::vector<std::string> nodes;
+    std::vector<std::vector<size_t>> edges;
+    std::vector<bool> resolved;
+    std::vector<bool> installed;
+    std::vector<size_t> closure;            // distinct packages reachable from the node
+    std::vector<size_t> closure_installed;  // of those, how many are installed
+};
+
+static bool deptree_build_graph(const std::string& root, const std::unordered_set<std::string>& installed,
+                                DeptreeGraph& graph) {
+    std::unordered_map<std::string, size_t> node_ids;
+    auto node_id = [&](const std::string& name) {
+        const auto it = node_ids.find(name);
+        if (it != node_ids.end()) {
+            return it->second;
+        }
+        node_ids.emplace(name, graph.nodes.size());
+        graph.nodes.push_back(name);
+        graph.edges.emplace_back();
+        graph.resolved.push_back(true);
+        graph.installed.push_back(installed.count(name) > 0);
+        return graph.nodes.size() - 1;
+    };
+
+    // The root may be a .cpk path or name#version; dependencies are port names,
+    // so everything below it is a hash probe into the in-memory index
+    node_id(root);
+    std::vector<std::string> deps;
+    if (!get_package_dependency_names(root, deps)) {
+        return false;
     }
-    out << '\n';
+    for (size_t id = 0; id < graph.nodes.size(); ++id) {
+        if (id > 0 && !lookup_cpkindex_deps_by_port(graph.nodes[id], deps)) {
+            graph.resolved[id] = false;
+            continue;
+        }
+        for (const auto& dep : deps) {
+            const size_t dep_id = node_id(dep);
+            graph.edges[id].push_back(dep_id);
+        }
+    }
+    return true;
 }
 
-static void deptree_walk(const std::string& pkg, int depth, std::set<std::string>& expanded,
-                         const std::unordered_set<std::string>& installed, std::ostringstream& out) {
-    const std::string mark = installed.count(pkg) > 0 ? "[i]" : "[ ]";
+// Closure sizes from the cached per-port bitsets; false unless every node of
+// the graph is a port (or dependency name) of the index, as for a plain port root
+static bool deptree_count_closures_cached(DeptreeGraph& graph, const std::unordered_set<std::string>& installed) {
+    CpkClosureIndex index;
+    if (!index.open()) {
+        return false;
+    }
+    std::vector<size_t> ids(graph.nodes.size());
+    for (size_t v = 0; v < graph.nodes.size(); ++v) {
+        if (!index.find(graph.nodes[v], ids[v])) {
+            return false;
+        }
+    }
+    const std::vector<uint64_t> installed_bits = index.name_set(std::vector<std::string>(installed.begin(), installed.end()));
+    graph.closure.assign(graph.nodes.size(), 0);
+    graph.closure_installed.assign(graph.nodes.size(), 0);
+    std::vector<uint64_t> bits;
+    for (size_t v = 0; v < graph.nodes.size(); ++v) {
+        index.closure(ids[v], bits);
+        for (size_t i = 0; i < bits.size(); ++i) {
+            graph.closure[v] += static_cast<size_t>(__builtin_popcountll(bits[i]));
+            graph.closure_installed[v] += static_cast<size_t>(__builtin_popcountll(bits[i] & installed_bits[i]));
+        }
+    }
+    return true;
+}
 
-    if (expanded.count(pkg)) {
-        deptree_format_line(mark, depth, pkg, true, out);
-        return;
+// Closure sizes of the graph itself (roots given as name#version or .cpk
+// path), memoized per strongly connected component
+static void deptree_count_closures(DeptreeGraph& graph) {
+    const size_t n = graph.nodes.size();
+    const size_t words = (n + 63) / 64;
+    std::vector<uint64_t> installed_bits(words, 0);
+    for (size_t v = 0; v < n; ++v) {
+        if (graph.installed[v]) {
+            installed_bits[v / 64] |= uint64_t(1) << (v % 64);
+        }
     }
+    graph.closure.assign(n, 0);
+    graph.closure_installed.assign(n, 0);
+    std::vector<size_t> component;
+    const std::vector<std::vector<size_t>> components = cpk_graph_components(graph.edges, component);
+    cpk_for_each_component_closure(graph.edges, components, component, [&](size_t c, const std::vector<uint64_t>& bits) {
+        size_t total = 0;
+        size_t total_installed = 0;
+        for (size_t i = 0; i < words; ++i) {
+            total += static_cast<size_t>(__builtin_popcountll(bits[i]));
+            total_installed += static_cast<size_t>(__builtin_popcountll(bits[i] & installed_bits[i]));
+        }
+        for (size_t v : components[c]) {
+            // A package is not part of its own closure, even inside a cycle
+            const bool self = (bits[v / 64] >> (v % 64)) & 1;
+            graph.closure[v] = total - (self ? 1 : 0);
+            graph.closure_installed[v] = total_installed - (self && graph.installed[v] ? 1 : 0);
+        }
+    });
+}
 
-    expanded.insert(pkg);
-    deptree_format_line(mark, depth, pkg, false, out);
+// Write out once it grows past a few pages so large trees stream
+static void deptree_flush(std::string& out, bool force = false) {
+    if (force || out.size() >= 64 * 1024) {
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+}
 
-    std::vector<std::string> deps;
-    if (!get_package_dependency_names(pkg, deps)) {
-        return;
+// "12 deps, 9 installed"
+static std::string deptree_closure_counts(const DeptreeGraph& graph, size_t v) {
+    return std::to_string(graph.closure[v]) + (graph.closure[v] == 1 ? " dep, " : " deps, ") +
+           std::to_string(graph.closure_installed[v]) + " installed";
+}
+
+// prt-get style tree: depth-first with an explicit stack, each package expanded once
+static void deptree_print_text(const DeptreeGraph& graph) {
+    std::string out = "-- dependencies ([i] = installed, '-->' = seen before, (n deps, m installed) = whole subtree)\n";
+    std::vector<bool> expanded(graph.nodes.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack;  // (node, next edge); depth is the stack size
+    auto emit = [&](size_t v) {
+        out += graph.installed[v] ? "[i] " : "[ ] ";
+        out.append(2 * stack.size(), ' ');
+        out += graph.nodes[v];
+        if (expanded[v]) {
+            out += " -->\n";
+            return false;
+        }
+        expanded[v] = true;
+        if (graph.closure[v]) {
+            out += " (" + deptree_closure_counts(graph, v) + ")";
+        }
+        out += '\n';
+        deptree_flush(out);
+        return true;
+    };
+    emit(0);
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+        const size_t v = stack.back().first;
+        size_t& edge = stack.back().second;
+        if (edge == graph.edges[v].size()) {
+            stack.pop_back();
+            continue;
+        }
+        const size_t w = graph.edges[v][edge++];
+        if (emit(w)) {
+            stack.emplace_back(w, 0);
+        }
+    }
+    deptree_flush(out, true);
+}
+
+static void deptree_print_dot(const DeptreeGraph& graph) {
+    std::string out = "digraph ";
+    cpk_append_json_string(out, graph.nodes[0]);
+    out += " {\n  node [shape=box];\n";
+    for (size_t v = 0; v < graph.nodes.size(); ++v) {
+        out += "  ";
+        cpk_append_json_string(out, graph.nodes[v]);
+        out += " [label=";
+        cpk_append_json_string(out, graph.nodes[v]);
+        if (graph.closure[v]) {
+            // Second label line (DOT's \n escape) inside the quoted string
+            out.pop_back();
+            out += "\\n" + deptree_closure_counts(graph, v) + "\"";
+        }
+        if (graph.installed[v]) {
+            out += ", style=filled, fillcolor=lightgrey";
+        } else if (!graph.resolved[v]) {
+            out += ", style=dashed";
+        }
+        out += "];\n";
+        for (size_t w : graph.edges[v]) {
+            out += "  ";
+            cpk_append_json_string(out, graph.nodes[v]);
+            out += " -> ";
+            cpk_append_json_string(out, graph.nodes[w]);
+            out += ";\n";
+        }
+        deptree_flush(out);
     }
-    for (const auto& d : deps) {
-        deptree_walk(d, depth + 1, expanded, installed, out);
+    out += "}\n";
+    deptree_flush(out, true);
+}
+
+static void deptree_print_json(const DeptreeGraph& graph) {
+    std::string out = "{\"root\": ";
+    cpk_append_json_string(out, graph.nodes[0]);
+    out += ", \"packages\": [";
+    for (size_t v = 0; v < graph.nodes.size(); ++v) {
+        out += v ? ",\n {\"name\": " : "\n {\"name\": ";
+        cpk_append_json_string(out, graph.nodes[v]);
+        out += ", \"installed\": ";
+        out += graph.installed[v] ? "true" : "false";
+        out += ", \"in_index\": ";
+        out += graph.resolved[v] ? "true" : "false";
+        out += ", \"closure\": " + std::to_string(graph.closure[v]);
+        out += ", \"closure_installed\": " + std::to_string(graph.closure_installed[v]);
+        out += ", \"depends\": [";
+        for (size_t i = 0; i < graph.edges[v].size(); ++i) {
+            if (i) {
+                out += ", ";
+            }
+            cpk_append_json_string(out, graph.nodes[graph.edges[v][i]]);
+        }
+        out += "]}";
+        deptree_flush(out);
     }
+    out += "\n]}\n";
+    deptree_flush(out, true);
 }
 
 void cmd_deptree(const std::vector<std::string>& args) {
-    if (args.empty()) {
+    std::string format = "text";
+    std::vector<std::string> positional;
+    for (const auto& a : args) {
+        if (a.rfind("--format=", 0) == 0) {
+            format = a.substr(9);
+        } else {
+            positional.push_back(a);
+        }
+    }
+    if (format != "text" && format != "dot" && format != "json") {
+        print_message("Unknown format: " + format + " (use text, dot or json)", RED);
+        return;
+    }
+    if (positional.empty()) {
         print_message("Package name is required", RED);
         return;
     }
 
-    const std::string& root = args[0];
+    const std::string& root = positional[0];
     cpk_preload_index_deps_cache();
 
-    std::vector<std::string> probe;
-    if (!get_package_dependency_names(root, probe)) {
-        return;
-    }
-
     std::unordered_set<std::string> installed;
     for (const auto& p : get_installed_packages()) {
         installed.insert(p);
     }
+    // A local .cpk root counts as installed when its port is
+    std::string root_name = root, pkgver, pkgarch;
+    if (fs::exists(root) && fs::is_regular_file(root)) {
+        parse_cpk_filename(root, root_name, pkgver, pkgarch);
+    }
+    root_name = root_name.substr(0, root_name.find('#'));
+    if (installed.count(root_name)) {
+        installed.insert(root);
+    }
+
+    DeptreeGraph graph;
+    if (!deptree_build_graph(root, installed, graph)) {
+        return;
+    }
+    if (!deptree_count_closures_cached(graph, installed)) {
+        deptree_count_closures(graph);
+    }
 
-    std::ostringstream tree;
-    tree << "-- dependencies ([i] = installed, '-->' = seen before)\n";
-    std::set<std::string> expanded;
-    deptree_walk(root, 0, expanded, installed, tree);
-    std::cout << tree.str();
+    if (format == "dot") {
+        deptree_print_dot(graph);
+    } else if (format == "json") {
+        deptree_print_json(graph);
+    } else {
+        for (size_t v = 1; v < graph.nodes.size(); ++v) {
+            if (!graph.resolved[v]) {
+                print_message("Warning: dependency \"" + graph.nodes[v] + "\" is not in the package index", YELLOW);
+            }
+        }
+        deptree_print_text(graph);
+    }
 }
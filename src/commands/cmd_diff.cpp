@@ -1,42 +1,130 @@
 #include "../cpk.h"
 #include "../utils.h"
-#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <string_view>
 #include <vector>
 #include <string>
 
+// One side of the join; views point into the pkginfo output or the loaded index
+struct DiffEntry {
+    std::string_view name;
+    std::string_view version;
+};
+
+struct DiffRow {
+    std::string_view name;
+    std::string_view installed;
+    std::string_view available;
+};
+
 void cmd_diff(const std::vector<std::string>& args) {
+    bool json = false;
+    bool tsv = false;
+    for (const auto& a : args) {
+        if (a == "--json") {
+            json = true;
+        } else if (a == "--tsv") {
+            tsv = true;
+        } else {
+            print_message("Unknown option: " + a, RED);
+            return;
+        }
+    }
+    if (json && tsv) {
+        print_message("--json and --tsv cannot be combined", RED);
+        return;
+    }
+
     // Get installed packages
     std::vector<std::string> pkginfo_args = { "-i" };
     std::string installed_packages;
     shellcmd(CPK_PKGINFO_CMD, pkginfo_args, &installed_packages, false);
 
-    // Compare and display differences
-    std::istringstream installed_stream(installed_packages);
-    std::string diff_packages;
-    bool found_difference = false;
-
-    // Read installed packages line by line and split into name & version
-    std::string installed_pkgname, installed_pkgver;
-    std::string package, pkgname, pkgver, pkgarch;
-    while (installed_stream >> installed_pkgname >> installed_pkgver) {
-        if (find_package(installed_pkgname, package, pkgname, pkgver, pkgarch)) {
-            if (installed_pkgname == pkgname && installed_pkgver != pkgver) {
-                found_difference = true;
-                diff_packages += installed_pkgname + " " + installed_pkgver + " " + pkgver + "\n";
+    // "name version" per line
+    std::vector<DiffEntry> installed;
+    const std::string_view installed_text(installed_packages);
+    size_t pos = 0;
+    while (pos < installed_text.size()) {
+        size_t end = installed_text.find('\n', pos);
+        if (end == std::string_view::npos) {
+            end = installed_text.size();
+        }
+        const std::string_view line = installed_text.substr(pos, end - pos);
+        const size_t name_end = line.find_first_of(" \t");
+        if (name_end != std::string_view::npos && name_end > 0) {
+            const size_t ver_start = line.find_first_not_of(" \t", name_end);
+            if (ver_start != std::string_view::npos) {
+                const size_t ver_end = line.find_first_of(" \t\r", ver_start);
+                installed.push_back({line.substr(0, name_end), line.substr(ver_start, ver_end - ver_start)});
             }
         }
+        pos = end + 1;
     }
 
-    if (!found_difference) {
-        print_message("No differences found", GREEN);
+    // Each port's revision as find_package() resolves it
+    std::vector<std::pair<std::string_view, CpkIndexRevision>> selected;
+    if (!cpk_index_selected_revisions(selected)) {
+        cpk_print_missing_index_error();
+        return;
+    }
+    std::vector<DiffEntry> available;
+    available.reserve(selected.size());
+    for (const auto& entry : selected) {
+        available.push_back({entry.first, entry.second.version});
     }
-    else {
+
+    // Sort both sides by name and merge-join
+    auto by_name = [](const DiffEntry& a, const DiffEntry& b) {
+        return a.name < b.name;
+    };
+    std::sort(installed.begin(), installed.end(), by_name);
+    std::sort(available.begin(), available.end(), by_name);
+    std::vector<DiffRow> rows;
+    size_t j = 0;
+    for (const auto& inst : installed) {
+        while (j < available.size() && available[j].name < inst.name) {
+            ++j;
+        }
+        if (j < available.size() && available[j].name == inst.name && available[j].version != inst.version) {
+            rows.push_back({inst.name, inst.version, available[j].version});
+        }
+    }
+
+    std::string out;
+    if (json) {
+        out += '[';
+        for (size_t i = 0; i < rows.size(); ++i) {
+            out += i ? ",\n {\"package\": " : "\n {\"package\": ";
+            cpk_append_json_string(out, rows[i].name);
+            out += ", \"installed\": ";
+            cpk_append_json_string(out, rows[i].installed);
+            out += ", \"available\": ";
+            cpk_append_json_string(out, rows[i].available);
+            out += '}';
+        }
+        out += rows.empty() ? "]\n" : "\n]\n";
+    } else if (tsv) {
+        out += "package\tinstalled\tavailable\n";
+        for (const auto& row : rows) {
+            out.append(row.name).append(1, '\t').append(row.installed).append(1, '\t').append(row.available).append(1, '\n');
+        }
+    } else if (rows.empty()) {
+        print_message("No differences found", GREEN);
+        return;
+    } else {
         if (CPK_VERBOSE) {
             print_header("Differences between installed and available packages", BLUE);
         }
         print_fmt_header("Package Installed Available");
-        print_fmt_lines(diff_packages);
+        for (const auto& row : rows) {
+            out.append(row.name).append(1, ' ').append(row.installed).append(1, ' ').append(row.available).append(1, '\n');
+        }
+        print_fmt_lines(out);
+        return;
     }
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    std::fflush(stdout);
 
     return;
 }
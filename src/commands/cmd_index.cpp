@@ -1,12 +1,42 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "../fs_compat.h"
+#include <stdexcept>
 
 void cmd_index(const std::vector<std::string>& args) {
-    if (args.size() != 1) {
+    std::vector<std::string> positional;
+    bool pack = false;
+    int keep = 0;
+    fs::path attic_dir;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (a == "--pack") {
+            pack = true;
+        } else if (a == "--keep" && i + 1 < args.size()) {
+            try {
+                keep = std::stoi(args[++i]);
+            } catch (const std::exception& e) {
+                keep = -1;
+            }
+            if (keep < 1) {
+                print_message("--keep requires a positive number", RED);
+                return;
+            }
+        } else if (a == "--attic" && i + 1 < args.size()) {
+            attic_dir = args[++i];
+        } else {
+            positional.push_back(a);
+        }
+    }
+    if (positional.size() != 1) {
+        print_message("Usage: cpk index [--pack] [--keep N [--attic <dir>]] <repo>", YELLOW);
+        return;
+    }
+    if (!attic_dir.empty() && keep == 0) {
+        print_message("--attic requires --keep", RED);
         return;
     }
-    fs::path repo_dir = args[0];
+    fs::path repo_dir = positional[0];
     if (!fs::is_directory(repo_dir)) {
         print_message("Directory does not exist: " + repo_dir.string(), RED);
         return;
@@ -14,7 +44,14 @@ void cmd_index(const std::vector<std::string>& args) {
     if (CPK_VERBOSE) {
         print_header("Updating index of local repository", BLUE);
     }
-    generate_cpk_index(repo_dir);
+    generate_cpk_index(repo_dir, keep, attic_dir);
     print_message("Generated CPKINDEX in " + repo_dir.string(), GREEN);
+    if (pack) {
+        if (!generate_cpk_pack(repo_dir)) {
+            print_message("Failed to generate CPKPACK in " + repo_dir.string(), RED);
+            return;
+        }
+        print_message("Generated CPKPACK in " + repo_dir.string(), GREEN);
+    }
     return;
 }
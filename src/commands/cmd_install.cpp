@@ -1,109 +1,88 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "../fs_compat.h"
+#include "cmd_install.h"
+#include <fstream>
 #include <vector>
 #include <string>
-#include <set>
+#include <unordered_map>
+#include <unordered_set>
 
 static void parse_install_flags(const std::vector<std::string>& args,
                                 std::vector<std::string>& positional,
                                 bool& upgrade,
-                                bool& no_deps) {
+                                bool& no_deps,
+                                bool& dry_run) {
     upgrade = false;
     no_deps = false;
+    dry_run = false;
     positional.clear();
     for (const auto& a : args) {
         if (a == "--upgrade") {
             upgrade = true;
         } else if (a == "--no-deps") {
             no_deps = true;
+        } else if (a == "--dry-run") {
+            dry_run = true;
+        } else if (a == "--native") {
+            CPK_NATIVE_INSTALL = true;
         } else {
             positional.push_back(a);
         }
     }
 }
 
-static bool spec_resolves_installed(const std::string& spec) {
+// Port name a plan spec installs as (name, name#version-release or .cpk path)
+static std::string spec_pkgname(const std::string& spec) {
     if (fs::exists(spec) && fs::is_regular_file(spec)) {
         std::string pn, pv, pa;
-        if (!parse_cpk_filename(spec, pn, pv, pa)) {
-            return false;
-        }
-        return is_package_installed(pn);
-    }
-    std::string package, pkgname, pkgver, pkgarch;
-    if (!find_package(spec, package, pkgname, pkgver, pkgarch)) {
-        return false;
+        return parse_cpk_filename(spec, pn, pv, pa) ? pn : std::string();
     }
-    return is_package_installed(pkgname);
+    return spec.substr(0, spec.find('#'));
 }
 
-static bool visit_for_plan(const std::string& spec,
-                           std::vector<std::string>& plan,
-                           std::set<std::string>& visit_stack,
-                           std::set<std::string>& done,
-                           bool allow_skip_missing_index_dep) {
-    if (done.count(spec)) {
-        return true;
-    }
-    if (visit_stack.count(spec)) {
-        return true;
+// Pull every repository package of the plan that is not cached yet from the
+// repository pack in one request; anything it cannot serve is downloaded
+// per package by install_package_spec() as before.
+static void prefetch_from_pack(const std::vector<std::string>& specs) {
+    if (!cpk_file_readable(get_cpkpack_index_path())) {
+        return;
     }
-    visit_stack.insert(spec);
-
-    // Local .cpk: resolve deps from the archive only (find_package would fail on path).
-    if (fs::exists(spec) && fs::is_regular_file(spec)) {
-        std::vector<std::string> deps;
-        if (!get_package_dependency_names(spec, deps)) {
-            visit_stack.erase(spec);
-            return false;
+    std::vector<std::string> missing;
+    for (const auto& spec : specs) {
+        if (fs::exists(spec) && fs::is_regular_file(spec)) {
+            continue;
         }
-        for (const auto& d : deps) {
-            if (!visit_for_plan(d, plan, visit_stack, done, true)) {
-                visit_stack.erase(spec);
-                return false;
-            }
+        std::string package, pkgname, pkgver, pkgarch;
+        if (!find_package(spec, package, pkgname, pkgver, pkgarch)) {
+            continue;
         }
-        visit_stack.erase(spec);
-        done.insert(spec);
-        plan.push_back(spec);
-        return true;
-    }
-
-    // Names in Depends-on lines are not always literal CPKINDEX ports (e.g. CRUX virtual "db").
-    // Transitive deps may be skipped with a warning; the root spec must exist in the index.
-    std::string package_dummy, pkgname_dummy, pkgver_dummy, pkgarch_dummy;
-    if (!find_package(spec, package_dummy, pkgname_dummy, pkgver_dummy, pkgarch_dummy, !allow_skip_missing_index_dep)) {
-        if (!allow_skip_missing_index_dep) {
-            visit_stack.erase(spec);
-            return false;
+        const std::string package_source = get_cache_dir() + "/" + pkgname + "/" + pkgver;
+        if (!fs::is_directory(package_source) && !fs::exists(get_cache_file(package))) {
+            missing.push_back(package);
         }
-        print_message("Warning: dependency \"" + spec + "\" is not in the package index (skipping; often a virtual or footprint name).", YELLOW);
-        visit_stack.erase(spec);
-        done.insert(spec);
-        return true;
     }
-
-    std::vector<std::string> deps;
-    if (!get_package_dependency_names(spec, deps)) {
-        print_message("Failed to read dependency metadata for \"" + spec + "\" while resolving the install plan.", RED);
-        visit_stack.erase(spec);
-        return false;
+    if (missing.size() < 2) {
+        return;
     }
-    for (const auto& d : deps) {
-        if (!visit_for_plan(d, plan, visit_stack, done, true)) {
-            visit_stack.erase(spec);
-            return false;
-        }
+    const int fetched = fetch_pack_members(missing);
+    if (CPK_VERBOSE && fetched > 0) {
+        print_message("Fetched " + std::to_string(fetched) + " of " + std::to_string(missing.size()) + " package(s) from CPKPACK");
     }
-    visit_stack.erase(spec);
-    done.insert(spec);
-    plan.push_back(spec);
-    return true;
 }
 
-// Install a single package spec (repo name, name#ver, or path to .cpk). Returns false on hard failure.
-static bool install_package_spec(const std::string& spec, bool allow_upgrade_if_installed) {
+// A plan entry fetched and extracted, ready for pkgadd or the native installer
+struct PreparedPackage {
+    std::string pkgname;
+    std::string package_file;    // name#version.pkg.tar.*
+    std::string package_source;  // extracted port tree (install scripts, README)
+    bool upgrade = false;
+    bool skip = false;           // already installed and not upgrading
+};
+
+// Resolve a package spec (repo name, name#ver, or path to .cpk) and retrieve
+// its package file. Returns false on hard failure.
+static bool prepare_package_spec(const std::string& spec, bool allow_upgrade_if_installed, PreparedPackage& prepared) {
     std::string package, pkgname, pkgver, pkgarch;
     std::string package_file;
     bool is_local_file = false;
@@ -123,18 +102,18 @@ static bool install_package_spec(const std::string& spec, bool allow_upgrade_if_
         }
     }
 
-    std::string upgrade_flag;
+    prepared.pkgname = pkgname;
     if (is_package_installed(pkgname)) {
         if (allow_upgrade_if_installed) {
             print_header("Upgrading package " + pkgname, BLUE);
-            upgrade_flag = "-u";
+            prepared.upgrade = true;
         } else {
             print_message("Package " + pkgname + " is already installed", YELLOW);
+            prepared.skip = true;
             return true;
         }
     } else {
         print_header("Installing package " + pkgname, BLUE);
-        upgrade_flag = "";
     }
 
     std::string cache_dir = get_cache_dir();
@@ -147,6 +126,11 @@ static bool install_package_spec(const std::string& spec, bool allow_upgrade_if_
                 return false;
             }
         }
+        // A .cpk carries the port tree; install the package built into it
+        const std::string built = find_pkg_file(package_source, pkgname, pkgver);
+        if (!built.empty()) {
+            package_file = built;
+        }
     } else {
         std::string package_url = cpk_repo_join(url_encode(package));
         std::string package_path = get_cache_file(package);
@@ -165,45 +149,285 @@ static bool install_package_spec(const std::string& spec, bool allow_upgrade_if_
         }
     }
 
-    run_script(package_source + "/pre-install", "Running pre-install script");
+    prepared.package_file = package_file;
+    prepared.package_source = package_source;
+    return true;
+}
+
+static bool print_package_readme(const PreparedPackage& prepared) {
+    std::string readme_path = prepared.package_source + "/README";
+    if (fs::exists(readme_path)) {
+        print_header("Printing package's README file", BLUE);
+        if (shellcmd("cat", { readme_path }, nullptr) != 0) {
+            print_message("Failed to print package's README file", RED);
+            return false;
+        }
+    }
+    return true;
+}
+
+// File owners for one install run: the owner index is opened once and the
+// packages installed by earlier plan entries are tracked in memory on top of it
+struct PlanOwners {
+    CpkOwnerIndex index;
+    bool have_index = false;
+    std::unordered_map<std::string, std::string> planned;  // path -> package installed in this run
+};
+
+// Non-directory paths of the port's .footprint ("mode<TAB>owner/group<TAB>path[ -> target]")
+static std::vector<std::string> footprint_files(const PreparedPackage& prepared) {
+    std::vector<std::string> paths;
+    std::ifstream footprint(prepared.package_source + "/.footprint");
+    std::string line;
+    while (std::getline(footprint, line)) {
+        const size_t tab = line.find('\t', line.find('\t') + 1);
+        if (line.empty() || tab == std::string::npos || line[0] == 'd') {
+            continue;
+        }
+        std::string path = line.substr(tab + 1);
+        if (line[0] == 'l') {
+            path = path.substr(0, path.find(" -> "));
+        }
+        paths.push_back(path);
+    }
+    return paths;
+}
+
+// Files of the port's .footprint that other packages already own, checked
+// before any install script runs; pkgadd would refuse them anyway
+static bool check_footprint_conflicts(const PreparedPackage& prepared, const std::vector<std::string>& files,
+                                      PlanOwners& owners) {
+    std::vector<std::string> conflicts;
+    std::vector<size_t> ids;
+    for (const auto& path : files) {
+        const auto planned = owners.planned.find(path);
+        if (planned != owners.planned.end()) {
+            if (planned->second != prepared.pkgname) {
+                conflicts.push_back(path + " (" + planned->second + ")");
+            }
+            continue;
+        }
+        if (!owners.have_index) {
+            continue;
+        }
+        ids.clear();
+        owners.index.owners(path, ids);
+        for (size_t id : ids) {
+            if (owners.index.package_name(id) != prepared.pkgname) {
+                conflicts.push_back(path + " (" + std::string(owners.index.package_name(id)) + ")");
+            }
+        }
+    }
+    if (conflicts.empty()) {
+        return true;
+    }
+    print_message(std::to_string(conflicts.size()) + " file(s) already owned by other packages:", RED);
+    for (const auto& conflict : conflicts) {
+        print_message("  " + conflict, RED);
+    }
+    return false;
+}
+
+// Install a single package spec with pkgadd. Returns false on hard failure.
+static bool install_package_spec(const std::string& spec, bool allow_upgrade_if_installed, PlanOwners& owners) {
+    PreparedPackage prepared;
+    if (!prepare_package_spec(spec, allow_upgrade_if_installed, prepared)) {
+        return false;
+    }
+    if (prepared.skip) {
+        return true;
+    }
+
+    const std::vector<std::string> files = footprint_files(prepared);
+    if (!check_footprint_conflicts(prepared, files, owners)) {
+        print_message("Failed to install package", RED);
+        return false;
+    }
+
+    run_script(prepared.package_source + "/pre-install", "Running pre-install script");
 
-    std::vector<std::string> pkgadd_args = { "-r", CPK_INSTALL_ROOT, upgrade_flag, package_file };
+    std::vector<std::string> pkgadd_args = { "-r", CPK_INSTALL_ROOT };
+    if (prepared.upgrade) {
+        pkgadd_args.push_back("-u");
+    }
+    pkgadd_args.push_back(prepared.package_file);
     std::string pkgadd_output;
 
     if (CPK_VERBOSE) {
-        print_message("Running " + CPK_PKGADD_CMD + " " + pkgadd_args[0] + " " + pkgadd_args[1] + " " + pkgadd_args[2] + " " + pkgadd_args[3]);
+        std::string command = CPK_PKGADD_CMD;
+        for (const auto& arg : pkgadd_args) {
+            command += " " + arg;
+        }
+        print_message("Running " + command);
     }
 
     if (shellcmd(CPK_PKGADD_CMD, pkgadd_args, &pkgadd_output) != 0) {
         print_message("Failed to install package", RED);
         return false;
     }
+    for (const auto& path : files) {
+        owners.planned[path] = prepared.pkgname;
+    }
 
-    run_script(package_source + "/post-install", "Running post-install script");
+    run_script(prepared.package_source + "/post-install", "Running post-install script");
 
-    std::string readme_path = package_source + "/README";
-    if (fs::exists(readme_path)) {
-        print_header("Printing package's README file", BLUE);
-        if (shellcmd("cat", { readme_path }, nullptr) != 0) {
-            print_message("Failed to print package's README file", RED);
+    if (!print_package_readme(prepared)) {
+        return false;
+    }
+
+    print_message("Package installed successfully");
+    return true;
+}
+
+// cpk_native_install: fetch every entry first, then apply the packages in one
+// db transaction, each pre-install script running just before its package is
+// extracted, and run the post-install scripts, in plan order
+static bool install_specs_native(const std::vector<std::string>& specs,
+                                 const std::unordered_set<std::string>& upgrade_specs) {
+    std::vector<PreparedPackage> batch;
+    for (const auto& spec : specs) {
+        PreparedPackage prepared;
+        if (!prepare_package_spec(spec, upgrade_specs.count(spec) > 0, prepared)) {
+            return false;
+        }
+        if (!prepared.skip) {
+            batch.push_back(prepared);
+        }
+    }
+    if (batch.empty()) {
+        return true;
+    }
+
+    std::vector<CpkNativePackage> packages;
+    for (const auto& prepared : batch) {
+        CpkNativePackage package;
+        package.archive = prepared.package_file;
+        package.pre_install = prepared.package_source + "/pre-install";
+        package.upgrade = prepared.upgrade;
+        packages.push_back(package);
+    }
+    // On failure the packages before the failing one are still installed and
+    // get their post-install scripts and READMEs
+    size_t applied = 0;
+    const bool ok = cpk_native_install(CPK_INSTALL_ROOT, packages, applied);
+    for (size_t i = 0; i < applied; ++i) {
+        run_script(batch[i].package_source + "/post-install", "Running post-install script for " + batch[i].pkgname);
+    }
+    for (size_t i = 0; i < applied; ++i) {
+        if (!print_package_readme(batch[i])) {
             return false;
         }
     }
+    if (!ok) {
+        print_message("Failed to install packages (" + std::to_string(applied) + " of " +
+                      std::to_string(batch.size()) + " installed)", RED);
+        return false;
+    }
 
-    print_message("Package installed successfully");
+    print_message(std::to_string(batch.size()) + " package(s) installed successfully");
     return true;
 }
 
-void cmd_install(const std::vector<std::string>& args) {
-    if (!cpk_is_privileged_process()) {
-        print_message("cpk install must be run as root.", RED);
-        return;
+void print_plan_dry_run(const std::vector<std::string>& specs,
+                        const std::unordered_set<std::string>& upgrade_specs,
+                        const std::unordered_set<std::string>& installed) {
+    struct DryRunEntry {
+        std::string label;
+        std::string action;
+        std::string package;  // repository .cpk to download, empty otherwise
+    };
+    std::vector<DryRunEntry> entries;
+    std::vector<std::string> downloads;
+    for (const auto& spec : specs) {
+        DryRunEntry entry;
+        std::string package, pkgname, pkgver, pkgarch;
+        const bool is_local_file = fs::exists(spec) && fs::is_regular_file(spec);
+        if (is_local_file) {
+            if (!parse_cpk_filename(spec, pkgname, pkgver, pkgarch)) {
+                print_message("Invalid .cpk file format: " + spec, RED);
+                continue;
+            }
+        } else if (!find_package(spec, package, pkgname, pkgver, pkgarch, true)) {
+            continue;
+        }
+        entry.label = pkgname + "#" + pkgver;
+        const bool upgrade = upgrade_specs.count(spec) > 0;
+        if (installed.count(pkgname) && !upgrade) {
+            entry.action = "installed";
+        } else if (is_local_file || fs::is_directory(get_cache_dir() + "/" + pkgname + "/" + pkgver) ||
+                   fs::exists(get_cache_file(package))) {
+            entry.action = upgrade ? "upgrade" : "cached";
+        } else {
+            entry.action = upgrade ? "upgrade" : "download";
+            entry.package = package;
+            downloads.push_back(package);
+        }
+        entries.push_back(entry);
+    }
+
+    const auto sizes = cpk_package_download_sizes(downloads);
+    unsigned long long total = 0;
+    size_t unknown = 0;
+    std::string lines;
+    for (const auto& entry : entries) {
+        std::string bytes = "-";
+        if (!entry.package.empty()) {
+            const auto it = sizes.find(entry.package);
+            if (it != sizes.end()) {
+                bytes = cpk_format_bytes(it->second);
+                total += it->second;
+            } else {
+                bytes = "?";
+                ++unknown;
+            }
+        }
+        lines += entry.label + " " + entry.action + " " + bytes + "\n";
     }
+    print_fmt_header("Package Action Download");
+    print_fmt_lines(lines);
+
+    std::string summary = "Download: " + std::to_string(total) + " bytes (" + cpk_format_bytes(total) + ") in " +
+                          std::to_string(downloads.size()) + " package(s)";
+    if (unknown > 0) {
+        summary += ", size unknown for " + std::to_string(unknown);
+    }
+    print_message(summary);
+    // Downloaded archives stay in the cache next to their extracted sources
+    std::string cache_line = "Cache space needed: at least " + cpk_format_bytes(total);
+    std::error_code ec;
+    const fs::space_info space = fs::space(get_cache_dir(), ec);
+    if (!ec) {
+        cache_line += " (" + cpk_format_bytes(space.available) + " available in " + get_cache_dir() + ")";
+    }
+    print_message(cache_line, !ec && space.available < total ? YELLOW : NONE);
+}
 
+bool install_plan_specs(const std::vector<std::string>& specs, const std::unordered_set<std::string>& upgrade_specs) {
+    prefetch_from_pack(specs);
+    if (CPK_NATIVE_INSTALL) {
+        return install_specs_native(specs, upgrade_specs);
+    }
+    PlanOwners owners;
+    owners.have_index = owners.index.open(CPK_INSTALL_ROOT);
+    for (const auto& spec : specs) {
+        if (!install_package_spec(spec, upgrade_specs.count(spec) > 0, owners)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void cmd_install(const std::vector<std::string>& args) {
     std::vector<std::string> positional;
     bool upgrade = false;
     bool no_deps = false;
-    parse_install_flags(args, positional, upgrade, no_deps);
+    bool dry_run = false;
+    parse_install_flags(args, positional, upgrade, no_deps, dry_run);
+
+    if (!dry_run && !cpk_is_privileged_process()) {
+        print_message("cpk install must be run as root.", RED);
+        return;
+    }
 
     if (positional.empty()) {
         print_message("Package name or path to .cpk file is required", RED);
@@ -213,25 +437,59 @@ void cmd_install(const std::vector<std::string>& args) {
     const std::string& primary = positional[0];
 
     if (!no_deps) {
-        std::vector<std::string> plan;
-        std::set<std::string> visit_stack, done;
-        if (!visit_for_plan(primary, plan, visit_stack, done, false)) {
+        CpkInstallPlan plan;
+        if (!cpk_plan_install({primary}, plan)) {
             print_message("Failed to resolve dependency tree", RED);
             return;
         }
-        for (const auto& spec : plan) {
-            const bool allow_upgrade = upgrade && (spec == primary);
-            if (spec_resolves_installed(spec) && !allow_upgrade) {
-                continue;
+        if (CPK_VERBOSE) {
+            for (size_t level = 0; level < plan.levels.size(); ++level) {
+                std::string members;
+                for (const auto& spec : plan.levels[level]) {
+                    members += " " + spec;
+                }
+                print_message("Level " + std::to_string(level) + ":" + members);
             }
-            if (!install_package_spec(spec, allow_upgrade)) {
-                return;
+        }
+        const std::vector<std::string> installed_list = get_installed_packages();
+        const std::unordered_set<std::string> installed(installed_list.begin(), installed_list.end());
+        std::unordered_set<std::string> upgrade_specs;
+        if (upgrade) {
+            upgrade_specs.insert(primary);
+        }
+        if (dry_run) {
+            print_plan_dry_run(plan.order, upgrade_specs, installed);
+            return;
+        }
+        std::vector<std::string> pending;
+        for (const auto& spec : plan.order) {
+            if (installed.count(spec_pkgname(spec)) && !upgrade_specs.count(spec)) {
+                continue;
             }
+            pending.push_back(spec);
+        }
+        install_plan_specs(pending, upgrade_specs);
+        return;
+    }
+
+    if (dry_run) {
+        const std::vector<std::string> installed_list = get_installed_packages();
+        std::unordered_set<std::string> upgrade_specs;
+        if (upgrade) {
+            upgrade_specs.insert(primary);
         }
+        print_plan_dry_run({primary}, upgrade_specs,
+                           std::unordered_set<std::string>(installed_list.begin(), installed_list.end()));
         return;
     }
 
-    if (!install_package_spec(primary, upgrade)) {
+    if (CPK_NATIVE_INSTALL) {
+        install_specs_native({primary}, upgrade ? std::unordered_set<std::string>{primary} : std::unordered_set<std::string>());
+        return;
+    }
+    PlanOwners owners;
+    owners.have_index = owners.index.open(CPK_INSTALL_ROOT);
+    if (!install_package_spec(primary, upgrade, owners)) {
         return;
     }
 }
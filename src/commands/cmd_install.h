@@ -3,7 +3,17 @@
 
 #include <vector>
 #include <string>
+#include <unordered_set>
 
 void cmd_install(const std::vector<std::string>& args);
+// Install plan entries in order (prefetching what the repository pack can
+// serve); specs in upgrade_specs are upgraded if installed. Stops at the first failure.
+bool install_plan_specs(const std::vector<std::string>& specs, const std::unordered_set<std::string>& upgrade_specs);
+
+// --dry-run: list what each plan entry needs (installed, cached, download or
+// upgrade) with download sizes and the cache space it takes; changes nothing
+void print_plan_dry_run(const std::vector<std::string>& specs,
+                        const std::unordered_set<std::string>& upgrade_specs,
+                        const std::unordered_set<std::string>& installed);
 
 #endif
@@ -0,0 +1,82 @@
+#include "../cpk.h"
+#include "../utils.h"
+#include "../fs_compat.h"
+#include "cmd_owner.h"
+#include <iostream>
+#include <vector>
+#include <string>
+
+// Path as the db lists it: relative to the installation root (which may also
+// prefix an absolute argument), without a leading "/"
+static std::string db_relative_path(const std::string& path) {
+    std::string relative = path;
+    std::string root = CPK_INSTALL_ROOT;
+    while (root.size() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    if (root != "/" && relative.compare(0, root.size(), root) == 0 &&
+        (relative.size() == root.size() || relative[root.size()] == '/')) {
+        relative.erase(0, root.size());
+    }
+    while (!relative.empty() && relative[0] == '/') {
+        relative.erase(0, 1);
+    }
+    return relative;
+}
+
+void cmd_owner(const std::vector<std::string>& args) {
+    std::vector<std::string> queries;
+    bool from_stdin = false;
+    for (const auto& a : args) {
+        if (a == "-") {
+            from_stdin = true;
+        } else {
+            queries.push_back(a);
+        }
+    }
+    if (from_stdin) {
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            if (!line.empty()) {
+                queries.push_back(line);
+            }
+        }
+    }
+    if (queries.empty()) {
+        print_message("Path is required", RED);
+        return;
+    }
+
+    CpkOwnerIndex index;
+    if (!index.open(CPK_INSTALL_ROOT)) {
+        print_message("Failed to read package database under " + CPK_INSTALL_ROOT, RED);
+        return;
+    }
+
+    std::string lines;
+    std::vector<std::string> unowned;
+    std::vector<size_t> owners;
+    for (const auto& query : queries) {
+        std::string file = db_relative_path(query);
+        owners.clear();
+        index.owners(file, owners);
+        if (owners.empty() && !file.empty() && file.back() != '/') {
+            file += '/';
+            index.owners(file, owners);
+        }
+        if (owners.empty()) {
+            unowned.push_back(query);
+            continue;
+        }
+        for (size_t id : owners) {
+            lines += std::string(index.package_name(id)) + " " + std::string(index.package_version(id)) + " /" + file + "\n";
+        }
+    }
+    if (!lines.empty()) {
+        print_fmt_header("Package Version File");
+        print_fmt_lines(lines);
+    }
+    for (const auto& query : unowned) {
+        print_message("No package owns " + query, YELLOW);
+    }
+}
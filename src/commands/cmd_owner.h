@@ -0,0 +1,9 @@
+#ifndef CMD_OWNER_H
+#define CMD_OWNER_H
+
+#include <vector>
+#include <string>
+
+void cmd_owner(const std::vector<std::string>& args);
+
+#endif
@@ -1,37 +1,463 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "../fs_compat.h"
+#include "cmd_search.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <regex>
 #include <sstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// CPKSEARCH.idx layout (host byte order; rebuilt whenever CPKINDEX or CPKDESC change):
+//   header | entries | trigrams (sorted by key) | postings | strings
+// One entry per CPKINDEX line. Each trigram points at the ascending ids of the
+// entries whose lowercased package name or description contain it, so a query
+// only verifies the lines left after intersecting the posting lists.
+struct SearchIndexHeader {
+    char magic[8];
+    int64_t index_size;
+    int64_t index_mtime;
+    int64_t desc_size;
+    int64_t desc_mtime;
+    uint32_t entries;
+    uint32_t trigrams;
+    uint32_t postings;
+    uint32_t strings;
+};
+
+struct SearchEntry {
+    uint32_t package_offset;
+    uint32_t package_size;
+    uint32_t desc_offset;
+    uint32_t desc_size;
+};
+
+struct SearchTrigram {
+    uint32_t key;
+    uint32_t first;
+    uint32_t count;
+};
+
+static const char SEARCH_MAGIC[8] = {'C', 'P', 'K', 'T', 'R', 'I', '1', '\0'};
+
+static std::string search_index_path() {
+    return CPK_HOME_DIR + "/CPKSEARCH.idx";
+}
+
+// Size and mtime (ns) identify the CPKINDEX/CPKDESC an index was built from
+static void file_stamp(const std::string& path, int64_t& size, int64_t& mtime) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        size = st.st_size;
+        mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    } else {
+        size = -1;
+        mtime = 0;
+    }
+}
+
+static std::string lowercase(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+    return text;
+}
+
+static void collect_trigrams(const std::string& lower_text, std::vector<uint32_t>& out) {
+    for (size_t i = 0; i + 3 <= lower_text.size(); ++i) {
+        out.push_back((static_cast<uint32_t>(static_cast<unsigned char>(lower_text[i])) << 16) |
+                      (static_cast<uint32_t>(static_cast<unsigned char>(lower_text[i + 1])) << 8) |
+                      static_cast<uint32_t>(static_cast<unsigned char>(lower_text[i + 2])));
+    }
+}
+
+static void append_bytes(std::string& out, const void* data, size_t size) {
+    out.append(static_cast<const char*>(data), size);
+}
+
+static std::string serialize_search_index() {
+    SearchIndexHeader header;
+    std::memcpy(header.magic, SEARCH_MAGIC, sizeof(header.magic));
+    file_stamp(get_cpkindex_path(), header.index_size, header.index_mtime);
+    file_stamp(get_cpkdesc_path(), header.desc_size, header.desc_mtime);
+
+    std::unordered_map<std::string, std::string> descriptions;
+    cpk_for_each_index_line(get_cpkdesc_path(), [&](const CpkIndexLine& line) {
+        descriptions.emplace(std::string(line.package), std::string(line.deps));
+    });
+
+    std::vector<SearchEntry> entries;
+    std::string strings;
+    std::map<uint32_t, std::vector<uint32_t>> postings;
+    std::vector<uint32_t> trigrams;
+    cpk_for_each_index_line(get_cpkindex_path(), [&](const CpkIndexLine& line) {
+        const std::string package(line.package);
+        const auto desc_it = descriptions.find(package);
+        const std::string desc = desc_it == descriptions.end() ? std::string() : desc_it->second;
+
+        SearchEntry entry;
+        entry.package_offset = static_cast<uint32_t>(strings.size());
+        entry.package_size = static_cast<uint32_t>(package.size());
+        strings += package;
+        entry.desc_offset = static_cast<uint32_t>(strings.size());
+        entry.desc_size = static_cast<uint32_t>(desc.size());
+        strings += desc;
+
+        const uint32_t id = static_cast<uint32_t>(entries.size());
+        entries.push_back(entry);
+
+        trigrams.clear();
+        collect_trigrams(lowercase(package), trigrams);
+        collect_trigrams(lowercase(desc), trigrams);
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+        for (uint32_t key : trigrams) {
+            postings[key].push_back(id);
+        }
+    });
+
+    std::vector<SearchTrigram> table;
+    std::vector<uint32_t> ids;
+    for (const auto& posting : postings) {
+        table.push_back({posting.first, static_cast<uint32_t>(ids.size()), static_cast<uint32_t>(posting.second.size())});
+        ids.insert(ids.end(), posting.second.begin(), posting.second.end());
+    }
+
+    header.entries = static_cast<uint32_t>(entries.size());
+    header.trigrams = static_cast<uint32_t>(table.size());
+    header.postings = static_cast<uint32_t>(ids.size());
+    header.strings = static_cast<uint32_t>(strings.size());
+
+    std::string out;
+    append_bytes(out, &header, sizeof(header));
+    append_bytes(out, entries.data(), entries.size() * sizeof(SearchEntry));
+    append_bytes(out, table.data(), table.size() * sizeof(SearchTrigram));
+    append_bytes(out, ids.data(), ids.size() * sizeof(uint32_t));
+    out += strings;
+    return out;
+}
+
+static bool write_search_index(const std::string& bytes) {
+    const std::string path = search_index_path();
+    const std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    out.close();
+    if (!out) {
+        fs::remove(tmp);
+        return false;
+    }
+    fs::rename(tmp, path);
+    return true;
+}
+
+bool build_cpk_search_index() {
+    return write_search_index(serialize_search_index());
+}
+
+// Read-only view over a serialized index, either mmap'ed or built in memory
+struct SearchIndex {
+    std::string owned;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    const SearchIndexHeader* header = nullptr;
+    const SearchEntry* entries = nullptr;
+    const SearchTrigram* trigrams = nullptr;
+    const uint32_t* postings = nullptr;
+    const char* strings = nullptr;
+
+    ~SearchIndex() {
+        if (mapping != nullptr) {
+            munmap(mapping, mapping_size);
+        }
+    }
+
+    bool attach(const char* data, size_t size) {
+        if (size < sizeof(SearchIndexHeader)) {
+            return false;
+        }
+        header = reinterpret_cast<const SearchIndexHeader*>(data);
+        if (std::memcmp(header->magic, SEARCH_MAGIC, sizeof(SEARCH_MAGIC)) != 0) {
+            return false;
+        }
+        const size_t expected = sizeof(SearchIndexHeader) + header->entries * sizeof(SearchEntry) +
+                                header->trigrams * sizeof(SearchTrigram) +
+                                header->postings * sizeof(uint32_t) + header->strings;
+        if (size != expected) {
+            return false;
+        }
+        entries = reinterpret_cast<const SearchEntry*>(data + sizeof(SearchIndexHeader));
+        trigrams = reinterpret_cast<const SearchTrigram*>(entries + header->entries);
+        postings = reinterpret_cast<const uint32_t*>(trigrams + header->trigrams);
+        strings = reinterpret_cast<const char*>(postings + header->postings);
+        return true;
+    }
+
+    bool current() const {
+        int64_t index_size, index_mtime, desc_size, desc_mtime;
+        file_stamp(get_cpkindex_path(), index_size, index_mtime);
+        file_stamp(get_cpkdesc_path(), desc_size, desc_mtime);
+        return header->index_size == index_size && header->index_mtime == index_mtime &&
+               header->desc_size == desc_size && header->desc_mtime == desc_mtime;
+    }
+
+    std::string package(uint32_t id) const {
+        return std::string(strings + entries[id].package_offset, entries[id].package_size);
+    }
+
+    std::string description(uint32_t id) const {
+        return std::string(strings + entries[id].desc_offset, entries[id].desc_size);
+    }
+
+    // Ids of entries containing every trigram (sorted); false if a trigram is absent
+    bool lookup(const std::vector<uint32_t>& keys, std::vector<uint32_t>& ids) const {
+        std::vector<const SearchTrigram*> lists;
+        for (uint32_t key : keys) {
+            const SearchTrigram* end = trigrams + header->trigrams;
+            const SearchTrigram* it = std::lower_bound(trigrams, end, key, [](const SearchTrigram& t, uint32_t k) {
+                return t.key < k;
+            });
+            if (it == end || it->key != key) {
+                ids.clear();
+                return false;
+            }
+            lists.push_back(it);
+        }
+        // Intersect starting from the shortest posting list
+        std::sort(lists.begin(), lists.end(), [](const SearchTrigram* a, const SearchTrigram* b) {
+            return a->count < b->count;
+        });
+        ids.assign(postings + lists[0]->first, postings + lists[0]->first + lists[0]->count);
+        std::vector<uint32_t> next;
+        for (size_t i = 1; i < lists.size() && !ids.empty(); ++i) {
+            next.clear();
+            std::set_intersection(ids.begin(), ids.end(),
+                                  postings + lists[i]->first, postings + lists[i]->first + lists[i]->count,
+                                  std::back_inserter(next));
+            ids.swap(next);
+        }
+        return !ids.empty();
+    }
+};
+
+static bool open_search_index(SearchIndex& index) {
+    const std::string path = search_index_path();
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                index.mapping = mapping;
+                index.mapping_size = static_cast<size_t>(st.st_size);
+            }
+        }
+        close(fd);
+    }
+    if (index.mapping != nullptr &&
+        index.attach(static_cast<const char*>(index.mapping), index.mapping_size) && index.current()) {
+        return true;
+    }
+
+    // Missing or stale: rebuild, and keep it for the next search when cpk_home_dir is writable
+    index.owned = serialize_search_index();
+    if (access(CPK_HOME_DIR.c_str(), W_OK) == 0) {
+        write_search_index(index.owned);
+    }
+    return index.attach(index.owned.data(), index.owned.size());
+}
+
+// Literal runs every match of the pattern must contain (empty = no prefilter).
+// Alternation is not analysed; an atom followed by ?, * or {} is optional, and
+// nothing inside a group is collected since the group may be optional as a whole.
+static std::vector<std::string> regex_required_literals(const std::string& pattern) {
+    std::vector<std::string> literals;
+    if (pattern.find('|') != std::string::npos) {
+        return literals;
+    }
+    std::string current;
+    int depth = 0;
+    auto flush = [&]() {
+        if (current.size() >= 3) {
+            literals.push_back(lowercase(current));
+        }
+        current.clear();
+    };
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        const char c = pattern[i];
+        if (c == '\\' && i + 1 < pattern.size()) {
+            const char escaped = pattern[++i];
+            if (std::isalnum(static_cast<unsigned char>(escaped)) || depth > 0) {
+                flush();  // \w, \d, \b, ... are classes or assertions, not literals
+            } else {
+                current += escaped;
+            }
+        } else if (c == '?' || c == '*' || c == '{') {
+            if (!current.empty()) {
+                current.pop_back();
+            }
+            flush();
+            if (c == '{') {
+                i = pattern.find('}', i);
+                if (i == std::string::npos) {
+                    break;
+                }
+            }
+        } else if (c == '[') {
+            flush();
+            i = pattern.find(']', i + 2);
+            if (i == std::string::npos) {
+                break;
+            }
+        } else if (c == '(') {
+            flush();
+            ++depth;
+        } else if (c == ')') {
+            flush();
+            if (depth > 0) {
+                --depth;
+            }
+        } else if (std::strchr(".^$+", c) != nullptr || depth > 0) {
+            flush();
+        } else {
+            current += c;
+        }
+    }
+    flush();
+    return literals;
+}
 
 void cmd_search(const std::vector<std::string>& args) {
-    if (args.empty()) {
+    std::vector<std::string> terms;
+    bool use_regex = false;
+    bool exact = false;
+    bool fuzzy = false;
+    for (const auto& a : args) {
+        if (a == "--regex") {
+            use_regex = true;
+        } else if (a == "--exact") {
+            exact = true;
+        } else if (a == "--fuzzy") {
+            fuzzy = true;
+        } else {
+            terms.push_back(a);
+        }
+    }
+    if (terms.empty()) {
         print_message("Search argument is required");
         return;
     }
-    std::string search_term = args[0];
-
-    const std::string index_file = get_cpkindex_path();
-    std::ifstream file(index_file);
-    if (!file.is_open()) {
+    if (use_regex + exact + fuzzy > 1) {
+        print_message("--regex, --exact and --fuzzy cannot be combined", RED);
+        return;
+    }
+    if (!cpk_file_readable(get_cpkindex_path())) {
         cpk_print_missing_index_error();
         return;
     }
-    std::string index_line;
-    bool found = false;
+
+    // Nearest port names by edit distance; no trigram prefilter, since a typo
+    // breaks up to three trigrams per edited character
+    if (fuzzy) {
+        std::ostringstream fuzzy_results;
+        for (const auto& term : terms) {
+            for (const auto& port : cpk_fuzzy_port_matches(term, 10)) {
+                fuzzy_results << port << '\n';
+            }
+        }
+        if (fuzzy_results.str().empty()) {
+            print_message("No matching packages found", YELLOW);
+        } else {
+            print_fmt_lines(fuzzy_results.str());
+        }
+        return;
+    }
+
+    std::vector<std::regex> patterns;
+    if (use_regex) {
+        for (const auto& term : terms) {
+            try {
+                patterns.emplace_back(term);
+            } catch (const std::regex_error& e) {
+                print_message("Invalid regular expression: " + term, RED);
+                return;
+            }
+        }
+    }
+
+    SearchIndex index;
+    if (!open_search_index(index)) {
+        print_message("Failed to load search index", RED);
+        return;
+    }
+
+    // Candidates: intersection of the posting lists of every required trigram.
+    // --exact accepts a port equal to any term, so no trigram is required by all.
+    std::vector<uint32_t> keys;
+    for (const auto& term : exact ? std::vector<std::string>() : terms) {
+        const std::vector<std::string> literals = use_regex ? regex_required_literals(term)
+                                                            : std::vector<std::string>{lowercase(term)};
+        for (const auto& literal : literals) {
+            collect_trigrams(literal, keys);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    std::vector<uint32_t> candidates;
+    if (keys.empty()) {
+        candidates.resize(index.header->entries);
+        for (uint32_t id = 0; id < index.header->entries; ++id) {
+            candidates[id] = id;
+        }
+    } else {
+        index.lookup(keys, candidates);
+    }
+
+    std::vector<std::string> lower_terms;
+    for (const auto& term : terms) {
+        lower_terms.push_back(lowercase(term));
+    }
 
     std::ostringstream search_results;
-    while (std::getline(file, index_line)) {
-        if (!cpk_index_line_valid(index_line)) {
-            continue;
+    bool found = false;
+    for (uint32_t id : candidates) {
+        const std::string pkg = index.package(id);
+        bool match = true;
+        if (exact) {
+            const std::string port = pkg.substr(0, pkg.find('#'));
+            match = std::find(terms.begin(), terms.end(), port) != terms.end();
+        } else if (use_regex) {
+            const std::string desc = index.description(id);
+            for (const auto& pattern : patterns) {
+                if (!std::regex_search(pkg, pattern) && !std::regex_search(desc, pattern)) {
+                    match = false;
+                    break;
+                }
+            }
+        } else {
+            const std::string lower_pkg = lowercase(pkg);
+            const std::string lower_desc = lowercase(index.description(id));
+            for (const auto& term : lower_terms) {
+                if (lower_pkg.find(term) == std::string::npos && lower_desc.find(term) == std::string::npos) {
+                    match = false;
+                    break;
+                }
+            }
         }
-        const std::string pkg = cpk_index_line_package(index_line);
-        if (pkg.find(search_term) != std::string::npos) {
+        if (match) {
             found = true;
             search_results << pkg << '\n';
         }
     }
-    file.close();
 
     if (!found) {
         print_message("No matching packages found", YELLOW);
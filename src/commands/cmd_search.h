@@ -5,5 +5,7 @@
 #include <string>
 
 void cmd_search(const std::vector<std::string>& args);
+// Rebuild the trigram search index (cpk_home_dir/CPKSEARCH.idx) from CPKINDEX and CPKDESC
+bool build_cpk_search_index();
 
 #endif
@@ -1,41 +1,200 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "../fs_compat.h"
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
+static void parse_uninstall_flags(const std::vector<std::string>& args,
+                                  std::vector<std::string>& positional,
+                                  bool& cascade,
+                                  bool& dry_run) {
+    cascade = false;
+    dry_run = false;
+    positional.clear();
+    for (const auto& a : args) {
+        if (a == "--cascade") {
+            cascade = true;
+        } else if (a == "--dry-run") {
+            dry_run = true;
+        } else if (a == "--native") {
+            CPK_NATIVE_INSTALL = true;
+        } else {
+            positional.push_back(a);
+        }
+    }
+}
+
+// Dependencies of an installed package: its CPKINDEX entry, or the Pkgfile of
+// its extracted tree for ports that left the index
+static std::vector<std::string> installed_dependencies(const std::string& name, const std::string& version) {
+    std::vector<std::string> deps;
+    if (lookup_cpkindex_deps_by_port(name, deps)) {
+        return deps;
+    }
+    std::string pkgname, desc, url, deps_line;
+    if (!parse_pkgfile(resolve_package_extract_dir(name, version) + "/Pkgfile", pkgname, desc, url, deps_line)) {
+        return deps;
+    }
+    std::istringstream words(deps_line);
+    std::string word;
+    while (words >> word) {
+        while (!word.empty() && (word.back() == ',' || word.back() == ';')) {
+            word.pop_back();
+        }
+        if (!word.empty()) {
+            deps.push_back(word);
+        }
+    }
+    return deps;
+}
+
 void cmd_uninstall(const std::vector<std::string>& args) {
+    std::vector<std::string> positional;
+    bool cascade = false;
+    bool dry_run = false;
+    parse_uninstall_flags(args, positional, cascade, dry_run);
 
-    if (args.empty()) {
+    if (positional.empty()) {
         print_message("Package name is required", RED);
         return;
     }
 
-    if (!cpk_is_privileged_process()) {
+    if (!dry_run && !cpk_is_privileged_process()) {
         print_message("cpk uninstall must be run as root.", RED);
         return;
     }
 
-    std::string package, pkgname, pkgver, pkgarch;
-    if (!find_package(args[0], package, pkgname, pkgver, pkgarch, true)) return;
-
-    if (!is_package_installed(pkgname)) {
-        print_message("Package " + pkgname + " not installed", RED);
+    // Targets are resolved against the database, so ports gone from the index can still be removed
+    std::vector<CpkInstalledPackage> records;
+    if (!cpk_read_pkg_db(CPK_INSTALL_ROOT, records)) {
+        print_message("Failed to read package database under " + CPK_INSTALL_ROOT, RED);
+        return;
+    }
+    std::unordered_map<std::string, size_t> ids;
+    for (size_t i = 0; i < records.size(); ++i) {
+        ids.emplace(records[i].name, i);
+    }
+    std::vector<bool> removing(records.size(), false);
+    bool missing = false;
+    for (const auto& spec : positional) {
+        const std::string pkgname = spec.substr(0, spec.find('#'));
+        const auto it = ids.find(pkgname);
+        if (it == ids.end()) {
+            print_message("Package " + pkgname + " not installed", RED);
+            missing = true;
+            continue;
+        }
+        removing[it->second] = true;
+    }
+    if (missing) {
         return;
     }
 
-    print_header("Uninstalling package " + pkgname, BLUE);
+    // edges[v]: installed packages v depends on; dependents is the reverse
+    std::vector<std::vector<size_t>> edges(records.size());
+    std::vector<std::vector<size_t>> dependents(records.size());
+    for (size_t v = 0; v < records.size(); ++v) {
+        for (const auto& dep : installed_dependencies(records[v].name, records[v].version)) {
+            const auto it = ids.find(dep);
+            if (it != ids.end() && it->second != v) {
+                edges[v].push_back(it->second);
+                dependents[it->second].push_back(v);
+            }
+        }
+    }
+
+    // Packages still needed by one that stays block the removal unless --cascade takes them along
+    std::vector<size_t> queue;
+    for (size_t v = 0; v < records.size(); ++v) {
+        if (removing[v]) {
+            queue.push_back(v);
+        }
+    }
+    const std::vector<bool> requested = removing;
+    size_t pulled = 0;
+    for (size_t i = 0; i < queue.size(); ++i) {
+        for (size_t d : dependents[queue[i]]) {
+            if (!removing[d]) {
+                removing[d] = true;
+                ++pulled;
+                queue.push_back(d);
+            }
+        }
+    }
+    if (pulled > 0 && !cascade) {
+        for (size_t v = 0; v < records.size(); ++v) {
+            if (!requested[v]) {
+                continue;
+            }
+            std::string users;
+            for (size_t d : dependents[v]) {
+                if (!requested[d]) {
+                    users += " " + records[d].name;
+                }
+            }
+            if (!users.empty()) {
+                print_message("Package " + records[v].name + " is required by:" + users, RED);
+            }
+        }
+        print_message("Nothing removed (use --cascade to remove the dependent packages too)", RED);
+        return;
+    }
 
-    std::vector<std::string> pkgrm_args = { "-r", CPK_INSTALL_ROOT, pkgname };
-    std::string pkgrm_output;
+    // Dependents before their dependencies: components come dependencies first, so walk them backwards
+    std::vector<size_t> component;
+    const std::vector<std::vector<size_t>> components = cpk_graph_components(edges, component);
+    std::vector<std::string> order;
+    for (auto c = components.rbegin(); c != components.rend(); ++c) {
+        std::vector<std::string> members;
+        for (size_t v : *c) {
+            if (removing[v]) {
+                members.push_back(records[v].name);
+            }
+        }
+        std::sort(members.begin(), members.end());
+        order.insert(order.end(), members.begin(), members.end());
+    }
 
-    if (CPK_VERBOSE) {
-        print_message("Running " + CPK_PKGRM_CMD + " -r " + CPK_INSTALL_ROOT + " " + pkgname);
+    if (dry_run || CPK_VERBOSE) {
+        std::string lines;
+        for (const auto& name : order) {
+            const size_t v = ids[name];
+            lines += name + " " + records[v].version + " " + (requested[v] ? "requested" : "dependent") + "\n";
+        }
+        print_fmt_header("Package Version Reason");
+        print_fmt_lines(lines);
+        if (dry_run) {
+            return;
+        }
     }
 
-    if (shellcmd(CPK_PKGRM_CMD, pkgrm_args, &pkgrm_output) != 0) {
-        print_message("Failed to uninstall package", RED);
+    if (CPK_NATIVE_INSTALL) {
+        print_header("Uninstalling " + std::to_string(order.size()) + " package(s)", BLUE);
+        if (!cpk_native_remove(CPK_INSTALL_ROOT, order)) {
+            print_message("Failed to uninstall packages", RED);
+            return;
+        }
+        print_message(std::to_string(order.size()) + " package(s) uninstalled successfully");
         return;
     }
-    return;
+
+    // pkgrm takes the database lock itself, so each call commits on its own
+    for (const auto& pkgname : order) {
+        print_header("Uninstalling package " + pkgname, BLUE);
+
+        std::vector<std::string> pkgrm_args = { "-r", CPK_INSTALL_ROOT, pkgname };
+        std::string pkgrm_output;
+
+        if (CPK_VERBOSE) {
+            print_message("Running " + CPK_PKGRM_CMD + " -r " + CPK_INSTALL_ROOT + " " + pkgname);
+        }
+
+        if (shellcmd(CPK_PKGRM_CMD, pkgrm_args, &pkgrm_output) != 0) {
+            print_message("Failed to uninstall package", RED);
+            return;
+        }
+    }
 }
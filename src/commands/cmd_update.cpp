@@ -1,63 +1,85 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "../fs_compat.h"
+#include "cmd_search.h"
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
-static std::string trim_index_line(std::string line) {
-    while (!line.empty() && (line.back() == '\r' || line.back() == '\n' || line.back() == ' ' || line.back() == '\t')) {
-        line.pop_back();
-    }
-    size_t i = 0;
-    while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
-        ++i;
-    }
-    return line.substr(i);
+// CPKINDEX package "name#ver-rel.arch.cpk" -> unique label without ".cpk"
+static std::string index_package_label(std::string_view package) {
+    return std::string(package.substr(0, package.size() - 4));
 }
 
-// CPKINDEX line "name#ver-rel.arch.cpk: deps" -> unique label without ".cpk"
-static std::string index_package_label(const std::string& pkg_line) {
-    if (pkg_line.size() >= 4 && pkg_line.compare(pkg_line.size() - 4, 4, ".cpk") == 0) {
-        return pkg_line.substr(0, pkg_line.size() - 4);
+// Map each port name to the label of the revision find_package() resolves it
+// to in the loaded CPKINDEX. Returns false only if the index cannot be read.
+static bool read_index_labels(std::unordered_map<std::string, std::string>& labels) {
+    std::vector<std::pair<std::string_view, CpkIndexRevision>> selected;
+    if (!cpk_index_selected_revisions(selected)) {
+        return false;
     }
-    return pkg_line;
-}
-
-// Port name for CPKINDEX lines "name#version-release.arch.cpk: deps"
-static std::string index_pkgname(const std::string& pkg_line) {
-    const size_t h = pkg_line.find('#');
-    if (h == std::string::npos || h == 0) {
-        return pkg_line;
+    for (const auto& entry : selected) {
+        labels.emplace(std::string(entry.first), index_package_label(entry.second.package));
     }
-    return pkg_line.substr(0, h);
+    return true;
 }
 
-// Map each port name to the label of its newest revision (first CPKINDEX line
-// per port name wins). Returns false only if the file cannot be opened.
-static bool read_index_labels(const std::string& index_file,
-                              std::unordered_map<std::string, std::string>& labels) {
-    std::ifstream in(index_file);
-    if (!in.is_open()) {
+// Fetch only the CPKINDEX.<arch> shard listed in the repository's CPKSHARDS
+// manifest. Returns false when the repository publishes no shard for arch (or
+// the shard does not match its checksum), so the caller falls back to CPKINDEX.
+static bool download_index_shard(const std::string& arch, const std::string& index_file) {
+    const std::string manifest_file = index_file + ".shards";
+    if (!download_file(cpk_repo_join("CPKSHARDS"), manifest_file, true)) {
         return false;
     }
+    std::string shard_file, shard_sha256;
+    std::ifstream manifest(manifest_file);
     std::string line;
-    while (std::getline(in, line)) {
-        const std::string trimmed = trim_index_line(line);
-        if (!cpk_index_line_valid(trimmed)) {
-            continue;
+    while (std::getline(manifest, line)) {
+        std::istringstream fields(line);
+        std::string shard_arch, file, packages, sha256;
+        if (fields >> shard_arch >> file >> packages >> sha256 && shard_arch == arch) {
+            shard_file = file;
+            shard_sha256 = sha256;
+            break;
+        }
+    }
+    manifest.close();
+    fs::remove(manifest_file);
+    if (shard_file.empty()) {
+        if (CPK_VERBOSE) {
+            print_message("No index shard for " + arch + " in repository, fetching full CPKINDEX", YELLOW);
         }
-        const std::string pkg_line = cpk_index_line_package(trimmed);
-        const std::string pkgname = index_pkgname(pkg_line);
-        labels.emplace(pkgname, index_package_label(pkg_line));
+        return false;
     }
+
+    const std::string shard_tmp = index_file + ".tmp";
+    if (!download_file(cpk_repo_join(url_encode(shard_file)), shard_tmp, true)) {
+        return false;
+    }
+    if (calculate_sha256(shard_tmp) != shard_sha256) {
+        print_message("Checksum mismatch for " + shard_file + ", fetching full CPKINDEX", YELLOW);
+        fs::remove(shard_tmp);
+        return false;
+    }
+    fs::rename(shard_tmp, index_file);
     return true;
 }
 
 void cmd_update(const std::vector<std::string>& args) {
-    (void)args;
+    std::string arch;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--arch" && i + 1 < args.size()) {
+            arch = args[++i];
+        } else if (args[i].rfind("--arch=", 0) == 0) {
+            arch = args[i].substr(7);
+        } else {
+            print_message("Usage: cpk update [--arch <arch>]", YELLOW);
+            return;
+        }
+    }
 
     if(!fs::is_directory(CPK_HOME_DIR)) {
         print_message("Home directory does not exists " + CPK_HOME_DIR, RED);
@@ -87,49 +109,75 @@ void cmd_update(const std::vector<std::string>& args) {
     // on demand by the commands that need them (e.g. cpk info).
     std::unordered_map<std::string, std::string> old_labels;
     if (had_index) {
-        read_index_labels(index_file, old_labels);
+        read_index_labels(old_labels);
     }
 
-    const std::string index_url = cpk_repo_join("CPKINDEX");
-    if (!download_file(index_url, index_file, true)) {
-        print_message("Failed to update index file " + index_file, RED);
-        return;
+    if (arch.empty()) {
+        arch = get_system_architecture();
     }
+    if (!download_index_shard(arch, index_file)) {
+        const std::string index_url = cpk_repo_join("CPKINDEX");
+        if (!download_file(index_url, index_file, true)) {
+            print_message("Failed to update index file " + index_file, RED);
+            return;
+        }
+    }
+
+    // Remember the architecture so package lookups prefer it over the host's
+    const std::string arch_file = index_file + ".arch";
+    if (arch != get_system_architecture()) {
+        std::ofstream arch_out(arch_file);
+        arch_out << arch << '\n';
+        arch_out.close();
+        if (!arch_out) {
+            print_message("Failed to record index architecture in " + arch_file, RED);
+            return;
+        }
+    } else if (fs::exists(arch_file)) {
+        fs::remove(arch_file);
+    }
+    // Drop the old index model; the next lookup loads the new index with the new architecture
     cpk_invalidate_cpkindex_deps_cache();
 
+    // Optional pack offset table: lets install fetch plan members from one
+    // byte-range stream. Repositories without CPKPACK simply return 404.
+    const std::string pack_index_file = get_cpkpack_index_path();
+    if (!download_file(cpk_repo_join("CPKPACK.idx"), pack_index_file, true) && fs::exists(pack_index_file)) {
+        fs::remove(pack_index_file);
+    }
+
+    // Optional one-line descriptions for cpk search; the trigram index is
+    // rebuilt here so the first search after an update does not pay for it.
+    const std::string desc_file = get_cpkdesc_path();
+    if (!download_file(cpk_repo_join("CPKDESC"), desc_file, true) && fs::exists(desc_file)) {
+        fs::remove(desc_file);
+    }
+    if (!build_cpk_search_index() && CPK_VERBOSE) {
+        print_message("Could not write search index; cpk search will build it on demand", YELLOW);
+    }
+    // Per-port dependency closures for deps -r / deptree, keyed by the new index
+    if (!build_cpk_closure_index() && CPK_VERBOSE) {
+        print_message("No closure cache written; closure queries will walk the index", YELLOW);
+    }
+
     std::vector<std::string> new_labels;
     std::vector<std::string> updated_labels;
-    std::unordered_set<std::string> seen;
 
-    std::ifstream index_in(index_file);
-    if (!index_in.is_open()) {
+    // Compare each port's resolved revision, in index order
+    std::vector<std::pair<std::string_view, CpkIndexRevision>> selected;
+    if (!cpk_index_selected_revisions(selected)) {
         print_message("Error opening index file: " + index_file, RED);
         return;
     }
-
-    std::string index_line;
-    while (std::getline(index_in, index_line)) {
-        const std::string trimmed = trim_index_line(index_line);
-        if (!cpk_index_line_valid(trimmed)) {
-            continue;
-        }
-        const std::string pkg_line = cpk_index_line_package(trimmed);
-
-        // Only the first index row per port name is the newest revision.
-        const std::string pkgname = index_pkgname(pkg_line);
-        if (!seen.insert(pkgname).second) {
-            continue;
-        }
-
-        const std::string label = index_package_label(pkg_line);
-        auto it = old_labels.find(pkgname);
+    for (const auto& entry : selected) {
+        const std::string label = index_package_label(entry.second.package);
+        auto it = old_labels.find(std::string(entry.first));
         if (it == old_labels.end()) {
             new_labels.push_back(label);
         } else if (it->second != label) {
             updated_labels.push_back(label);
         }
     }
-    index_in.close();
 
     // Preserve CPKINDEX line order (do not sort): index order is significant for tooling.
 
@@ -4,36 +4,69 @@
 #include <sstream>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
-void cmd_upgrade(const std::vector<std::string>& args) {
+void cmd_upgrade(const std::vector<std::string>& options) {
 
-    if (!cpk_is_privileged_process()) {
+    bool dry_run = false;
+    std::vector<std::string> args;
+    for (const auto& a : options) {
+        if (a == "--dry-run") {
+            dry_run = true;
+        } else {
+            args.push_back(a);
+        }
+    }
+
+    if (!dry_run && !cpk_is_privileged_process()) {
         print_message("cpk upgrade must be run as root.", RED);
         return;
     }
 
+    // Installed name -> version from a single pkginfo call
+    std::vector<std::string> pkginfo_args = { "-i" };
+    std::string installed_packages;
+    shellcmd(CPK_PKGINFO_CMD, pkginfo_args, &installed_packages, false);
+    std::unordered_map<std::string, std::string> installed;
+    std::string installed_pkgname, installed_pkgver;
+    std::istringstream installed_stream(installed_packages);
+    while (installed_stream >> installed_pkgname >> installed_pkgver) {
+        installed[installed_pkgname] = installed_pkgver;
+    }
+
+    // Requested ports (a name#version spec upgrades to the unpinned revision, as before)
+    std::vector<std::string> requested;
+    for (const std::string& pkg : args) {
+        requested.push_back(pkg.substr(0, pkg.find('#')));
+    }
+
+    // Index revision of each port of interest (the installed set and the
+    // requested names), chosen as find_package() resolves the port
+    std::unordered_map<std::string, std::string> available;
+    const std::unordered_set<std::string> requested_set(requested.begin(), requested.end());
+    std::vector<std::pair<std::string_view, CpkIndexRevision>> selected;
+    if (!cpk_index_selected_revisions(selected)) {
+        cpk_print_missing_index_error();
+        return;
+    }
+    for (const auto& entry : selected) {
+        std::string name(entry.first);
+        if (installed.count(name) || requested_set.count(name)) {
+            available.emplace(std::move(name), std::string(entry.second.version));
+        }
+    }
+
     std::vector<std::string> packages;
 
     // If no specific packages are provided, upgrade only packages with newer versions available
     if (args.empty()) {
-        // Get installed packages
-        std::vector<std::string> pkginfo_args = { "-i" };
-        std::string installed_packages;
-        shellcmd(CPK_PKGINFO_CMD, pkginfo_args, &installed_packages, false);
-
-        // Read installed packages line by line and split into name & version
-        std::string installed_pkgname, installed_pkgver;
-        std::string package, pkgname, pkgver, pkgarch;
-        std::istringstream installed_stream(installed_packages);
-
-        while (installed_stream >> installed_pkgname >> installed_pkgver) {
-            if (find_package(installed_pkgname, package, pkgname, pkgver, pkgarch)) {
-                if (installed_pkgname == pkgname && compare_versions(installed_pkgver, pkgver) < 0) {
-                    // Only add if available version is newer than installed
-                    packages.push_back(installed_pkgname);
-                }
+        for (const auto& entry : available) {
+            if (compare_versions(installed[entry.first], entry.second) < 0) {
+                packages.push_back(entry.first);
             }
         }
+        std::sort(packages.begin(), packages.end());
 
         if (packages.empty()) {
             print_message("No packages with newer versions available", GREEN);
@@ -41,24 +74,44 @@ void cmd_upgrade(const std::vector<std::string>& args) {
         }
     }
     else {
-        packages = args;
+        for (const std::string& pkg : requested) {
+            if (!available.count(pkg)) {
+                print_message("Package " + pkg + " not found in index", RED);
+                cpk_print_did_you_mean(pkg);
+            } else if (!installed.count(pkg)) {
+                print_message("Package " + pkg + " is not installed", YELLOW);
+            } else {
+                packages.push_back(pkg);
+            }
+        }
+        if (packages.empty()) {
+            return;
+        }
     }
 
-    // Check which packages have updates available and upgrade them
-    for (const std::string& pkg : packages) {
-        std::string package, pkgname, pkgver, pkgarch;
-        if (find_package(pkg, package, pkgname, pkgver, pkgarch)) {
-            if (is_package_installed(pkgname)) {
-                cmd_install({pkgname, "--upgrade"});
-            }
-            else {
-                print_message("Package " + pkgname + " is not installed", YELLOW);
-            }
+    // Combined closure of every package to upgrade: new dependencies are
+    // installed, installed ones are left alone, all in one topological order
+    CpkInstallPlan plan;
+    if (!cpk_plan_install(packages, plan)) {
+        print_message("Failed to resolve dependency tree", RED);
+        return;
+    }
+    const std::unordered_set<std::string> upgrade_specs(packages.begin(), packages.end());
+    if (dry_run) {
+        std::unordered_set<std::string> installed_names;
+        for (const auto& entry : installed) {
+            installed_names.insert(entry.first);
         }
-        else {
-            print_message("Package " + pkg + " not found in index", RED);
+        print_plan_dry_run(plan.order, upgrade_specs, installed_names);
+        return;
+    }
+    std::vector<std::string> pending;
+    for (const auto& spec : plan.order) {
+        if (upgrade_specs.count(spec) || !installed.count(spec)) {
+            pending.push_back(spec);
         }
     }
- 
+    install_plan_specs(pending, upgrade_specs);
+
     return;
 }
@@ -1,15 +1,256 @@
 #include "../cpk.h"
 #include "../utils.h"
 #include "../fs_compat.h"
+#include <cstdlib>
 #include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
+// Outcome of checking one port tree against its .signature
+struct PortVerification {
+    std::string name;
+    std::string version;
+    std::string dir;
+    bool ok = false;
+    const CpkSignifyKey* key = nullptr;
+    std::string error;                    // signature itself did not verify
+    std::vector<std::string> mismatched;  // listed files whose checksum differs
+    std::vector<std::string> missing;     // listed files not present (sources not downloaded)
+};
+
+static std::vector<CpkSignifyKey> load_public_keys(const std::string& directory) {
+    std::vector<CpkSignifyKey> keys;
+    std::error_code ec;
+    if (!fs::is_directory(directory, ec)) {
+        return keys;
+    }
+    for (const auto& path : find_public_keys(directory)) {
+        CpkSignifyKey key;
+        if (cpk_signify_read_key(path, key)) {
+            keys.push_back(key);
+        } else if (CPK_VERBOSE) {
+            print_message("Warning: not a signify public key: " + path, YELLOW);
+        }
+    }
+    return keys;
+}
+
+// What signify -C does, in-process: verify the signed checksum list with the
+// key the signature names, then hash every "SHA256 (file) = digest" entry in dir.
+// ok ignores missing files; callers decide whether those count as failures.
+static void verify_port_tree(PortVerification& v, const std::vector<CpkSignifyKey>& keys) {
+    std::ifstream file(v.dir + "/.signature", std::ios::binary);
+    if (!file.is_open()) {
+        v.error = "no .signature";
+        return;
+    }
+    const std::string signature((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string_view message;
+    if (!cpk_signify_verify(signature, keys, message, v.key, v.error)) {
+        return;
+    }
+    size_t pos = 0;
+    while (pos < message.size()) {
+        size_t end = message.find('\n', pos);
+        if (end == std::string_view::npos) {
+            end = message.size();
+        }
+        const std::string_view line = message.substr(pos, end - pos);
+        pos = end + 1;
+        if (line.empty()) {
+            continue;
+        }
+        const size_t open = line.find(" (");
+        const size_t close = line.rfind(") = ");
+        if (open == std::string_view::npos || close == std::string_view::npos || close < open) {
+            v.error = "malformed checksum line: " + std::string(line);
+            return;
+        }
+        const std::string algorithm(line.substr(0, open));
+        const std::string name(line.substr(open + 2, close - open - 2));
+        const std::string digest(line.substr(close + 4));
+        if (algorithm != "SHA256") {
+            v.error = "unsupported checksum " + algorithm + " for " + name;
+            return;
+        }
+        const std::string path = v.dir + "/" + name;
+        std::error_code ec;
+        if (!fs::exists(path, ec)) {
+            v.missing.push_back(name);
+            continue;
+        }
+        if (calculate_sha256(path) != digest) {
+            v.mismatched.push_back(name);
+        }
+    }
+    v.ok = v.mismatched.empty();
+}
+
+// Extracted port trees under cpk_home_dir and the user cache ("<name>/<version>/Pkgfile")
+static void add_cached_ports(const std::string& root, std::map<std::string, PortVerification>& ports) {
+    std::error_code ec;
+    for (const auto& name : fs::directory_iterator(root, ec)) {
+        if (!fs::is_directory(name.path(), ec)) {
+            continue;
+        }
+        for (const auto& version : fs::directory_iterator(name.path(), ec)) {
+            const std::string dir = version.path().string();
+            if (!fs::exists(dir + "/Pkgfile", ec) || ports.count(dir)) {
+                continue;
+            }
+            PortVerification v;
+            v.name = name.path().filename().string();
+            v.version = version.path().filename().string();
+            v.dir = dir;
+            ports.emplace(dir, v);
+        }
+    }
+}
+
+// cpk verify --all: every installed port (fetched from the repository when no
+// tree is on disk) plus every cached tree, checked concurrently. Sources that
+// were never downloaded are reported, not failed.
+static void verify_all(const std::vector<CpkSignifyKey>& keys, size_t jobs) {
+    std::vector<std::string> pkginfo_args = { "-i" };
+    std::string installed_packages;
+    shellcmd(CPK_PKGINFO_CMD, pkginfo_args, &installed_packages, false);
+    std::unordered_map<std::string, std::string> installed;
+    std::string installed_pkgname, installed_pkgver;
+    std::istringstream installed_stream(installed_packages);
+    while (installed_stream >> installed_pkgname >> installed_pkgver) {
+        installed[installed_pkgname] = installed_pkgver;
+    }
+
+    std::map<std::string, PortVerification> ports;  // by directory
+    std::unordered_map<std::string, std::string> absent;  // installed name -> .cpk to fetch
+    for (const auto& [name, version] : installed) {
+        const std::string dir = resolve_package_extract_dir(name, version);
+        if (fs::exists(dir + "/Pkgfile")) {
+            PortVerification v;
+            v.name = name;
+            v.version = version;
+            v.dir = dir;
+            ports.emplace(dir, v);
+        } else {
+            absent.emplace(name, std::string());
+        }
+    }
+    if (!absent.empty()) {
+        cpk_for_each_index_line(get_cpkindex_path(), [&](const CpkIndexLine& line) {
+            const auto it = absent.find(std::string(line.name));
+            if (it != absent.end() && line.version == installed[it->first]) {
+                it->second.assign(line.package);
+            }
+        });
+        std::vector<std::string> fetch;
+        for (const auto& [name, package] : absent) {
+            if (!package.empty() && !fs::exists(get_cache_file(package))) {
+                fetch.push_back(package);
+            }
+        }
+        if (fetch.size() > 1) {
+            fetch_pack_members(fetch);
+        }
+        for (const auto& [name, package] : absent) {
+            if (package.empty()) {
+                print_message("Warning: no port for installed " + name + " " + installed[name] + " in the index", YELLOW);
+                continue;
+            }
+            const std::string package_path = get_cache_file(package);
+            if (!download_file(cpk_repo_join(url_encode(package)), package_path) ||
+                !extract_package(package_path, get_cache_dir())) {
+                print_message("Failed to retrieve port " + package, RED);
+                continue;
+            }
+            PortVerification v;
+            v.name = name;
+            v.version = installed[name];
+            v.dir = get_cache_dir() + "/" + name + "/" + v.version;
+            ports.emplace(v.dir, v);
+        }
+    }
+    add_cached_ports(CPK_HOME_DIR, ports);
+    add_cached_ports(get_cache_dir(), ports);
+
+    std::vector<PortVerification> results;
+    results.reserve(ports.size());
+    for (auto& entry : ports) {
+        results.push_back(std::move(entry.second));
+    }
+    cpk_parallel_for_each(results, jobs, [&](PortVerification& v) { verify_port_tree(v, keys); });
+
+    size_t failed = 0, partial = 0;
+    for (const auto& v : results) {
+        const std::string label = v.name + " " + v.version;
+        if (!v.error.empty()) {
+            ++failed;
+            print_message("FAILED " + label + ": " + v.error, RED);
+        } else if (!v.ok) {
+            ++failed;
+            std::string files;
+            for (const auto& name : v.mismatched) {
+                files += " " + name;
+            }
+            print_message("FAILED " + label + ": checksum mismatch:" + files, RED);
+        } else if (!v.missing.empty()) {
+            ++partial;
+            if (CPK_VERBOSE) {
+                print_message("ok " + label + " (" + std::to_string(v.missing.size()) + " source(s) not downloaded)");
+            }
+        } else if (CPK_VERBOSE) {
+            print_message("ok " + label);
+        }
+    }
+    std::string summary = "Verified " + std::to_string(results.size()) + " port(s): " +
+                          std::to_string(results.size() - failed) + " ok, " + std::to_string(failed) + " failed";
+    if (partial) {
+        summary += " (" + std::to_string(partial) + " with sources not downloaded)";
+    }
+    print_message(summary, failed ? RED : GREEN);
+}
+
 void cmd_verify(const std::vector<std::string>& args) {
-    if (args.empty()) {
+    bool all = false;
+    bool selftest = false;
+    long jobs = static_cast<long>(std::thread::hardware_concurrency());
+    std::vector<std::string> packages;
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& a = args[i];
+        if (a == "--all") {
+            all = true;
+        } else if (a == "--selftest") {
+            selftest = true;
+        } else if (a == "-j" && i + 1 < args.size()) {
+            jobs = std::strtol(args[++i].c_str(), nullptr, 10);
+        } else if (a.rfind("-j", 0) == 0 && a.size() > 2) {
+            jobs = std::strtol(a.c_str() + 2, nullptr, 10);
+        } else if (a.rfind("--jobs=", 0) == 0) {
+            jobs = std::strtol(a.c_str() + 7, nullptr, 10);
+        } else {
+            packages.push_back(a);
+        }
+    }
+    if (selftest) {
+        std::string failure;
+        if (!cpk_crypto_selftest(failure)) {
+            print_message("Self-test failed: " + failure, RED);
+            return;
+        }
+        print_message("Self-test passed: SHA-256, SHA-512 and Ed25519 known answers");
+        return;
+    }
+    if (!all && packages.empty()) {
         print_message("Package name is required", RED);
         return;
     }
+    if (jobs < 1) {
+        jobs = 1;
+    }
 
     {
         std::ifstream index_probe(get_cpkindex_path());
@@ -19,8 +260,20 @@ void cmd_verify(const std::vector<std::string>& args) {
         }
     }
 
+    // Keys are picked by the key number each signature carries, not by trial
+    const std::vector<CpkSignifyKey> keys = load_public_keys("/etc/ports/");
+    if (keys.empty()) {
+        print_message("No public keys found in /etc/ports/", RED);
+        return;
+    }
+
+    if (all) {
+        verify_all(keys, static_cast<size_t>(jobs));
+        return;
+    }
+
     std::string package, pkgname, pkgver, pkgarch;
-    if (!find_package(args[0], package, pkgname, pkgver, pkgarch, true)) return;
+    if (!find_package(packages[0], package, pkgname, pkgver, pkgarch, true)) return;
 
     const std::string package_url = cpk_repo_join(url_encode(package));
     const std::string cache_dir = get_cache_dir();
@@ -41,13 +294,6 @@ void cmd_verify(const std::vector<std::string>& args) {
         return;
     }
 
-    // Find public keys in /etc/ports/
-    std::vector<std::string> pub_keys = find_public_keys("/etc/ports/");
-    if (pub_keys.empty()) {
-        print_message("No public keys found in /etc/ports/", RED);
-        return;
-    }
-
     // Download missing source files
     std::vector<std::string> pkgmk_args = { "-do" };
     std::string pkgmk_output;
@@ -59,19 +305,24 @@ void cmd_verify(const std::vector<std::string>& args) {
         return;
     }
 
-    // Try each public key until one works
-    for (const std::string& public_key : pub_keys) {
-        std::string signature_cmd = "signify";
-        std::vector<std::string> signature_args = { "-q", "-C", "-p", public_key, "-x", ".signature" };
-        std::string signature_output;
-
-        int ret = shellcmd(signature_cmd, signature_args, &signature_output, false);
-
-        if (ret == 0) {
-            print_message("Verification successful with key: " + public_key);
-            return; // Stop on first success
-        }
+    PortVerification v;
+    v.name = pkgname;
+    v.version = pkgver;
+    v.dir = package_source;
+    verify_port_tree(v, keys);
+    if (!v.error.empty()) {
+        print_message("Verification failed: " + v.error, RED);
+        return;
     }
-
-    print_message("Verification failed for all keys in /etc/ports/", RED);
+    for (const auto& name : v.mismatched) {
+        print_message("Checksum mismatch: " + name, RED);
+    }
+    for (const auto& name : v.missing) {
+        print_message("Missing file: " + name, RED);
+    }
+    if (!v.ok || !v.missing.empty()) {
+        print_message("Verification failed for " + pkgname, RED);
+        return;
+    }
+    print_message("Verification successful with key: " + v.key->path);
 }
@@ -8,6 +8,8 @@
 #include "commands/cmd_list.h"
 #include "commands/cmd_diff.h"
 #include "commands/cmd_verify.h"
+#include "commands/cmd_audit.h"
+#include "commands/cmd_owner.h"
 #include "commands/cmd_build.h"
 #include "commands/cmd_install.h"
 #include "commands/cmd_uninstall.h"
@@ -35,6 +37,7 @@ std::string CPK_PKGINFO_CMD = "pkginfo";
 
 bool CPK_COLOR_MODE = false;
 bool CPK_VERBOSE = false;
+bool CPK_NATIVE_INSTALL = false;
 
 int main(int argc, char* argv[]) {
     // Parse command-line arguments
@@ -94,6 +97,10 @@ int main(int argc, char* argv[]) {
         cmd_diff(args);
     } else if (command == "verify") {
         cmd_verify(args);
+    } else if (command == "audit") {
+        cmd_audit(args);
+    } else if (command == "owner") {
+        cmd_owner(args);
     } else if (command == "build") {
         cmd_build(args);
     } else if (command == "install" || command == "add") {
@@ -18,6 +18,7 @@ extern std::string CPK_PKGINFO_CMD;
 
 extern bool CPK_COLOR_MODE;
 extern bool CPK_VERBOSE;
+extern bool CPK_NATIVE_INSTALL;
 
 // Function prototypes for package management commands
 void cmd_update(const std::vector<std::string>& args);
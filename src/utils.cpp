@@ -8,6 +8,8 @@
 #include <archive_entry.h>
 #include <curl/curl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <iomanip>
 #include <cstdlib>
 #include <stdexcept>
@@ -18,6 +20,15 @@
 #include <cstdio>
 #include <unistd.h>
 #include <unordered_map>
+#include <map>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <memory>
+#include <unordered_set>
+#include <set>
+#include <regex.h>
+#include <sys/file.h>
 
 bool cpk_file_readable(const std::string& path) {
     FILE* fp = fopen(path.c_str(), "rb");
@@ -54,48 +65,73 @@ static size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     return written;
 }
 
-// Function to compare versions semantically
-// Returns: -1 if v1 < v2, 0 if v1 == v2, 1 if v1 > v2
-// Only compares the VERSION part (before the first '-'), ignoring RELEASE
-int compare_versions(const std::string& v1, const std::string& v2) {
-    std::vector<int> ver1, ver2;
-    
-    // Extract version part (before '-') if present and parse v1
-    size_t dash1 = v1.find('-');
-    std::string ver1_str = (dash1 != std::string::npos) ? v1.substr(0, dash1) : v1;
-    std::istringstream iss1(ver1_str);
-    std::string token;
-    while (std::getline(iss1, token, '.')) {
-        try {
-            ver1.push_back(std::stoi(token));
-        } catch (const std::exception& e) {
-            ver1.push_back(0);
-        }
-    }
-    
-    // Extract version part (before '-') if present and parse v2
-    size_t dash2 = v2.find('-');
-    std::string ver2_str = (dash2 != std::string::npos) ? v2.substr(0, dash2) : v2;
-    std::istringstream iss2(ver2_str);
-    while (std::getline(iss2, token, '.')) {
-        try {
-            ver2.push_back(std::stoi(token));
-        } catch (const std::exception& e) {
-            ver2.push_back(0);
+// Version keys: "version[-release]" is split into runs of digits and runs of
+// letters (other characters only separate runs). Each run is encoded so that a
+// plain byte comparison of two keys orders the versions:
+//   digits  -> 0x03, digit count, digits without leading zeros
+//   letters -> 0x02, letters, 0x00
+// The version ends with 0x01 (lower than any further run, so 1.0 < 1.0.1 and
+// 1.0 < 1.0a), followed by the release runs. Trailing zero runs are dropped so
+// 1.0 == 1.0.0, and a missing release counts as 0.
+static void append_version_runs(std::string& key, const char* begin, const char* end) {
+    const size_t start = key.size();
+    size_t nonzero_end = start;
+    const char* p = begin;
+    while (p < end) {
+        const unsigned char c = static_cast<unsigned char>(*p);
+        if (std::isdigit(c)) {
+            while (p < end && *p == '0') {
+                ++p;
+            }
+            const char* digits = p;
+            while (p < end && std::isdigit(static_cast<unsigned char>(*p))) {
+                ++p;
+            }
+            const size_t count = std::min<size_t>(static_cast<size_t>(p - digits), 255);
+            key += '\x03';
+            key += static_cast<char>(count);
+            key.append(digits, count);
+            if (count > 0) {
+                nonzero_end = key.size();
+            }
+        } else if (std::isalpha(c)) {
+            key += '\x02';
+            while (p < end && std::isalpha(static_cast<unsigned char>(*p))) {
+                key += *p++;
+            }
+            key += '\0';
+            nonzero_end = key.size();
+        } else {
+            ++p;
         }
     }
-    
-    // Compare element by element
-    size_t max_len = std::max(ver1.size(), ver2.size());
-    for (size_t i = 0; i < max_len; i++) {
-        int v1_part = (i < ver1.size()) ? ver1[i] : 0;
-        int v2_part = (i < ver2.size()) ? ver2[i] : 0;
-        
-        if (v1_part < v2_part) return -1;
-        if (v1_part > v2_part) return 1;
+    key.resize(nonzero_end);
+}
+
+static void append_version_key(std::string& key, std::string_view version) {
+    const size_t dash = version.rfind('-');
+    const char* data = version.data();
+    const size_t version_end = dash == std::string_view::npos ? version.size() : dash;
+    append_version_runs(key, data, data + version_end);
+    key += '\x01';
+    if (dash != std::string_view::npos) {
+        append_version_runs(key, data + dash + 1, data + version.size());
     }
-    
-    return 0; // They are equal
+}
+
+std::string cpk_version_key(std::string_view version) {
+    std::string key;
+    key.reserve(version.size() * 2 + 4);
+    append_version_key(key, version);
+    return key;
+}
+
+// Function to compare versions semantically
+// Returns: -1 if v1 < v2, 0 if v1 == v2, 1 if v1 > v2, ordering VERSION first
+// and then RELEASE, both by their key
+int compare_versions(const std::string& v1, const std::string& v2) {
+    const int order = cpk_version_key(v1).compare(cpk_version_key(v2));
+    return (order > 0) - (order < 0);
 }
 
 // URL-encodes special characters in the given string
@@ -268,91 +304,134 @@ void print_help_info() {
 }
 
 void print_help_install() {
-    print_message("Usage: cpk install <package> [--upgrade] [--no-deps]");
-    print_message("       cpk install <path/to/package.cpk> [--upgrade] [--no-deps]");
-    print_message("       cpk add <package> [--upgrade] [--no-deps]");
-    print_message("       cpk add <path/to/package.cpk> [--upgrade] [--no-deps]");
+    print_message("Usage: cpk install <package> [--upgrade] [--no-deps] [--dry-run] [--native]");
+    print_message("       cpk install <path/to/package.cpk> [--upgrade] [--no-deps] [--dry-run] [--native]");
+    print_message("       cpk add <package> [--upgrade] [--no-deps] [--dry-run] [--native]");
+    print_message("       cpk add <path/to/package.cpk> [--upgrade] [--no-deps] [--dry-run] [--native]");
     print_message("\nDescription:");
-    print_message("  Must be run as root");
+    print_message("  Must be run as root (except with --dry-run)");
     print_message("  Install or upgrade packages on the system");
     print_message("  add is an alias for install (same behavior)");
     print_message("  By default resolves dependencies from metadata and installs them first");
+    print_message("  When the repository publishes CPKPACK, missing packages are fetched with one byte-range request");
     print_message("\nArguments:");
     print_message("  <package>                Package name (from repository)");
     print_message("  <path/to/package.cpk>    Path to local .cpk file");
     print_message("  --upgrade                Upgrade the requested package if already installed");
     print_message("  --no-deps                Install only the named package (skip dependency tree)");
+    print_message("  --dry-run                Print the plan (installed, cached, download, upgrade) with");
+    print_message("                           download sizes and cache space needed; install nothing");
+    print_message("  --native                 Install in-process instead of with pkgadd: check all packages");
+    print_message("                           for conflicts, extract them honoring pkgadd.conf and rewrite");
+    print_message("                           the package database once (also cpk_native_install in cpk.conf)");
     print_message("\nExamples:");
     print_message("  cpk install vim");
     print_message("  cpk install vim --no-deps");
     print_message("  cpk add vim --upgrade");
+    print_message("  cpk install vim --dry-run");
     print_message("  cpk install /tmp/mypackage#4.1.0-1.i686.cpk");
     print_general_options();
 }
 
 void print_help_uninstall() {
-    print_message("Usage: cpk uninstall <package>");
-    print_message("       cpk del <package>");
-    print_message("       cpk rm <package>");
+    print_message("Usage: cpk uninstall [--cascade] [--dry-run] [--native] <package>...");
+    print_message("       cpk del [--cascade] [--dry-run] [--native] <package>...");
+    print_message("       cpk rm [--cascade] [--dry-run] [--native] <package>...");
     print_message("\nDescription:");
-    print_message("  Must be run as root");
-    print_message("  Remove packages from the system");
+    print_message("  Must be run as root (except with --dry-run)");
+    print_message("  Remove packages from the system, dependents before their dependencies");
+    print_message("  Packages are looked up in the package database, not in the index");
     print_message("\nArguments:");
-    print_message("  <package>                Package name");
+    print_message("  <package>                Installed package name");
+    print_message("  --cascade                Also remove installed packages that depend on them");
+    print_message("                           (otherwise such dependents stop the removal)");
+    print_message("  --dry-run                Print the removal order; remove nothing");
+    print_message("  --native                 Remove in-process with one database rewrite instead of");
+    print_message("                           running pkgrm per package (also cpk_native_install)");
     print_message("\nAliases:");
     print_message("  del, rm                  Aliases for uninstall");
     print_message("\nExamples:");
     print_message("  cpk uninstall vim");
     print_message("  cpk rm vim");
+    print_message("  cpk uninstall vim gvim");
+    print_message("  cpk uninstall python3 --cascade --dry-run");
     print_general_options();
 }
 
 void print_help_update() {
-    print_message("Usage: cpk update");
+    print_message("Usage: cpk update [--arch <arch>]");
     print_message("\nDescription:");
     print_message("  Must be run as root (writes under cpk_home_dir)");
     print_message("  Download CPKINDEX from the repository (embeds each port's .cpk and deps)");
     print_message("  .cpk.info metadata (description/URL) is fetched on demand, not here");
+    print_message("  Also fetches CPKPACK.idx when the repository publishes a pack");
+    print_message("  Fetches only the CPKINDEX.<arch> shard for the host (or --arch) when published");
+    print_message("  Package lookups then prefer the architecture the index was fetched for");
     print_message("  Summary lists new and updated packages by diffing the previous CPKINDEX");
+    print_message("\nArguments:");
+    print_message("  --arch <arch>            Index shard to fetch instead of the host architecture");
     print_message("\nExamples:");
     print_message("  cpk update");
+    print_message("  cpk update --arch armhf");
     print_general_options();
 }
 
 void print_help_deps() {
     print_message("Usage: cpk deps <package>");
+    print_message("       cpk deps --recursive [--missing] <package>...");
+    print_message("       cpk deps --depends-on <dependency> <package>...");
     print_message("\nDescription:");
     print_message("  Show package dependencies (alias for 'cpk info --dependencies')");
+    print_message("  --recursive and --depends-on answer from per-port closure bitsets cached");
+    print_message("  in CPKCLOSURE.idx, rebuilt when the CPKINDEX content changes");
     print_message("\nArguments:");
     print_message("  <package>                Package name");
+    print_message("  --recursive              List every transitive dependency (union for several packages)");
+    print_message("  --missing                With --recursive: only those not installed yet");
+    print_message("  --depends-on <dep>       Tell whether each package depends on <dep>, directly or not");
     print_message("\nExamples:");
     print_message("  cpk deps vim");
+    print_message("  cpk deps --recursive --missing xorg");
+    print_message("  cpk deps --depends-on openssl curl wget");
     print_general_options();
 }
 
 void print_help_deptree() {
-    print_message("Usage: cpk deptree <package>");
-    print_message("       cpk deptree <path/to/package.cpk>");
+    print_message("Usage: cpk deptree [--format=text|dot|json] <package>");
+    print_message("       cpk deptree [--format=text|dot|json] <path/to/package.cpk>");
     print_message("\nDescription:");
     print_message("  Print a recursive dependency tree (similar to prt-get deptree)");
+    print_message("  Each expanded package shows how many packages its whole subtree pulls in");
+    print_message("  and how many of those are already installed");
     print_message("\nArguments:");
     print_message("  <package>                Package name or name#version-release");
     print_message("  <path/to/package.cpk>    Local package file");
+    print_message("  --format=dot             Graphviz digraph of the dependency closure");
+    print_message("  --format=json            Closure as a list of packages with their dependencies");
     print_message("\nExamples:");
     print_message("  cpk deptree vim");
+    print_message("  cpk deptree --format=dot xorg | dot -Tsvg > xorg.svg");
     print_message("  cpk deptree /tmp/foo#1.0-1.i686.cpk");
     print_general_options();
 }
 
 void print_help_search() {
-    print_message("Usage: cpk search <keyword>");
+    print_message("Usage: cpk search [--exact|--regex|--fuzzy] <term>...");
     print_message("\nDescription:");
-    print_message("  Search cpk_home_dir/CPKINDEX by keyword (no root required)");
+    print_message("  Search package names and descriptions in cpk_home_dir/CPKINDEX (no root required)");
+    print_message("  Every term must match; lookups go through the trigram index CPKSEARCH.idx");
     print_message("\nArguments:");
-    print_message("  <keyword>                Search term");
+    print_message("  <term>...                Case-insensitive substrings (all must match)");
+    print_message("\nOptions:");
+    print_message("  --exact                  Match port names exactly");
+    print_message("  --regex                  Treat each term as a regular expression");
+    print_message("  --fuzzy                  List the port names closest to each term (typo tolerant)");
     print_message("\nExamples:");
     print_message("  cpk search vim");
-    print_message("  cpk search editor");
+    print_message("  cpk search text editor");
+    print_message("  cpk search --exact curl");
+    print_message("  cpk search --regex '^lib.*ssl'");
+    print_message("  cpk search --fuzzy firefx");
     print_general_options();
 }
 
@@ -366,48 +445,109 @@ void print_help_list() {
 }
 
 void print_help_diff() {
-    print_message("Usage: cpk diff");
+    print_message("Usage: cpk diff [--json|--tsv]");
     print_message("\nDescription:");
     print_message("  Show differences between installed and available packages");
+    print_message("\nOptions:");
+    print_message("  --json                   Print a JSON array of {package, installed, available}");
+    print_message("  --tsv                    Print tab-separated rows with a header line");
     print_message("\nExamples:");
     print_message("  cpk diff");
+    print_message("  cpk diff --json");
     print_general_options();
 }
 
 void print_help_verify() {
     print_message("Usage: cpk verify <package>");
+    print_message("       cpk verify --all [-j N]");
+    print_message("       cpk verify --selftest");
     print_message("\nDescription:");
     print_message("  Verify integrity of package source files using signatures");
+    print_message("  The .signature is checked with the /etc/ports/*.pub key it names, then every");
+    print_message("  listed file's SHA-256, all in-process");
     print_message("\nArguments:");
     print_message("  <package>                Package name");
+    print_message("  --all                    Verify every installed and cached port; sources that were");
+    print_message("                           never downloaded are reported but do not fail");
+    print_message("  -j N, --jobs=N           Threads for --all (default: number of CPUs)");
+    print_message("  --selftest               Check SHA-256, SHA-512 and Ed25519 against known answers");
     print_message("\nExamples:");
     print_message("  cpk verify vim");
+    print_message("  cpk verify --all -j 8");
+    print_general_options();
+}
+
+void print_help_audit() {
+    print_message("Usage: cpk audit [--hash] [-j N] [<package>...]");
+    print_message("\nDescription:");
+    print_message("  Check installed files of all (or the given) packages under the installation root");
+    print_message("  Every file in the pkgutils database is stat'ed and compared with the port's");
+    print_message("  .footprint; missing, modified and permission-drifted files are reported");
+    print_message("\nArguments:");
+    print_message("  <package>                Installed package name");
+    print_message("  --hash                   Also compare file contents with the cached pkg.tar.*");
+    print_message("  -j N, --jobs=N           Packages audited in parallel (default: number of CPUs)");
+    print_message("\nExamples:");
+    print_message("  cpk audit");
+    print_message("  cpk audit --hash openssh sudo");
+    print_general_options();
+}
+
+void print_help_owner() {
+    print_message("Usage: cpk owner <path>...");
+    print_message("       cpk owner -");
+    print_message("\nDescription:");
+    print_message("  Print the installed package(s) owning each path under the installation root");
+    print_message("  Looks paths up in CPKOWNERS.idx, a sorted table of the pkgutils database file lists");
+    print_message("  rebuilt when the database changes");
+    print_message("\nArguments:");
+    print_message("  <path>                   File or directory, absolute or relative to the root");
+    print_message("  -                        Also read paths from standard input, one per line");
+    print_message("\nExamples:");
+    print_message("  cpk owner /usr/bin/vim");
+    print_message("  find /usr/lib -name '*.so*' | cpk owner -");
     print_general_options();
 }
 
 void print_help_build() {
-    print_message("Usage: cpk build <package>");
+    print_message("Usage: cpk build [--with-deps] [-j N] [--no-cache] <package>...");
+    print_message("       cpk build --stats [N]");
     print_message("\nDescription:");
     print_message("  Must be run as root");
-    print_message("  Build a package from source files using pkgmk");
+    print_message("  Build packages from source files using pkgmk");
+    print_message("  Independent ports build concurrently, each pkgmk in its own port directory");
+    print_message("  Sources are fetched (pkgmk -do) before each build; timings, CPU, max RSS and output");
+    print_message("  size of every run are appended to CPKBUILD.log in the cpk home directory");
+    print_message("  With one job pkgmk keeps the terminal and its output size is not recorded");
     print_message("\nArguments:");
     print_message("  <package>                Package name");
+    print_message("  --with-deps              Also build dependencies that are not installed, in dependency");
+    print_message("                           order; ports another build needs are installed once built");
+    print_message("  -j N, --jobs=N           Run up to N pkgmk processes at a time (default 1); with more");
+    print_message("                           than one, output goes to pkgmk.log in each port directory");
+    print_message("  --no-cache               Always run pkgmk instead of reusing a cached build with the");
+    print_message("                           same Pkgfile, footprint, checksums and dependency versions");
+    print_message("  --stats [N]              Show the N slowest ports from the build log (default 20)");
     print_message("\nExamples:");
     print_message("  cpk build vim");
+    print_message("  cpk build --with-deps -j 16 qt6-base");
+    print_message("  cpk build --stats");
     print_general_options();
 }
 
 void print_help_upgrade() {
-    print_message("Usage: cpk upgrade [<package>...]");
+    print_message("Usage: cpk upgrade [--dry-run] [<package>...]");
     print_message("\nDescription:");
-    print_message("  Must be run as root");
+    print_message("  Must be run as root (except with --dry-run)");
     print_message("  Upgrade all installed packages to the latest versions");
     print_message("  If package names are provided, only upgrade those packages");
     print_message("\nArguments:");
     print_message("  <package>                Optional: specific package(s) to upgrade");
+    print_message("  --dry-run                Print the plan with download sizes; upgrade nothing");
     print_message("\nExamples:");
     print_message("  cpk upgrade");
     print_message("  cpk upgrade vim busybox");
+    print_message("  cpk upgrade --dry-run");
     print_general_options();
 }
 
@@ -422,25 +562,39 @@ void print_help_clean() {
 }
 
 void print_help_index() {
-    print_message("Usage: cpk index <repo>");
+    print_message("Usage: cpk index [--pack] [--keep N [--attic <dir>]] <repo>");
     print_message("\nDescription:");
     print_message("  Create CPKINDEX for a local repository");
+    print_message("  Also writes CPKINDEX.<arch> shards and their CPKSHARDS manifest");
     print_message("\nArguments:");
     print_message("  <repo>                   Path to repository directory");
+    print_message("  --pack                   Also append new .cpk files to CPKPACK and write its CPKPACK.idx offset table");
+    print_message("  --keep N                 List only the newest N revisions of each port (version order)");
+    print_message("  --attic <dir>            Move .cpk files pruned by --keep into <dir>");
     print_message("\nExamples:");
     print_message("  cpk index /path/to/repo");
+    print_message("  cpk index --pack /path/to/repo");
+    print_message("  cpk index --keep 2 --attic /path/to/attic /path/to/repo");
     print_general_options();
 }
 
 void print_help_archive() {
-    print_message("Usage: cpk archive <prtdir> <repo>");
+    print_message("Usage: cpk archive [options] <prtdir> <repo>");
     print_message("\nDescription:");
     print_message("  Create .cpk archive(s) from a directory containing ports");
     print_message("\nArguments:");
     print_message("  <prtdir>                 Path to ports directory");
     print_message("  <repo>                   Path to output repository directory");
+    print_message("  --compress=<codec>       Compress .cpk payloads with none (default), zstd or xz");
+    print_message("  --level=N                Compression level for the selected codec");
+    print_message("  --threads=N              Compression threads for the selected codec");
+    print_message("  --reproducible           Sorted entries, fixed mtime (SOURCE_DATE_EPOCH or 0), uid/gid 0");
+    print_message("  --rebuild-stale          Regenerate .cpk files whose port changed without a version bump");
+    print_message("\nNotes:");
+    print_message("  <repo>/.cpk-archive-manifest records the inputs of each .cpk; unchanged ports are skipped");
     print_message("\nExamples:");
     print_message("  cpk archive /usr/ports /var/cpk/repo");
+    print_message("  cpk archive --compress=zstd --level=19 --reproducible /usr/ports /var/cpk/repo");
     print_general_options();
 }
 
@@ -463,6 +617,8 @@ void print_help(const std::string& command) {
         print_message("  list        List all installed packages");
         print_message("  diff        Show differences between installed and available packages");
         print_message("  verify      Verify integrity of package source files");
+        print_message("  audit       Check installed files against their package footprints");
+        print_message("  owner       Show which installed package owns a file");
         print_message("  build       Build a package from source files");
         print_message("  install     Install or upgrade packages on the system");
         print_message("  add         Alias for install");
@@ -499,6 +655,10 @@ void print_help(const std::string& command) {
             print_help_diff();
         } else if (command == "verify") {
             print_help_verify();
+        } else if (command == "audit") {
+            print_help_audit();
+        } else if (command == "owner") {
+            print_help_owner();
         } else if (command == "build") {
             print_help_build();
         } else if (command == "upgrade") {
@@ -522,8 +682,9 @@ bool extract_package(const std::string& tar_file, const std::string& dest_dir) {
     struct archive* a = archive_read_new();  // Create archive object
     struct archive_entry* entry;
 
-    // Register the format as tar-based
+    // Register the format as tar-based (plain or compressed with any filter)
     archive_read_support_format_tar(a);
+    archive_read_support_filter_all(a);
 
     // Open the archive
     if (archive_read_open_filename(a, tar_file.c_str(), 10240) != ARCHIVE_OK) {
@@ -622,6 +783,10 @@ bool load_cpk_config(const std::string& config_file) {
             std::string verbose;
             iss >> verbose;
             CPK_VERBOSE = ( verbose == "true");
+        } else if (key == "cpk_native_install") {
+            std::string native;
+            iss >> native;
+            CPK_NATIVE_INSTALL = (native == "true");
         } 
     }
 
@@ -739,60 +904,104 @@ bool parse_cpk_filename(const std::string& filepath, std::string& pkgname, std::
     return !pkgname.empty() && !pkgver.empty() && !pkgarch.empty();
 }
 
-static std::string cpk_trim_index_line(std::string line) {
-    while (!line.empty() && (line.back() == '\r' || line.back() == '\n' || line.back() == ' ' || line.back() == '\t')) {
-        line.pop_back();
+bool cpk_parse_index_line(std::string_view line, CpkIndexLine& out) {
+    size_t begin = 0;
+    size_t end = line.size();
+    while (begin < end && (line[begin] == ' ' || line[begin] == '\t')) {
+        ++begin;
     }
-    size_t i = 0;
-    while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
-        ++i;
+    while (end > begin && (line[end - 1] == '\r' || line[end - 1] == '\n' || line[end - 1] == ' ' || line[end - 1] == '\t')) {
+        --end;
     }
-    return line.substr(i);
-}
-
-bool cpk_index_line_valid(const std::string& index_line) {
-    const std::string line = cpk_trim_index_line(index_line);
-    if (line.empty() || line[0] == '#') {
+    if (begin == end || line[begin] == '#') {
         return false;
     }
-    const size_t cpk_pos = line.rfind(".cpk");
-    if (cpk_pos == std::string::npos) {
+    line = line.substr(begin, end - begin);
+
+    const size_t colon = line.find(".cpk:");
+    if (colon == std::string_view::npos || colon == 0) {
         return false;
     }
-    const size_t after = cpk_pos + 4;
-    return after < line.size() && line[after] == ':';
+    out.package = line.substr(0, colon + 4);
+    size_t deps_start = colon + 5;
+    while (deps_start < line.size() && (line[deps_start] == ' ' || line[deps_start] == '\t')) {
+        ++deps_start;
+    }
+    out.deps = line.substr(deps_start);
+
+    // name#version-release.arch.cpk
+    const size_t hash = out.package.find('#');
+    const size_t dot = out.package.rfind('.', colon - 1);
+    if (hash != std::string_view::npos && dot != std::string_view::npos && hash < dot) {
+        out.name = out.package.substr(0, hash);
+        out.version = out.package.substr(hash + 1, dot - hash - 1);
+        out.arch = out.package.substr(dot + 1, colon - dot - 1);
+    } else {
+        out.name = out.version = out.arch = std::string_view();
+    }
+    return true;
 }
 
-std::string cpk_index_line_package(const std::string& index_line) {
-    if (!cpk_index_line_valid(index_line)) {
-        return "";
+CpkFileBuffer::~CpkFileBuffer() {
+    if (mapping != nullptr) {
+        munmap(mapping, size);
     }
-    const std::string line = cpk_trim_index_line(index_line);
-    const size_t cpk_pos = line.rfind(".cpk");
-    const size_t after = cpk_pos + 4;
-    return line.substr(0, after);
 }
 
-std::string cpk_index_line_deps(const std::string& index_line) {
-    if (!cpk_index_line_valid(index_line)) {
-        return "";
+bool CpkFileBuffer::open(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
     }
-    const std::string line = cpk_trim_index_line(index_line);
-    const size_t cpk_pos = line.rfind(".cpk");
-    const size_t after = cpk_pos + 4;
-    size_t deps_start = after + 1;
-    while (deps_start < line.size() && (line[deps_start] == ' ' || line[deps_start] == '\t')) {
-        ++deps_start;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0) {
+        void* mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+            mapping = mapped;
+            data = static_cast<const char*>(mapped);
+            size = static_cast<size_t>(st.st_size);
+            close(fd);
+            return true;
+        }
+    }
+    // Empty, special or unmappable file: fall back to plain reads
+    char block[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) > 0) {
+        contents.append(block, static_cast<size_t>(n));
+    }
+    close(fd);
+    if (n < 0) {
+        return false;
     }
-    return line.substr(deps_start);
+    data = contents.data();
+    size = contents.size();
+    return true;
+}
+
+// Unpinned revision choice shared by find_package() and the index model:
+// lines for the index architecture first, then the newest version
+static bool preferred_index_revision(const CpkIndexRevision& candidate, const CpkIndexRevision* best,
+                                     std::string_view arch) {
+    if (best == nullptr) {
+        return true;
+    }
+    const bool candidate_arch = candidate.arch == arch;
+    if (candidate_arch != (best->arch == arch)) {
+        return candidate_arch;
+    }
+    return candidate.version_key > best->version_key;
 }
 
 // Helper function to find package details
 // package_name is either "pkgname" (newest version in index) or "pkgname#version-release"
-// (exact version; architecture prefers get_system_architecture() when several match).
+// Both prefer lines for get_index_architecture(), then the newest version.
 bool find_package(const std::string& package_name, std::string& package, std::string& pkgname, std::string& pkgver, std::string& pkgarch, bool report_missing) {
-    const std::string index_file = get_cpkindex_path();
-
     std::string requested_name = package_name;
     std::string requested_version;
     size_t spec_hash = package_name.find('#');
@@ -805,81 +1014,38 @@ bool find_package(const std::string& package_name, std::string& package, std::st
         }
     }
 
-    const std::string search_prefix = requested_name + "#";
-    const std::string sys_arch = requested_version.empty() ? std::string() : get_system_architecture();
-
-    bool result = false;
-    std::string best_version;  // Store the newest version (unpinned queries only)
-    bool pinned_have_system_arch = false;
-
-    bool index_opened = false;
-
-    std::ifstream file(index_file);
-    if (!file.is_open()) {
-        cpk_print_missing_index_error();
-        result = false;
-    } else {
-            index_opened = true;
-            std::string index_line;
-            while (std::getline(file, index_line)) {
-                if (!cpk_index_line_valid(index_line)) {
-                    continue;
-                }
-                const std::string pkg_entry = cpk_index_line_package(index_line);
-                if (pkg_entry.find(search_prefix) != std::string::npos) {
-                    size_t cpk_pos = pkg_entry.rfind(".cpk");
-                    size_t last_dot = pkg_entry.rfind('.', cpk_pos - 1);
-                    size_t hash_pos = pkg_entry.find('#');
-
-                    if (cpk_pos != std::string::npos && last_dot != std::string::npos && hash_pos != std::string::npos) {
-                        std::string temp_pkgname = pkg_entry.substr(0, hash_pos);
-                        std::string temp_pkgver = pkg_entry.substr(hash_pos + 1, last_dot - hash_pos - 1);
-                        std::string temp_pkgarch = pkg_entry.substr(last_dot + 1, cpk_pos - last_dot - 1);
-
-                        if (requested_name != temp_pkgname) {
-                            continue;
-                        }
-
-                        if (!requested_version.empty()) {
-                            if (temp_pkgver != requested_version) {
-                                continue;
-                            }
-                            if (temp_pkgarch == sys_arch) {
-                                pkgname = temp_pkgname;
-                                pkgver = temp_pkgver;
-                                pkgarch = temp_pkgarch;
-                                package = pkg_entry;
-                                result = true;
-                                pinned_have_system_arch = true;
-                            } else if (!pinned_have_system_arch) {
-                                if (!result) {
-                                    pkgname = temp_pkgname;
-                                    pkgver = temp_pkgver;
-                                    pkgarch = temp_pkgarch;
-                                    package = pkg_entry;
-                                    result = true;
-                                }
-                            }
-                        } else {
-                            if (!result || compare_versions(temp_pkgver, best_version) > 0) {
-                                pkgname = temp_pkgname;
-                                pkgver = temp_pkgver;
-                                pkgarch = temp_pkgarch;
-                                package = pkg_entry;
-                                best_version = temp_pkgver;
-                                result = true;
-                            }
-                        }
-                    }
-                }
+    const std::string index_arch = get_index_architecture();
+
+    // Version keys were computed once when the index model was loaded
+    std::vector<CpkIndexRevision> revisions;
+    const bool index_opened = cpk_index_port_revisions(requested_name, revisions);
+    const CpkIndexRevision* best = nullptr;
+    for (const auto& revision : revisions) {
+        if (!requested_version.empty()) {
+            if (revision.version == requested_version &&
+                (best == nullptr || (revision.arch == index_arch && best->arch != index_arch))) {
+                best = &revision;
             }
-        file.close();
+        } else if (preferred_index_revision(revision, best, index_arch)) {
+            best = &revision;
+        }
+    }
+    const bool result = best != nullptr;
+    if (result) {
+        pkgname = requested_name;
+        pkgver.assign(best->version);
+        pkgarch.assign(best->arch);
+        package.assign(best->package);
+    }
+    if (!index_opened) {
+        cpk_print_missing_index_error();
     }
 
     // Index was readable but the package name is simply not listed: tell the
     // caller so single-package commands don't fail silently.
     if (!result && index_opened && report_missing) {
         print_message("Package not found in the index: " + package_name, RED);
+        cpk_print_did_you_mean(package_name);
     }
 
     return result;
@@ -911,24 +1077,11 @@ bool is_package_installed(const std::string& package_name) {
 }
 
 int get_number_of_packages() {
-    const std::string index_file = get_cpkindex_path();
-    std::ifstream file(index_file);
-    if (!file.is_open()) {
+    int package_count = 0;
+    if (!cpk_for_each_index_line(get_cpkindex_path(), [&](const CpkIndexLine&) { ++package_count; })) {
         cpk_print_missing_index_error();
         return -1;
     }
-
-    int package_count = 0;
-    std::string index_line;
-    
-    // Read the file line by line and count the lines (packages)
-    while (std::getline(file, index_line)) {
-        if (cpk_index_line_valid(index_line)) {
-            ++package_count;
-        }
-    }
-
-    file.close();  // Close the file
     return package_count;
 }
 
@@ -958,20 +1111,58 @@ void print_fmt_header(const std::string& header_text) {
 
 // Function to print lines in formatted columns
 void print_fmt_lines(const std::string& text) {
-    std::string line;
-    std::istringstream line_stream(text);
-
-    while (std::getline(line_stream, line)) {
-        std::istringstream columns(line);
-        std::string col1, col2, col3;
+    // Pad the first three columns to 40/20/20 like print_fmt_header() and
+    // write everything with one flush
+    static const size_t widths[] = {40, 20, 20};
+    std::string out;
+    out.reserve(text.size() + text.size() / 2);
+    const std::string_view all(text);
+    size_t pos = 0;
+    while (pos < all.size()) {
+        size_t end = all.find('\n', pos);
+        if (end == std::string_view::npos) {
+            end = all.size();
+        }
+        const std::string_view line = all.substr(pos, end - pos);
+        size_t i = 0;
+        for (size_t col = 0; col < 3; ++col) {
+            while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i]))) {
+                ++i;
+            }
+            const size_t start = i;
+            while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i]))) {
+                ++i;
+            }
+            out.append(line.substr(start, i - start));
+            if (i - start < widths[col]) {
+                out.append(widths[col] - (i - start), ' ');
+            }
+        }
+        out += '\n';
+        pos = end + 1;
+    }
+    std::cout << out << std::flush;
+}
 
-        columns >> col1 >> col2 >> col3;
-        std::cout << std::left
-                  << std::setw(40) << col1
-                  << std::setw(20) << col2
-                  << std::setw(20) << col3
-                  << std::endl;
+void cpk_append_json_string(std::string& out, std::string_view text) {
+    out += '"';
+    for (const char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
     }
+    out += '"';
 }
 
 // Function to find all `.pub` files in `/etc/ports/`
@@ -1018,38 +1209,129 @@ void copy_files(const fs::path &source_dir, const fs::path &dest_dir, const std:
     }
 }
 
-// Function to package files into a .cpk archive
-void package_files(const std::string &name, const std::string &version, const std::string &release, const std::string &arch, const fs::path &output_dir) {
-    fs::path package_path = output_dir / (name + "#" + version + "-" + release + "." + arch + ".cpk");
+bool cpk_archive_compress_supported(const std::string& compress) {
+    return compress == "none" || compress == "zstd" || compress == "xz";
+}
 
-    struct archive *a = archive_write_new();
-    archive_write_set_format_pax_restricted(a);
-    archive_write_open_filename(a, package_path.c_str());
+// Attach the requested compression filter (and its options) to a write archive
+static bool add_archive_write_filter(struct archive *a, const CpkArchiveOptions &options) {
+    int ret = ARCHIVE_OK;
+    if (options.compress == "zstd") {
+        ret = archive_write_add_filter_zstd(a);
+    } else if (options.compress == "xz") {
+        ret = archive_write_add_filter_xz(a);
+    } else if (options.compress != "none") {
+        print_message("Unsupported compression: " + options.compress + " (use none, zstd or xz)", RED);
+        return false;
+    }
+    if (ret != ARCHIVE_OK) {
+        print_message("Failed to enable " + options.compress + " compression: " + std::string(archive_error_string(a)), RED);
+        return false;
+    }
+    if (options.compress == "none") {
+        return true;
+    }
+    if (options.level >= 0) {
+        const std::string level = std::to_string(options.level);
+        if (archive_write_set_filter_option(a, nullptr, "compression-level", level.c_str()) != ARCHIVE_OK) {
+            print_message("Invalid compression level for " + options.compress + ": " + level, RED);
+            return false;
+        }
+    }
+    if (options.threads > 0) {
+        const std::string threads = std::to_string(options.threads);
+        // Older libarchive releases lack the threads option; compress single-threaded then
+        if (archive_write_set_filter_option(a, nullptr, "threads", threads.c_str()) != ARCHIVE_OK && CPK_VERBOSE) {
+            print_message("Warning: " + options.compress + " threads option not supported by libarchive", YELLOW);
+        }
+    }
+    return true;
+}
 
+// Function to package files into a .cpk archive
+bool package_files(const std::string &name, const std::string &version, const std::string &release, const std::string &arch, const fs::path &output_dir, const CpkArchiveOptions &options) {
+    fs::path package_path = output_dir / (name + "#" + version + "-" + release + "." + arch + ".cpk");
     fs::path basedir = output_dir / name;
+
+    // Collect entries first so reproducible mode can write them in a stable order
+    std::vector<fs::path> files;
     for (const auto &entry : fs::recursive_directory_iterator(basedir)) {
         if (!fs::is_regular_file(entry.path())) {
             // Ommit non-regular files (directories, symlinks, etc.)
             continue;
         }
+        files.push_back(entry.path());
+    }
+    if (options.reproducible) {
+        std::sort(files.begin(), files.end());
+    }
+
+    // Reproducible builds honor SOURCE_DATE_EPOCH like other packaging tools
+    time_t fixed_mtime = 0;
+    if (options.reproducible) {
+        const char* epoch = std::getenv("SOURCE_DATE_EPOCH");
+        if (epoch != nullptr) {
+            try {
+                fixed_mtime = static_cast<time_t>(std::stoll(epoch));
+            } catch (const std::exception& e) {
+                print_message("Ignoring invalid SOURCE_DATE_EPOCH: " + std::string(epoch), YELLOW);
+            }
+        }
+    }
+
+    struct archive *a = archive_write_new();
+    archive_write_set_format_pax_restricted(a);
+    if (!add_archive_write_filter(a, options)) {
+        archive_write_free(a);
+        fs::remove_all(basedir);
+        return false;
+    }
+    if (archive_write_open_filename(a, package_path.c_str()) != ARCHIVE_OK) {
+        print_message("Failed to create " + package_path.string() + ": " + std::string(archive_error_string(a)), RED);
+        archive_write_free(a);
+        fs::remove_all(basedir);
+        return false;
+    }
 
+    bool ok = true;
+    for (const auto &file_path : files) {
         struct archive_entry *entry_struct = archive_entry_new();
 
         // Relative path to .cpk file
-        fs::path rel_path = fs_relative(entry.path(), output_dir);
+        fs::path rel_path = fs_relative(file_path, output_dir);
         archive_entry_set_pathname(entry_struct, rel_path.c_str());
 
         // Setup basic file properties
-        auto filesize = fs::file_size(entry.path());
+        auto filesize = fs::file_size(file_path);
         archive_entry_set_size(entry_struct, filesize);
         archive_entry_set_filetype(entry_struct, AE_IFREG);
         archive_entry_set_perm(entry_struct, 0644);
 
+        if (options.reproducible) {
+            // Only fields that plain ustar can carry, so pax_restricted never emits
+            // extended headers with atime/ctime or host-specific owner names
+            archive_entry_set_mtime(entry_struct, fixed_mtime, 0);
+            archive_entry_set_uid(entry_struct, 0);
+            archive_entry_set_gid(entry_struct, 0);
+            archive_entry_set_uname(entry_struct, "root");
+            archive_entry_set_gname(entry_struct, "root");
+        } else {
+            struct stat st;
+            if (stat(file_path.c_str(), &st) == 0) {
+                archive_entry_set_mtime(entry_struct, st.st_mtime, 0);
+            }
+        }
+
         // Write file header
-        archive_write_header(a, entry_struct);
+        if (archive_write_header(a, entry_struct) != ARCHIVE_OK) {
+            print_message("Failed to add " + rel_path.string() + ": " + std::string(archive_error_string(a)), RED);
+            archive_entry_free(entry_struct);
+            ok = false;
+            break;
+        }
 
         // Write contents of the file
-        std::ifstream file(entry.path(), std::ios::binary);
+        std::ifstream file(file_path, std::ios::binary);
         std::vector<char> buffer(filesize);
         file.read(buffer.data(), buffer.size());
         archive_write_data(a, buffer.data(), buffer.size());
@@ -1057,17 +1339,25 @@ void package_files(const std::string &name, const std::string &version, const st
         archive_entry_free(entry_struct);
     }
 
-    archive_write_close(a);
+    if (archive_write_close(a) != ARCHIVE_OK) {
+        print_message("Failed to finish " + package_path.string() + ": " + std::string(archive_error_string(a)), RED);
+        ok = false;
+    }
     archive_write_free(a);
 
     // Clean up temporary directory
     fs::remove_all(basedir);
+
+    if (!ok) {
+        fs::remove(package_path);
+    }
+    return ok;
 }
 
 
-static bool dependencies_from_local_cpk(const fs::path& cpk_path, std::string& deps_str, const fs::path& work_dir) {
+static bool dependencies_from_local_cpk(const fs::path& cpk_path, std::string& deps_str, std::string& desc, const fs::path& work_dir) {
     const std::string info_path = cpk_path.string() + ".info";
-    std::string name, ver, arch, desc, url;
+    std::string name, ver, arch, url;
     if (fs::exists(info_path) && parse_cpk_info(info_path, name, ver, arch, desc, url, deps_str)) {
         return true;
     }
@@ -1084,388 +1374,3101 @@ static bool dependencies_from_local_cpk(const fs::path& cpk_path, std::string& d
     }
 
     const fs::path pkgfile = work_dir / pkgname / pkgver / "Pkgfile";
-    std::string pn, pd, pu;
-    if (!parse_pkgfile(pkgfile.string(), pn, pd, pu, deps_str)) {
+    std::string pn, pu;
+    if (!parse_pkgfile(pkgfile.string(), pn, desc, pu, deps_str)) {
+        return false;
+    }
+    return true;
+}
+
+// Write CPKINDEX.<arch> for every arch in the repository plus the arch-neutral
+// CPKSHARDS manifest ("<arch> <file> <packages> <sha256>" per shard), and drop
+// shards of arches that no longer have packages.
+static void write_cpk_index_shards(const fs::path &repo_dir, const std::map<std::string, std::string> &shards) {
+    for (const auto &entry : fs::directory_iterator(repo_dir)) {
+        const std::string file = entry.path().filename().string();
+        if (file.rfind("CPKINDEX.", 0) == 0 && file != "CPKINDEX.tmp" && !shards.count(file.substr(9))) {
+            fs::remove(entry.path());
+        }
+    }
+    std::ostringstream manifest;
+    manifest << "# CPKSHARDS: arch file packages sha256\n";
+    for (const auto &shard : shards) {
+        const std::string file = "CPKINDEX." + shard.first;
+        const fs::path tmp = repo_dir / (file + ".tmp");
+        std::ofstream out(tmp);
+        out << shard.second;
+        out.close();
+        fs::rename(tmp, repo_dir / file);
+        const long packages = std::count(shard.second.begin(), shard.second.end(), '\n');
+        manifest << shard.first << ' ' << file << ' ' << packages << ' ' << sha256_hex(shard.second) << '\n';
+    }
+    const fs::path manifest_tmp = repo_dir / "CPKSHARDS.tmp";
+    std::ofstream out(manifest_tmp);
+    out << manifest.str();
+    out.close();
+    fs::rename(manifest_tmp, repo_dir / "CPKSHARDS");
+}
+
+// Rename that falls back to copy and remove when target is on another filesystem
+static bool move_repo_file(const fs::path& source, const fs::path& target) {
+    std::error_code ec;
+    fs::rename(source, target, ec);
+    if (!ec) {
+        return true;
+    }
+    if (ec != std::errc::cross_device_link) {
+        print_message("Failed to move " + source.string() + " to " + target.string() + ": " + ec.message(), RED);
+        return false;
+    }
+    const fs::path part = target.string() + ".part";
+    fs::copy_file(source, part, fs::copy_options::overwrite_existing, ec);
+    if (!ec) {
+        fs::rename(part, target, ec);
+    }
+    if (!ec) {
+        fs::remove(source, ec);
+    }
+    if (ec) {
+        print_message("Failed to move " + source.string() + " to " + target.string() + ": " + ec.message(), RED);
+        fs::remove(part, ec);
         return false;
     }
     return true;
 }
 
 // Function to update the index of a local repository
-void generate_cpk_index(const fs::path &repo_dir) {
-    std::vector<std::string> cpk_files;
+// keep > 0 lists only the newest `keep` revisions of each port and arch; when
+// attic_dir is set the older .cpk (and .cpk.info) files are moved there.
+void generate_cpk_index(const fs::path &repo_dir, int keep, const fs::path &attic_dir) {
+    struct IndexedCpk {
+        std::string file;
+        std::string name;
+        std::string version;
+        std::string version_key;
+        std::string arch;
+    };
+    std::vector<IndexedCpk> cpk_files;
     for (const auto &entry : fs::directory_iterator(repo_dir)) {
         if (fs::is_regular_file(entry.path()) && entry.path().extension() == ".cpk") {
-            cpk_files.push_back(entry.path().filename().string());
+            IndexedCpk cpk;
+            cpk.file = entry.path().filename().string();
+            parse_cpk_filename(cpk.file, cpk.name, cpk.version, cpk.arch);
+            cpk.version_key = cpk_version_key(cpk.version);
+            cpk_files.push_back(cpk);
         }
     }
 
-    std::sort(cpk_files.rbegin(), cpk_files.rend());
+    // Ports keep their reverse-lexical order; revisions of one port are listed
+    // newest first by version so the first line per port is the one to install
+    std::sort(cpk_files.begin(), cpk_files.end(), [](const IndexedCpk& a, const IndexedCpk& b) {
+        if (a.name != b.name) {
+            return a.name > b.name;
+        }
+        if (a.version_key != b.version_key) {
+            return a.version_key > b.version_key;
+        }
+        return a.file > b.file;
+    });
 
     const fs::path work_dir = repo_dir / ".cpk-index-work";
     fs::path index_tmp = repo_dir / "CPKINDEX.tmp";
     std::ofstream index_file(index_tmp);
+    // Per-arch shards (CPKINDEX.<arch>) let clients fetch only their own lines
+    std::map<std::string, std::string> shards;
+    // Descriptions for cpk search, same "<package>: <text>" layout as CPKINDEX
+    fs::path desc_tmp = repo_dir / "CPKDESC.tmp";
+    std::ofstream desc_file(desc_tmp);
     int failures = 0;
+    int pruned = 0;
+    unsigned long long attic_bytes = 0;
+    std::unordered_map<std::string, int> kept_per_port;
+
+    if (!attic_dir.empty() && keep > 0) {
+        ensure_directory(attic_dir);
+    }
 
-    for (const auto &file : cpk_files) {
+    for (const auto &cpk : cpk_files) {
+        const std::string &file = cpk.file;
         const fs::path cpk_path = repo_dir / file;
-        std::string deps_str;
-        if (!dependencies_from_local_cpk(cpk_path, deps_str, work_dir)) {
+        if (keep > 0 && ++kept_per_port[cpk.name + "." + cpk.arch] > keep) {
+            ++pruned;
+            if (!attic_dir.empty()) {
+                const unsigned long long size = fs::file_size(cpk_path);
+                if (move_repo_file(cpk_path, attic_dir / file)) {
+                    attic_bytes += size;
+                    const fs::path info_path = repo_dir / (file + ".info");
+                    if (fs::exists(info_path)) {
+                        move_repo_file(info_path, attic_dir / (file + ".info"));
+                    }
+                }
+            }
+            continue;
+        }
+        std::string deps_str, desc_str;
+        if (!dependencies_from_local_cpk(cpk_path, deps_str, desc_str, work_dir)) {
             ++failures;
             if (CPK_VERBOSE) {
                 print_message("Warning: could not read dependencies for " + file, YELLOW);
             }
         }
-        index_file << file << ": " << deps_str << "\n";
+        const std::string index_line = file + ": " + deps_str + "\n";
+        index_file << index_line;
+        shards[cpk.arch] += index_line;
+        desc_file << file << ": " << desc_str << "\n";
     }
     index_file.close();
     fs::remove_all(work_dir);
+    std::error_code size_ec;
+    const uintmax_t old_index_size = fs::file_size(repo_dir / "CPKINDEX", size_ec);
+    const bool had_index = !size_ec;
+    const uintmax_t new_index_size = fs::file_size(index_tmp, size_ec);
     fs::rename(index_tmp, repo_dir / "CPKINDEX");
+    desc_file.close();
+    fs::rename(desc_tmp, repo_dir / "CPKDESC");
+    write_cpk_index_shards(repo_dir, shards);
     cpk_invalidate_cpkindex_deps_cache();
 
     if (failures > 0) {
         print_message("CPKINDEX: " + std::to_string(failures) + " package(s) have empty deps (check .cpk.info or Pkgfile)", YELLOW);
     }
-}
-
-// Function to get system architecture
-std::string get_system_architecture() {
-    std::string uname_cmd = "uname";
-    std::vector<std::string> uname_args = { "-m" };
-    std::string uname_output;
-
-    // Run the command
-    if (shellcmd(uname_cmd, uname_args, &uname_output, false) != 0 || uname_output.empty()) {
-        print_message("Failed to get system architecture, defaulting to x86_64", YELLOW);
-        uname_output = "x86_64";
-    }
-
-    // Remove newline characters
-    uname_output.erase(std::remove(uname_output.begin(), uname_output.end(), '\n'), uname_output.end());
-
-    // Normalize architecture names
-    if (uname_output == "aarch64" || uname_output == "arm64") {
-        return "arm64";
-    } else if (uname_output == "armv7l" || uname_output == "armv6l") {
-        return "armhf";
-    } else if (uname_output == "x86_64" || uname_output == "amd64") {
-        return "x86_64";
-    } else if (uname_output == "i686") {
-        return "i686";
-    } else if (uname_output == "ppc64") {
-        return "ppc64";
-    } else {
-        print_message("Warning: Unrecognized architecture '" + uname_output + "'", YELLOW);
-        return uname_output;
+    if (pruned > 0) {
+        std::string summary = "CPKINDEX: pruned " + std::to_string(pruned) + " old revision(s)";
+        if (had_index) {
+            summary += ", " + std::to_string(old_index_size) + " -> " + std::to_string(new_index_size) + " bytes";
+        }
+        if (!attic_dir.empty()) {
+            summary += "; moved " + std::to_string(attic_bytes) + " bytes of packages to " + attic_dir.string();
+        }
+        print_message(summary);
     }
 }
 
-// Function to get installed packages
-std::vector<std::string> get_installed_packages() {
-    std::vector<std::string> installed_packages;
-    std::vector<std::string> pkginfo_args = { "-i" };
-    std::string pkginfo_output;
-
-    if (shellcmd(CPK_PKGINFO_CMD, pkginfo_args, &pkginfo_output, false) != 0) {
-        print_message("Failed to get list of installed packages", RED);
+bool read_cpk_pack_index(const std::string& path, std::vector<CpkPackMember>& members) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        return false;
     }
-    else {
-        std::istringstream stream(pkginfo_output);
-        std::string line;
-
-        while (std::getline(stream, line)) {
-            std::istringstream line_stream(line);
-            std::string pkgname;
-            line_stream >> pkgname; // Extract the package name (first column)
-            if (!pkgname.empty()) {
-                installed_packages.push_back(pkgname);
-            }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        CpkPackMember member;
+        if (fields >> member.package >> member.offset >> member.size >> member.sha256) {
+            members.push_back(member);
         }
     }
-
-    return installed_packages;
+    return true;
 }
 
-// Function to calculate SHA256 checksum of a file
-std::string calculate_sha256(const std::string &file_path) {
-    std::string checksum;
-    std::vector<std::string> sha256sum_args;
+// Append every indexed .cpk not yet in the pack to CPKPACK and rewrite CPKPACK.idx.
+// Existing members are never moved, so offsets published in an older index stay
+// valid while mirrors catch up; bytes of removed members remain as dead space
+// until CPKPACK is deleted and rebuilt.
+bool generate_cpk_pack(const fs::path &repo_dir) {
+    const fs::path pack_path = repo_dir / "CPKPACK";
+    const fs::path idx_path = repo_dir / "CPKPACK.idx";
 
-    // Try sha256sum first (Linux), then shasum -a 256 (macOS/BSD)
-    std::string sha256sum_cmd = "sha256sum";
-    sha256sum_args.push_back(file_path);
-    std::string sha256sum_output;
+    // Pack exactly what CPKINDEX lists (revisions pruned by --keep stay out)
+    std::vector<std::string> cpk_files;
+    cpk_for_each_index_line((repo_dir / "CPKINDEX").string(), [&](const CpkIndexLine& line) {
+        const std::string package(line.package);
+        if (fs::is_regular_file(repo_dir / package)) {
+            cpk_files.push_back(package);
+        }
+    });
+    std::sort(cpk_files.begin(), cpk_files.end());
+
+    unsigned long long pack_size = fs::exists(pack_path) ? fs::file_size(pack_path) : 0;
+    std::unordered_map<std::string, CpkPackMember> previous;
+    std::vector<CpkPackMember> old_members;
+    read_cpk_pack_index(idx_path.string(), old_members);
+    for (const auto& member : old_members) {
+        // Entries pointing past the end of the pack cannot be trusted
+        if (member.offset + member.size <= pack_size) {
+            previous[member.package] = member;
+        }
+    }
 
-    int ret = shellcmd(sha256sum_cmd, sha256sum_args, &sha256sum_output, false);
+    std::ofstream pack(pack_path, std::ios::binary | std::ios::app);
+    if (!pack.is_open()) {
+        print_message("Failed to open " + pack_path.string() + " for writing", RED);
+        return false;
+    }
 
-    if (ret != 0) {
-        // Try shasum -a 256 as fallback
-        sha256sum_cmd = "shasum";
-        sha256sum_args.clear();
-        sha256sum_args.push_back("-a");
-        sha256sum_args.push_back("256");
-        sha256sum_args.push_back(file_path);
-        ret = shellcmd(sha256sum_cmd, sha256sum_args, &sha256sum_output, false);
+    std::vector<CpkPackMember> members;
+    int appended = 0;
+    for (const auto& file : cpk_files) {
+        const fs::path cpk_path = repo_dir / file;
+        CpkPackMember member;
+        member.package = file;
+        member.size = fs::file_size(cpk_path);
+        member.sha256 = calculate_sha256(cpk_path.string());
+        if (member.sha256.empty()) {
+            print_message("Failed to read " + cpk_path.string(), RED);
+            return false;
+        }
+        const auto it = previous.find(file);
+        if (it != previous.end() && it->second.size == member.size && it->second.sha256 == member.sha256) {
+            members.push_back(it->second);
+            continue;
+        }
+        std::ifstream in(cpk_path, std::ios::binary);
+        member.offset = pack_size;
+        pack << in.rdbuf();
+        if (!pack) {
+            print_message("Failed to append " + file + " to " + pack_path.string(), RED);
+            return false;
+        }
+        pack_size += member.size;
+        members.push_back(member);
+        ++appended;
+    }
+    pack.close();
+    if (!pack) {
+        print_message("Failed to write " + pack_path.string(), RED);
+        return false;
     }
 
-    if (ret == 0 && !sha256sum_output.empty()) {
-        // Extract checksum (first 64 characters before space)
-        std::istringstream iss(sha256sum_output);
-        iss >> checksum;
+    const fs::path idx_tmp = repo_dir / "CPKPACK.idx.tmp";
+    std::ofstream idx(idx_tmp);
+    idx << "# CPKPACK index: package offset size sha256\n";
+    for (const auto& member : members) {
+        idx << member.package << ' ' << member.offset << ' ' << member.size << ' ' << member.sha256 << '\n';
     }
+    idx.close();
+    if (!idx) {
+        print_message("Failed to write " + idx_tmp.string(), RED);
+        fs::remove(idx_tmp);
+        return false;
+    }
+    fs::rename(idx_tmp, idx_path);
 
-    return checksum;
+    if (CPK_VERBOSE) {
+        print_message("CPKPACK: " + std::to_string(appended) + " appended, " +
+                      std::to_string(members.size() - appended) + " unchanged, " +
+                      std::to_string(pack_size) + " bytes");
+    }
+    return true;
 }
 
-// Function to parse a .cpk.info file
-bool parse_cpk_info(const std::string &info_file_path, std::string &name, std::string &version, std::string &arch, std::string &description, std::string &url, std::string &dependencies) {
-    std::ifstream infile(info_file_path);
-    if (!infile.is_open()) {
-        return false;
+namespace {
+struct PackResponse {
+    FILE* body = nullptr;
+    CURL* curl = nullptr;
+    std::string content_type;
+    std::string content_range;
+};
+
+size_t pack_header_cb(char* buffer, size_t size, size_t nitems, void* userdata) {
+    PackResponse* response = static_cast<PackResponse*>(userdata);
+    std::string header(buffer, size * nitems);
+    while (!header.empty() && (header.back() == '\r' || header.back() == '\n')) {
+        header.pop_back();
+    }
+    std::string lower = header;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (lower.rfind("http/", 0) == 0) {
+        // New response (e.g. after a redirect): forget headers of the previous one
+        response->content_type.clear();
+        response->content_range.clear();
+    } else if (lower.rfind("content-type:", 0) == 0) {
+        response->content_type = ltrim(header.substr(13));
+    } else if (lower.rfind("content-range:", 0) == 0) {
+        response->content_range = ltrim(header.substr(14));
+    }
+    return size * nitems;
+}
+
+size_t pack_write_cb(void* ptr, size_t size, size_t nmemb, void* userdata) {
+    PackResponse* response = static_cast<PackResponse*>(userdata);
+    long http_code = 0;
+    curl_easy_getinfo(response->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 206) {
+        // Server ignored the Range header; do not pull the whole pack
+        return 0;
+    }
+    return fwrite(ptr, size, nmemb, response->body);
+}
+
+// "bytes 100-199/5000" -> [100, 199]
+bool parse_content_range(const std::string& value, unsigned long long& first, unsigned long long& last) {
+    return sscanf(value.c_str(), "bytes %llu-%llu", &first, &last) == 2;
+}
+
+// Byte range of the pack received in the response body
+struct PackSegment {
+    unsigned long long first;
+    unsigned long long last;
+    long body_offset;
+};
+
+bool read_body_line(FILE* fp, std::string& line) {
+    line.clear();
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        if (c == '\n') {
+            break;
+        }
+        line += static_cast<char>(c);
     }
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    return c != EOF || !line.empty();
+}
 
+// Locate the parts of a multipart/byteranges body without copying them
+bool parse_multipart_segments(FILE* fp, const std::string& boundary, std::vector<PackSegment>& segments) {
+    const std::string delimiter = "--" + boundary;
     std::string line;
-    bool found_valid_field = false;
-    while (std::getline(infile, line)) {
-        // Skip empty lines and comments
-        if (line.empty() || line[0] == '#') {
+    while (read_body_line(fp, line)) {
+        if (line == delimiter + "--") {
+            return true;
+        }
+        if (line != delimiter) {
             continue;
         }
-
-        // Check if this looks like HTML (common in 404 pages)
-        if (line.find("<html") != std::string::npos || line.find("<!DOCTYPE") != std::string::npos) {
-            infile.close();
+        PackSegment segment{0, 0, 0};
+        bool have_range = false;
+        while (read_body_line(fp, line) && !line.empty()) {
+            std::string lower = line;
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            if (lower.rfind("content-range:", 0) == 0) {
+                have_range = parse_content_range(ltrim(line.substr(14)), segment.first, segment.last);
+            }
+        }
+        if (!have_range || segment.last < segment.first) {
+            return false;
+        }
+        segment.body_offset = ftell(fp);
+        segments.push_back(segment);
+        if (fseek(fp, static_cast<long>(segment.last - segment.first + 1), SEEK_CUR) != 0) {
             return false;
         }
+    }
+    return !segments.empty();
+}
 
-        // Find the colon separator
-        size_t colon_pos = line.find(':');
-        if (colon_pos == std::string::npos) {
+// Copy one member out of the response body into the cache, verifying its checksum
+bool extract_pack_member(FILE* body, const PackSegment& segment, const CpkPackMember& member) {
+    const std::string dest = get_cache_file(member.package);
+    const std::string tmp = dest + ".part";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (out == nullptr) {
+        return false;
+    }
+    bool ok = fseek(body, segment.body_offset + static_cast<long>(member.offset - segment.first), SEEK_SET) == 0;
+    std::vector<char> buffer(1 << 16);
+    unsigned long long remaining = member.size;
+    while (ok && remaining > 0) {
+        const size_t want = static_cast<size_t>(std::min<unsigned long long>(remaining, buffer.size()));
+        const size_t got = fread(buffer.data(), 1, want, body);
+        ok = got == want && fwrite(buffer.data(), 1, got, out) == got;
+        remaining -= got;
+    }
+    ok = (fclose(out) == 0) && ok;
+    if (ok && calculate_sha256(tmp) != member.sha256) {
+        print_message("Checksum mismatch for " + member.package + " in CPKPACK", RED);
+        ok = false;
+    }
+    if (!ok) {
+        fs::remove(tmp);
+        return false;
+    }
+    fs::rename(tmp, dest);
+    return true;
+}
+}  // namespace
+
+int fetch_pack_members(const std::vector<std::string>& packages) {
+    std::vector<CpkPackMember> index;
+    if (packages.empty() || !read_cpk_pack_index(get_cpkpack_index_path(), index)) {
+        return 0;
+    }
+    std::unordered_map<std::string, const CpkPackMember*> by_package;
+    for (const auto& member : index) {
+        by_package[member.package] = &member;
+    }
+    std::vector<CpkPackMember> wanted;
+    for (const auto& package : packages) {
+        const auto it = by_package.find(package);
+        if (it != by_package.end() && it->second->size > 0) {
+            wanted.push_back(*it->second);
+        }
+    }
+    if (wanted.empty()) {
+        return 0;
+    }
+    std::sort(wanted.begin(), wanted.end(), [](const CpkPackMember& a, const CpkPackMember& b) {
+        return a.offset < b.offset;
+    });
+
+    // Coalesce members separated by small gaps: a few extra bytes are cheaper
+    // than another part header (or another request on servers without multi-range)
+    const unsigned long long max_gap = 64 * 1024;
+    std::vector<std::pair<unsigned long long, unsigned long long>> ranges;
+    for (const auto& member : wanted) {
+        const unsigned long long last = member.offset + member.size - 1;
+        if (!ranges.empty() && member.offset <= ranges.back().second + 1 + max_gap) {
+            ranges.back().second = std::max(ranges.back().second, last);
+        } else {
+            ranges.emplace_back(member.offset, last);
+        }
+    }
+    std::string range_spec;
+    for (const auto& range : ranges) {
+        if (!range_spec.empty()) {
+            range_spec += ",";
+        }
+        range_spec += std::to_string(range.first) + "-" + std::to_string(range.second);
+    }
+
+    const std::string body_path = get_cache_file("CPKPACK.part");
+    PackResponse response;
+    response.body = fopen(body_path.c_str(), "w+b");
+    if (response.body == nullptr) {
+        return 0;
+    }
+    response.curl = curl_easy_init();
+    if (!response.curl) {
+        fclose(response.body);
+        fs::remove(body_path);
+        return 0;
+    }
+    const std::string pack_url = cpk_repo_join("CPKPACK");
+    if (CPK_VERBOSE) {
+        print_message("Fetching " + std::to_string(wanted.size()) + " package(s) from " + pack_url);
+    }
+    curl_easy_setopt(response.curl, CURLOPT_URL, pack_url.c_str());
+    curl_easy_setopt(response.curl, CURLOPT_RANGE, range_spec.c_str());
+    curl_easy_setopt(response.curl, CURLOPT_HEADERFUNCTION, pack_header_cb);
+    curl_easy_setopt(response.curl, CURLOPT_HEADERDATA, &response);
+    curl_easy_setopt(response.curl, CURLOPT_WRITEFUNCTION, pack_write_cb);
+    curl_easy_setopt(response.curl, CURLOPT_WRITEDATA, &response);
+    curl_easy_setopt(response.curl, CURLOPT_FOLLOWLOCATION, 1L);
+    const CURLcode res = curl_easy_perform(response.curl);
+    long http_code = 0;
+    curl_easy_getinfo(response.curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_cleanup(response.curl);
+
+    std::vector<PackSegment> segments;
+    bool parsed = false;
+    if (res == CURLE_OK && http_code == 206) {
+        fflush(response.body);
+        rewind(response.body);
+        const std::string marker = "boundary=";
+        const size_t b = response.content_type.find(marker);
+        if (response.content_type.find("multipart/byteranges") != std::string::npos && b != std::string::npos) {
+            std::string boundary = response.content_type.substr(b + marker.size());
+            boundary = boundary.substr(0, boundary.find(';'));
+            if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+                boundary = boundary.substr(1, boundary.size() - 2);
+            }
+            parsed = parse_multipart_segments(response.body, boundary, segments);
+        } else {
+            // Single range (or the server merged our ranges into one)
+            PackSegment segment{0, 0, 0};
+            parsed = parse_content_range(response.content_range, segment.first, segment.last);
+            if (parsed) {
+                segments.push_back(segment);
+            }
+        }
+    } else if (CPK_VERBOSE) {
+        print_message("CPKPACK byte-range request not served (HTTP " + std::to_string(http_code) + "), fetching packages individually", YELLOW);
+    }
+
+    int fetched = 0;
+    if (parsed) {
+        for (const auto& member : wanted) {
+            for (const auto& segment : segments) {
+                if (member.offset >= segment.first && member.offset + member.size - 1 <= segment.last) {
+                    if (extract_pack_member(response.body, segment, member)) {
+                        ++fetched;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    fclose(response.body);
+    fs::remove(body_path);
+    return fetched;
+}
+
+std::unordered_map<std::string, unsigned long long> cpk_package_download_sizes(const std::vector<std::string>& packages) {
+    std::unordered_map<std::string, unsigned long long> sizes;
+    std::vector<CpkPackMember> index;
+    if (read_cpk_pack_index(get_cpkpack_index_path(), index)) {
+        const std::unordered_set<std::string> wanted(packages.begin(), packages.end());
+        for (const auto& member : index) {
+            if (member.size > 0 && wanted.count(member.package)) {
+                sizes[member.package] = member.size;
+            }
+        }
+    }
+
+    std::vector<std::string> unknown;
+    for (const auto& package : packages) {
+        if (!sizes.count(package)) {
+            unknown.push_back(package);
+        }
+    }
+    if (unknown.empty()) {
+        return sizes;
+    }
+
+    // HEAD requests for the rest, a few connections at a time on one multi handle
+    CURLM* multi = curl_multi_init();
+    if (!multi) {
+        return sizes;
+    }
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, 8L);
+    std::vector<std::string> urls;
+    urls.reserve(unknown.size());
+    std::unordered_map<CURL*, const std::string*> requests;
+    for (const auto& package : unknown) {
+        CURL* curl = curl_easy_init();
+        if (!curl) {
             continue;
         }
+        urls.push_back(cpk_repo_join(url_encode(package)));
+        curl_easy_setopt(curl, CURLOPT_URL, urls.back().c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_multi_add_handle(multi, curl);
+        requests[curl] = &package;
+    }
+    int running = 0;
+    do {
+        if (curl_multi_perform(multi, &running) != CURLM_OK) {
+            break;
+        }
+        if (running > 0) {
+            curl_multi_wait(multi, nullptr, 0, 1000, nullptr);
+        }
+    } while (running > 0);
 
-        std::string key = line.substr(0, colon_pos);
-        std::string value = line.substr(colon_pos + 1);
+    int queued = 0;
+    while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+        if (msg->msg != CURLMSG_DONE || msg->data.result != CURLE_OK) {
+            continue;
+        }
+        long http_code = 0;
+        curl_off_t length = -1;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &http_code);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        // file:// URLs report no response code
+        if (http_code < 400 && length >= 0) {
+            sizes[*requests[msg->easy_handle]] = static_cast<unsigned long long>(length);
+        }
+    }
+    for (const auto& request : requests) {
+        curl_multi_remove_handle(multi, request.first);
+        curl_easy_cleanup(request.first);
+    }
+    curl_multi_cleanup(multi);
+    return sizes;
+}
 
-        // Trim whitespace from key and value
-        key = ltrim(key);
-        size_t key_end = key.find_last_not_of(" \t\r\n");
-        if (key_end != std::string::npos) {
-            key = key.substr(0, key_end + 1);
-        } else {
-            key.clear();
+std::string cpk_format_bytes(unsigned long long bytes) {
+    static const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (value >= 1024.0 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+        value /= 1024.0;
+        ++unit;
+    }
+    char buf[32];
+    if (unit == 0) {
+        std::snprintf(buf, sizeof(buf), "%lluB", bytes);
+    } else {
+        std::snprintf(buf, sizeof(buf), "%.1f%s", value, units[unit]);
+    }
+    return buf;
+}
+
+// Function to get system architecture
+static std::string detect_system_architecture() {
+    std::string uname_cmd = "uname";
+    std::vector<std::string> uname_args = { "-m" };
+    std::string uname_output;
+
+    // Run the command
+    if (shellcmd(uname_cmd, uname_args, &uname_output, false) != 0 || uname_output.empty()) {
+        print_message("Failed to get system architecture, defaulting to x86_64", YELLOW);
+        uname_output = "x86_64";
+    }
+
+    // Remove newline characters
+    uname_output.erase(std::remove(uname_output.begin(), uname_output.end(), '\n'), uname_output.end());
+
+    // Normalize architecture names
+    if (uname_output == "aarch64" || uname_output == "arm64") {
+        return "arm64";
+    } else if (uname_output == "armv7l" || uname_output == "armv6l") {
+        return "armhf";
+    } else if (uname_output == "x86_64" || uname_output == "amd64") {
+        return "x86_64";
+    } else if (uname_output == "i686") {
+        return "i686";
+    } else if (uname_output == "ppc64") {
+        return "ppc64";
+    } else {
+        print_message("Warning: Unrecognized architecture '" + uname_output + "'", YELLOW);
+        return uname_output;
+    }
+}
+
+// Memoize: uname is forked once per run instead of once per index lookup
+std::string get_system_architecture() {
+    static const std::string arch = detect_system_architecture();
+    return arch;
+}
+
+// Architecture `cpk update` fetched CPKINDEX for (CPKINDEX.arch), else the
+// host; read again after cpk_invalidate_cpkindex_deps_cache()
+static std::string g_index_arch;
+static bool g_index_arch_loaded = false;
+
+std::string get_index_architecture() {
+    if (!g_index_arch_loaded) {
+        std::ifstream in(get_cpkindex_path() + ".arch");
+        std::string recorded;
+        g_index_arch = in >> recorded ? recorded : get_system_architecture();
+        g_index_arch_loaded = true;
+    }
+    return g_index_arch;
+}
+
+// Function to get installed packages
+std::vector<std::string> get_installed_packages() {
+    std::vector<std::string> installed_packages;
+    std::vector<std::string> pkginfo_args = { "-i" };
+    std::string pkginfo_output;
+
+    if (shellcmd(CPK_PKGINFO_CMD, pkginfo_args, &pkginfo_output, false) != 0) {
+        print_message("Failed to get list of installed packages", RED);
+    }
+    else {
+        std::istringstream stream(pkginfo_output);
+        std::string line;
+
+        while (std::getline(stream, line)) {
+            std::istringstream line_stream(line);
+            std::string pkgname;
+            line_stream >> pkgname; // Extract the package name (first column)
+            if (!pkgname.empty()) {
+                installed_packages.push_back(pkgname);
+            }
         }
-        value = ltrim(value);
-        size_t value_end = value.find_last_not_of(" \t\r\n");
-        if (value_end != std::string::npos) {
-            value = value.substr(0, value_end + 1);
+    }
+
+    return installed_packages;
+}
+
+bool cpk_read_pkg_db(const std::string& root, std::vector<CpkInstalledPackage>& out) {
+    CpkFileBuffer db;
+    if (!db.open((fs::path(root) / "var/lib/pkg/db").string())) {
+        return false;
+    }
+    // Records are "name\nversion\nfile\n...\n" separated by an empty line
+    const std::string_view text(db.data, db.size);
+    CpkInstalledPackage* current = nullptr;
+    size_t field = 0;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        const std::string_view line = text.substr(pos, end - pos);
+        pos = end + 1;
+        if (line.empty()) {
+            current = nullptr;
+            continue;
+        }
+        if (current == nullptr) {
+            out.emplace_back();
+            current = &out.back();
+            current->name.assign(line);
+            field = 1;
+        } else if (field == 1) {
+            current->version.assign(line);
+            field = 2;
         } else {
-            value.clear();
+            current->files.emplace_back(line);
+        }
+    }
+    return true;
+}
+
+CpkPkgDbLock::~CpkPkgDbLock() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool CpkPkgDbLock::acquire(const std::string& root, std::string& error) {
+    const std::string dir = (fs::path(root) / "var/lib/pkg").string();
+    fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        error = "could not read directory " + dir + ": " + std::strerror(errno);
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        error = errno == EWOULDBLOCK ? std::string("package database is currently locked by another process")
+                                     : "could not lock directory " + dir + ": " + std::strerror(errno);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool cpk_write_pkg_db(const std::string& root, std::vector<CpkInstalledPackage>& packages, std::string& error) {
+    std::sort(packages.begin(), packages.end(),
+              [](const CpkInstalledPackage& a, const CpkInstalledPackage& b) { return a.name < b.name; });
+    std::string text;
+    for (auto& package : packages) {
+        std::sort(package.files.begin(), package.files.end());
+        text += package.name + '\n' + package.version + '\n';
+        for (const auto& file : package.files) {
+            text += file;
+            text += '\n';
+        }
+        text += '\n';
+    }
+
+    const std::string db = (fs::path(root) / "var/lib/pkg/db").string();
+    const std::string db_new = db + ".incomplete_transaction";
+    const std::string db_backup = db + ".backup";
+    unlink(db_new.c_str());
+    const int fd = ::open(db_new.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+    if (fd < 0) {
+        error = "could not create " + db_new + ": " + std::strerror(errno);
+        return false;
+    }
+    size_t written = 0;
+    while (written < text.size()) {
+        const ssize_t n = write(fd, text.data() + written, text.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = "could not write " + db_new + ": " + std::strerror(errno);
+            close(fd);
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    if (fsync(fd) != 0 || close(fd) != 0) {
+        error = "could not synchronize " + db_new + ": " + std::strerror(errno);
+        return false;
+    }
+    if (unlink(db_backup.c_str()) != 0 && errno != ENOENT) {
+        error = "could not remove " + db_backup + ": " + std::strerror(errno);
+        return false;
+    }
+    if (link(db.c_str(), db_backup.c_str()) != 0 && errno != ENOENT) {
+        error = "could not create " + db_backup + ": " + std::strerror(errno);
+        return false;
+    }
+    if (rename(db_new.c_str(), db.c_str()) != 0) {
+        error = "could not rename " + db_new + " to " + db + ": " + std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+namespace {
+// <root>/etc/pkgadd.conf: "UPGRADE|INSTALL <extended regex> YES|NO" per line.
+// The last rule of an event matching a file decides; unmatched files get YES.
+struct PkgaddRules {
+    struct Rule {
+        bool upgrade;
+        bool action;
+        regex_t regex;
+    };
+    std::vector<Rule> rules;
+
+    PkgaddRules() = default;
+    PkgaddRules(const PkgaddRules&) = delete;
+    PkgaddRules& operator=(const PkgaddRules&) = delete;
+    ~PkgaddRules() {
+        for (auto& rule : rules) {
+            regfree(&rule.regex);
+        }
+    }
+
+    bool load(const std::string& path, std::string& error) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            return true;
+        }
+        std::string line;
+        size_t number = 0;
+        while (std::getline(file, line)) {
+            ++number;
+            std::istringstream iss(line);
+            std::string event, pattern, action, extra;
+            if (!(iss >> event) || event[0] == '#') {
+                continue;
+            }
+            const std::string where = path + ":" + std::to_string(number) + ": ";
+            if (!(iss >> pattern >> action) || (iss >> extra)) {
+                error = where + "wrong number of arguments";
+                return false;
+            }
+            if (event != "UPGRADE" && event != "INSTALL") {
+                error = where + "unknown event '" + event + "'";
+                return false;
+            }
+            if (action != "YES" && action != "NO") {
+                error = where + "unknown action '" + action + "', should be YES or NO";
+                return false;
+            }
+            Rule rule;
+            rule.upgrade = event == "UPGRADE";
+            rule.action = action == "YES";
+            if (regcomp(&rule.regex, pattern.c_str(), REG_EXTENDED | REG_NOSUB) != 0) {
+                error = where + "error compiling regular expression '" + pattern + "'";
+                return false;
+            }
+            rules.push_back(rule);
+        }
+        return true;
+    }
+
+    bool allows(bool upgrade, const std::string& file) const {
+        for (auto it = rules.rbegin(); it != rules.rend(); ++it) {
+            if (it->upgrade == upgrade && regexec(&it->regex, file.c_str(), 0, nullptr, 0) == 0) {
+                return it->action;
+            }
+        }
+        return true;
+    }
+};
+
+// A package of the transaction once its archive was listed and the rules applied
+struct NativeInstall {
+    std::string name;
+    std::string version;
+    std::string archive;
+    std::string pre_install;
+    bool upgrade = false;
+    std::set<std::string> files;               // what the db records (INSTALL NO removed)
+    std::unordered_set<std::string> keep;      // UPGRADE NO: existing file stays, new one is rejected
+    std::vector<std::string> obsolete;         // files of the old version the new one lacks
+};
+}  // namespace
+
+// Member path as the db records it: no leading "./", directories end in "/"
+static std::string pkg_member_path(struct archive_entry* entry) {
+    std::string path = archive_entry_pathname(entry);
+    if (path.rfind("./", 0) == 0) {
+        path.erase(0, 2);
+    }
+    if (archive_entry_filetype(entry) == AE_IFDIR && !path.empty() && path.back() != '/') {
+        path += '/';
+    }
+    return path;
+}
+
+static bool list_pkg_members(const std::string& archive_path, std::vector<std::string>& out) {
+    struct archive* a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_filter_all(a);
+    if (archive_read_open_filename(a, archive_path.c_str(), 1 << 16) != ARCHIVE_OK) {
+        archive_read_free(a);
+        return false;
+    }
+    struct archive_entry* entry;
+    int r;
+    while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
+        std::string path = pkg_member_path(entry);
+        if (!path.empty()) {
+            out.push_back(std::move(path));
+        }
+    }
+    archive_read_free(a);
+    return r == ARCHIVE_EOF;
+}
+
+static bool same_file_contents(const std::string& a, const std::string& b) {
+    CpkFileBuffer first, second;
+    return first.open(a) && second.open(b) && first.size == second.size &&
+           (first.size == 0 || std::memcmp(first.data, second.data, first.size) == 0);
+}
+
+static bool same_symlink_target(const std::string& a, const std::string& b) {
+    std::error_code ec_a, ec_b;
+    const fs::path target_a = fs::read_symlink(a, ec_a);
+    const fs::path target_b = fs::read_symlink(b, ec_b);
+    return !ec_a && !ec_b && target_a == target_b;
+}
+
+// Extract the package under prefix (the root with a trailing "/"). Files the
+// rules keep are written below var/lib/pkg/rejected/ instead, and dropped again
+// when they match what is already installed. Paths that did not exist before
+// are appended to created (relative to prefix) so a failed package can be undone.
+static bool extract_native_package(const NativeInstall& p, const std::string& prefix,
+                                   std::vector<std::string>& created) {
+    struct archive* a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_filter_all(a);
+    if (archive_read_open_filename(a, p.archive.c_str(), 1 << 16) != ARCHIVE_OK) {
+        print_message("Failed to open " + p.archive + ": " + std::string(archive_error_string(a)), RED);
+        archive_read_free(a);
+        return false;
+    }
+    struct archive* disk = archive_write_disk_new();
+    archive_write_disk_set_options(disk, ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME |
+                                             ARCHIVE_EXTRACT_UNLINK | ARCHIVE_EXTRACT_SECURE_NODOTDOT);
+    archive_write_disk_set_standard_lookup(disk);
+
+    const std::string reject_prefix = prefix + "var/lib/pkg/rejected/";
+    bool ok = true;
+    struct archive_entry* entry;
+    int r;
+    while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
+        const std::string path = pkg_member_path(entry);
+        if (!p.files.count(path)) {
+            if (CPK_VERBOSE) {
+                print_message("Ignoring " + path + " (pkgadd.conf)");
+            }
+            continue;
+        }
+        std::string target = prefix + path;
+        struct stat existing;
+        const bool reject = p.keep.count(path) && lstat(target.c_str(), &existing) == 0;
+        if (reject) {
+            target = reject_prefix + path;
+        }
+        struct stat before;
+        if (lstat(target.c_str(), &before) != 0) {
+            std::string relative = target.substr(prefix.size());
+            if (archive_entry_filetype(entry) == AE_IFDIR && relative.back() != '/') {
+                relative += '/';
+            }
+            created.push_back(relative);
+        }
+        archive_entry_set_pathname(entry, target.c_str());
+        if (const char* hardlink = archive_entry_hardlink(entry)) {
+            std::string link_path = hardlink;
+            if (link_path.rfind("./", 0) == 0) {
+                link_path.erase(0, 2);
+            }
+            archive_entry_set_hardlink(entry, (prefix + link_path).c_str());
+        }
+        if (archive_write_header(disk, entry) < ARCHIVE_WARN) {
+            print_message("Failed to extract " + path + ": " + std::string(archive_error_string(disk)), RED);
+            ok = false;
+            break;
+        }
+        const void* block;
+        size_t size;
+        la_int64_t offset;
+        int data;
+        while ((data = archive_read_data_block(a, &block, &size, &offset)) == ARCHIVE_OK) {
+            if (archive_write_data_block(disk, block, size, offset) < ARCHIVE_WARN) {
+                break;
+            }
+        }
+        if (data != ARCHIVE_EOF || archive_write_finish_entry(disk) < ARCHIVE_WARN) {
+            print_message("Failed to extract " + path + ": " + std::string(archive_error_string(data != ARCHIVE_EOF ? a : disk)), RED);
+            ok = false;
+            break;
+        }
+        if (!reject) {
+            continue;
+        }
+        if ((S_ISREG(existing.st_mode) && archive_entry_filetype(entry) == AE_IFREG &&
+             same_file_contents(prefix + path, target)) ||
+            (S_ISLNK(existing.st_mode) && archive_entry_filetype(entry) == AE_IFLNK &&
+             same_symlink_target(prefix + path, target))) {
+            unlink(target.c_str());
+            std::string dir = fs::path(target).parent_path().string();
+            while (dir.size() >= reject_prefix.size() && rmdir(dir.c_str()) == 0) {
+                dir = fs::path(dir).parent_path().string();
+            }
+        } else {
+            print_message("Rejecting " + path + ", keeping existing version", YELLOW);
+        }
+    }
+    if (ok && r != ARCHIVE_EOF) {
+        print_message("Failed to read " + p.archive + ": " + std::string(archive_error_string(a)), RED);
+        ok = false;
+    }
+    if (archive_write_close(disk) < ARCHIVE_WARN) {
+        ok = false;
+    }
+    archive_write_free(disk);
+    archive_read_free(a);
+    return ok;
+}
+
+// Delete root-relative paths, which callers sort in reverse so contents go
+// before their directories; directories still in use elsewhere stay
+static void remove_pkg_paths(const std::string& prefix, const std::vector<std::string>& files) {
+    for (const auto& file : files) {
+        const std::string path = prefix + file;
+        if (file.back() == '/' ? rmdir(path.c_str()) != 0 && errno != ENOTEMPTY && errno != EEXIST && errno != ENOENT
+                               : unlink(path.c_str()) != 0 && errno != ENOENT) {
+            print_message("Warning: could not remove " + path + ": " + std::strerror(errno), YELLOW);
+        }
+    }
+}
+
+static void run_ldconfig(const std::string& root, const std::string& prefix) {
+    if (fs::exists(prefix + "etc/ld.so.conf")) {
+        shellcmd("/sbin/ldconfig", { "-r", root }, nullptr, false);
+    }
+}
+
+bool cpk_native_install(const std::string& root, const std::vector<CpkNativePackage>& packages, size_t& applied) {
+    applied = 0;
+    std::string error;
+    CpkPkgDbLock lock;
+    if (!lock.acquire(root, error)) {
+        print_message("Failed to lock package database: " + error, RED);
+        return false;
+    }
+    std::vector<CpkInstalledPackage> records;
+    if (!cpk_read_pkg_db(root, records)) {
+        print_message("Failed to read package database under " + root, RED);
+        return false;
+    }
+    PkgaddRules rules;
+    if (!rules.load((fs::path(root) / "etc/pkgadd.conf").string(), error)) {
+        print_message(error, RED);
+        return false;
+    }
+    std::string prefix = root;
+    if (prefix.empty() || prefix.back() != '/') {
+        prefix += '/';
+    }
+
+    // Who owns each file and how many packages list each path (directories are shared)
+    std::map<std::string, CpkInstalledPackage> db;
+    std::unordered_map<std::string, std::string> owner;
+    std::unordered_map<std::string, unsigned> refs;
+    for (auto& record : records) {
+        for (const auto& file : record.files) {
+            ++refs[file];
+            if (file.back() != '/') {
+                owner[file] = record.name;
+            }
+        }
+        db[record.name] = std::move(record);
+    }
+
+    // Check the whole batch before touching the root; later packages see the
+    // files earlier ones claim and release
+    std::vector<NativeInstall> batch;
+    std::unordered_set<std::string> released;
+    bool failed = false;
+    for (const auto& package : packages) {
+        NativeInstall p;
+        p.archive = package.archive;
+        p.pre_install = package.pre_install;
+        const std::string filename = fs::path(package.archive).filename().string();
+        const size_t hash = filename.find('#');
+        const size_t suffix = filename.rfind(".pkg.tar");
+        if (hash == std::string::npos || suffix == std::string::npos || suffix <= hash + 1) {
+            print_message("Invalid package file name: " + filename, RED);
+            failed = true;
+            continue;
+        }
+        p.name = filename.substr(0, hash);
+        p.version = filename.substr(hash + 1, suffix - hash - 1);
+        const auto installed = db.find(p.name);
+        if (installed != db.end() && !package.upgrade) {
+            print_message("Package " + p.name + " is already installed (use --upgrade)", RED);
+            failed = true;
+            continue;
+        }
+        p.upgrade = installed != db.end();
+
+        std::vector<std::string> members;
+        if (!list_pkg_members(p.archive, members)) {
+            print_message("Failed to read " + p.archive, RED);
+            failed = true;
+            continue;
+        }
+        for (const auto& path : members) {
+            if (!rules.allows(false, path)) {
+                continue;
+            }
+            p.files.insert(path);
+            if (p.upgrade && path.back() != '/' && !rules.allows(true, path)) {
+                p.keep.insert(path);
+            }
+        }
+
+        std::vector<std::string> conflicts;
+        for (const auto& file : p.files) {
+            if (file.back() == '/') {
+                continue;
+            }
+            const auto it = owner.find(file);
+            struct stat st;
+            if (it != owner.end()) {
+                if (it->second != p.name) {
+                    conflicts.push_back(file + " (" + it->second + ")");
+                }
+            } else if (!released.count(file) && lstat((prefix + file).c_str(), &st) == 0) {
+                conflicts.push_back(file);
+            }
+        }
+        if (!conflicts.empty()) {
+            print_message(p.name + ": " + std::to_string(conflicts.size()) + " file(s) already installed:", RED);
+            for (const auto& file : conflicts) {
+                print_message("  " + file, RED);
+            }
+            failed = true;
+            continue;
+        }
+
+        if (p.upgrade) {
+            for (const auto& file : installed->second.files) {
+                --refs[file];
+                const auto it = owner.find(file);
+                if (it != owner.end() && it->second == p.name) {
+                    owner.erase(it);
+                }
+                if (!p.files.count(file)) {
+                    p.obsolete.push_back(file);
+                    released.insert(file);
+                }
+            }
+        }
+        for (const auto& file : p.files) {
+            ++refs[file];
+            if (file.back() != '/') {
+                owner[file] = p.name;
+            }
+        }
+        batch.push_back(std::move(p));
+    }
+    if (failed) {
+        print_message("Nothing installed", RED);
+        return false;
+    }
+
+    for (auto& p : batch) {
+        if (CPK_VERBOSE) {
+            print_message((p.upgrade ? "Upgrading " : "Installing ") + p.name + " " + p.version);
+        }
+        // As with pkgadd, a package's pre-install runs once the entries before it are on disk
+        if (!p.pre_install.empty()) {
+            run_script(p.pre_install, "Running pre-install script for " + p.name);
+        }
+        std::vector<std::string> created;
+        if (!extract_native_package(p, prefix, created)) {
+            // Take back what the failed package added; files it overwrote stay
+            // listed under their previous owner
+            std::sort(created.rbegin(), created.rend());
+            remove_pkg_paths(prefix, created);
+            failed = true;
+            break;
+        }
+        // Anything still listed by another package stays
+        std::vector<std::string> unused;
+        for (const auto& file : p.obsolete) {
+            if (refs[file] == 0) {
+                unused.push_back(file);
+            }
+        }
+        std::sort(unused.rbegin(), unused.rend());
+        remove_pkg_paths(prefix, unused);
+        CpkInstalledPackage& record = db[p.name];
+        record.name = p.name;
+        record.version = p.version;
+        record.files.assign(p.files.begin(), p.files.end());
+        ++applied;
+    }
+    if (applied == 0) {
+        return false;
+    }
+
+    // One rewrite for the whole batch, covering what did get extracted on failure
+    std::vector<CpkInstalledPackage> committed;
+    committed.reserve(db.size());
+    for (auto& entry : db) {
+        committed.push_back(std::move(entry.second));
+    }
+    if (!cpk_write_pkg_db(root, committed, error)) {
+        print_message("Failed to update package database: " + error, RED);
+        applied = 0;
+        return false;
+    }
+    run_ldconfig(root, prefix);
+    return !failed;
+}
+
+bool cpk_native_remove(const std::string& root, const std::vector<std::string>& names) {
+    std::string error;
+    CpkPkgDbLock lock;
+    if (!lock.acquire(root, error)) {
+        print_message("Failed to lock package database: " + error, RED);
+        return false;
+    }
+    std::vector<CpkInstalledPackage> records;
+    if (!cpk_read_pkg_db(root, records)) {
+        print_message("Failed to read package database under " + root, RED);
+        return false;
+    }
+    std::string prefix = root;
+    if (prefix.empty() || prefix.back() != '/') {
+        prefix += '/';
+    }
+
+    std::unordered_set<std::string> targets(names.begin(), names.end());
+    std::vector<CpkInstalledPackage> remaining;
+    std::vector<const CpkInstalledPackage*> removed;
+    std::unordered_set<std::string> kept;
+    for (const auto& record : records) {
+        if (targets.erase(record.name)) {
+            removed.push_back(&record);
+        } else {
+            kept.insert(record.files.begin(), record.files.end());
+        }
+    }
+    if (!targets.empty()) {
+        for (const auto& name : targets) {
+            print_message("Package " + name + " not installed", RED);
+        }
+        print_message("Nothing removed", RED);
+        return false;
+    }
+
+    // The union of the removed file lists, so directories shared between
+    // them go once all their contents are gone
+    std::vector<std::string> unused;
+    for (const auto* record : removed) {
+        for (const auto& file : record->files) {
+            if (!kept.count(file)) {
+                unused.push_back(file);
+            }
+        }
+    }
+    std::sort(unused.rbegin(), unused.rend());
+    unused.erase(std::unique(unused.begin(), unused.end()), unused.end());
+    remove_pkg_paths(prefix, unused);
+
+    for (auto& record : records) {
+        if (std::find(names.begin(), names.end(), record.name) == names.end()) {
+            remaining.push_back(std::move(record));
+        }
+    }
+    if (!cpk_write_pkg_db(root, remaining, error)) {
+        print_message("Failed to update package database: " + error, RED);
+        return false;
+    }
+    run_ldconfig(root, prefix);
+    return true;
+}
+
+// SHA-256 (FIPS 180-4), computed in-process so hashing many small port files
+// does not fork sha256sum once per file
+namespace {
+struct Sha256 {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char block[64];
+    size_t block_len = 0;
+    uint64_t total_len = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const unsigned char* p) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(p[4 * i]) << 24) | (uint32_t(p[4 * i + 1]) << 16) | (uint32_t(p[4 * i + 2]) << 8) | uint32_t(p[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    void update(const unsigned char* data, size_t len) {
+        total_len += len;
+        while (len > 0) {
+            const size_t n = std::min(len, sizeof(block) - block_len);
+            std::memcpy(block + block_len, data, n);
+            block_len += n;
+            data += n;
+            len -= n;
+            if (block_len == sizeof(block)) {
+                compress(block);
+                block_len = 0;
+            }
+        }
+    }
+
+    std::string hex_digest() {
+        const uint64_t bits = total_len * 8;
+        const unsigned char pad = 0x80;
+        update(&pad, 1);
+        const unsigned char zero = 0;
+        while (block_len != 56) {
+            update(&zero, 1);
+        }
+        unsigned char len_be[8];
+        for (int i = 0; i < 8; ++i) {
+            len_be[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(len_be, 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string out(64, '0');
+        for (int i = 0; i < 32; ++i) {
+            const unsigned char byte = static_cast<unsigned char>(h[i / 4] >> (24 - 8 * (i % 4)));
+            out[2 * i] = digits[byte >> 4];
+            out[2 * i + 1] = digits[byte & 0x0f];
+        }
+        return out;
+    }
+};
+}  // namespace
+
+std::string sha256_hex(const std::string& data) {
+    Sha256 ctx;
+    ctx.update(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+    return ctx.hex_digest();
+}
+
+// Function to calculate SHA256 checksum of a file (empty string if unreadable)
+std::string calculate_sha256(const std::string &file_path) {
+    FILE* fp = fopen(file_path.c_str(), "rb");
+    if (fp == nullptr) {
+        return "";
+    }
+    Sha256 ctx;
+    std::vector<unsigned char> buffer(1 << 16);
+    size_t n;
+    while ((n = fread(buffer.data(), 1, buffer.size(), fp)) > 0) {
+        ctx.update(buffer.data(), n);
+    }
+    const bool failed = ferror(fp) != 0;
+    fclose(fp);
+    return failed ? std::string() : ctx.hex_digest();
+}
+
+// Same digest for a path below dir_fd; every component is opened with
+// O_NOFOLLOW so a symlinked directory cannot point the read outside the tree
+std::string calculate_sha256_at(int dir_fd, const std::string &rel_path) {
+    int fd = dup(dir_fd);
+    size_t start = 0;
+    while (fd >= 0) {
+        const size_t slash = rel_path.find('/', start);
+        const std::string part = rel_path.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+        const bool last = slash == std::string::npos;
+        int next = -1;
+        if (part.empty() || part == ".") {
+            next = last ? -1 : fd;
+        } else if (part != "..") {
+            next = openat(fd, part.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | (last ? 0 : O_DIRECTORY));
+        }
+        if (next != fd) {
+            close(fd);
+        }
+        fd = next;
+        if (last) {
+            break;
+        }
+        start = slash + 1;
+    }
+    if (fd < 0) {
+        return "";
+    }
+    Sha256 ctx;
+    std::vector<unsigned char> buffer(1 << 16);
+    ssize_t n;
+    while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+        ctx.update(buffer.data(), static_cast<size_t>(n));
+    }
+    close(fd);
+    return n < 0 ? std::string() : ctx.hex_digest();
+}
+
+// SHA-512 (FIPS 180-4), the hash inside Ed25519
+namespace {
+struct Sha512 {
+    uint64_t h[8] = {0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+                     0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL};
+    unsigned char block[128];
+    size_t block_len = 0;
+    uint64_t total_len = 0;
+
+    static uint64_t rotr(uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+    void compress(const unsigned char* p) {
+        static const uint64_t k[80] = {
+            0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+            0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+            0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+            0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+            0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+            0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+            0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+            0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+            0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+            0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+            0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+            0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+            0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+            0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+            0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+            0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+            0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+            0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+            0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+            0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL};
+        uint64_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = 0;
+            for (int j = 0; j < 8; ++j) {
+                w[i] = (w[i] << 8) | p[8 * i + j];
+            }
+        }
+        for (int i = 16; i < 80; ++i) {
+            const uint64_t s0 = rotr(w[i - 15], 1) ^ rotr(w[i - 15], 8) ^ (w[i - 15] >> 7);
+            const uint64_t s1 = rotr(w[i - 2], 19) ^ rotr(w[i - 2], 61) ^ (w[i - 2] >> 6);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint64_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 80; ++i) {
+            const uint64_t t1 = hh + (rotr(e, 14) ^ rotr(e, 18) ^ rotr(e, 41)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint64_t t2 = (rotr(a, 28) ^ rotr(a, 34) ^ rotr(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    void update(const unsigned char* data, size_t len) {
+        total_len += len;
+        while (len > 0) {
+            const size_t n = std::min(len, sizeof(block) - block_len);
+            std::memcpy(block + block_len, data, n);
+            block_len += n;
+            data += n;
+            len -= n;
+            if (block_len == sizeof(block)) {
+                compress(block);
+                block_len = 0;
+            }
+        }
+    }
+
+    void digest(unsigned char out[64]) {
+        const uint64_t bits = total_len * 8;
+        const unsigned char pad = 0x80;
+        update(&pad, 1);
+        const unsigned char zero = 0;
+        while (block_len != 112) {
+            update(&zero, 1);
+        }
+        unsigned char len_be[16] = {0};
+        for (int i = 0; i < 8; ++i) {
+            len_be[8 + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(len_be, 16);
+        for (int i = 0; i < 64; ++i) {
+            out[i] = static_cast<unsigned char>(h[i / 8] >> (56 - 8 * (i % 8)));
+        }
+    }
+};
+
+// Ed25519 signature check (RFC 8032) over GF(2^255-19) in 16 limbs of 16
+// bits, after the public-domain TweetNaCl. Verification handles public data
+// only, so none of this needs to be constant time.
+typedef int64_t Gf[16];
+
+const Gf gf0 = {0};
+const Gf gf1 = {1};
+const Gf ed_d = {0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+                 0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203};
+const Gf ed_d2 = {0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+                  0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406};
+const Gf ed_x = {0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+                 0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169};
+const Gf ed_y = {0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+                 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666};
+const Gf ed_sqrtm1 = {0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+                      0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83};
+
+void gf_copy(Gf r, const Gf a) {
+    for (int i = 0; i < 16; ++i) r[i] = a[i];
+}
+
+void gf_carry(Gf o) {
+    for (int i = 0; i < 16; ++i) {
+        o[i] += int64_t(1) << 16;
+        const int64_t c = o[i] >> 16;
+        o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+        o[i] -= c * (int64_t(1) << 16);
+    }
+}
+
+void gf_select(Gf p, Gf q, int b) {
+    const int64_t c = ~(int64_t(b) - 1);
+    for (int i = 0; i < 16; ++i) {
+        const int64_t t = c & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+void gf_pack(unsigned char* o, const Gf n) {
+    Gf m, t;
+    gf_copy(t, n);
+    gf_carry(t);
+    gf_carry(t);
+    gf_carry(t);
+    for (int j = 0; j < 2; ++j) {
+        m[0] = t[0] - 0xffed;
+        for (int i = 1; i < 15; ++i) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        const int b = static_cast<int>((m[15] >> 16) & 1);
+        m[14] &= 0xffff;
+        gf_select(t, m, 1 - b);
+    }
+    for (int i = 0; i < 16; ++i) {
+        o[2 * i] = static_cast<unsigned char>(t[i] & 0xff);
+        o[2 * i + 1] = static_cast<unsigned char>(t[i] >> 8);
+    }
+}
+
+bool gf_equal(const Gf a, const Gf b) {
+    unsigned char c[32], d[32];
+    gf_pack(c, a);
+    gf_pack(d, b);
+    return std::memcmp(c, d, 32) == 0;
+}
+
+int gf_parity(const Gf a) {
+    unsigned char d[32];
+    gf_pack(d, a);
+    return d[0] & 1;
+}
+
+void gf_unpack(Gf o, const unsigned char* n) {
+    for (int i = 0; i < 16; ++i) o[i] = n[2 * i] + (int64_t(n[2 * i + 1]) << 8);
+    o[15] &= 0x7fff;
+}
+
+void gf_add(Gf o, const Gf a, const Gf b) {
+    for (int i = 0; i < 16; ++i) o[i] = a[i] + b[i];
+}
+
+void gf_sub(Gf o, const Gf a, const Gf b) {
+    for (int i = 0; i < 16; ++i) o[i] = a[i] - b[i];
+}
+
+void gf_mul(Gf o, const Gf a, const Gf b) {
+    int64_t t[31] = {0};
+    for (int i = 0; i < 16; ++i) {
+        for (int j = 0; j < 16; ++j) t[i + j] += a[i] * b[j];
+    }
+    for (int i = 0; i < 15; ++i) t[i] += 38 * t[i + 16];
+    for (int i = 0; i < 16; ++i) o[i] = t[i];
+    gf_carry(o);
+    gf_carry(o);
+}
+
+void gf_square(Gf o, const Gf a) {
+    gf_mul(o, a, a);
+}
+
+void gf_invert(Gf o, const Gf in) {
+    Gf c;
+    gf_copy(c, in);
+    for (int a = 253; a >= 0; --a) {
+        gf_square(c, c);
+        if (a != 2 && a != 4) gf_mul(c, c, in);
+    }
+    gf_copy(o, c);
+}
+
+void gf_pow2523(Gf o, const Gf in) {
+    Gf c;
+    gf_copy(c, in);
+    for (int a = 250; a >= 0; --a) {
+        gf_square(c, c);
+        if (a != 1) gf_mul(c, c, in);
+    }
+    gf_copy(o, c);
+}
+
+// Points in extended coordinates (X, Y, Z, T)
+void ed_add(Gf p[4], Gf q[4]) {
+    Gf a, b, c, d, t, e, f, g, h;
+    gf_sub(a, p[1], p[0]);
+    gf_sub(t, q[1], q[0]);
+    gf_mul(a, a, t);
+    gf_add(b, p[0], p[1]);
+    gf_add(t, q[0], q[1]);
+    gf_mul(b, b, t);
+    gf_mul(c, p[3], q[3]);
+    gf_mul(c, c, ed_d2);
+    gf_mul(d, p[2], q[2]);
+    gf_add(d, d, d);
+    gf_sub(e, b, a);
+    gf_sub(f, d, c);
+    gf_add(g, d, c);
+    gf_add(h, b, a);
+    gf_mul(p[0], e, f);
+    gf_mul(p[1], h, g);
+    gf_mul(p[2], g, f);
+    gf_mul(p[3], e, h);
+}
+
+void ed_pack(unsigned char* r, Gf p[4]) {
+    Gf tx, ty, zi;
+    gf_invert(zi, p[2]);
+    gf_mul(tx, p[0], zi);
+    gf_mul(ty, p[1], zi);
+    gf_pack(r, ty);
+    r[31] ^= static_cast<unsigned char>(gf_parity(tx) << 7);
+}
+
+void ed_scalarmult(Gf p[4], Gf q[4], const unsigned char* s) {
+    gf_copy(p[0], gf0);
+    gf_copy(p[1], gf1);
+    gf_copy(p[2], gf1);
+    gf_copy(p[3], gf0);
+    for (int i = 255; i >= 0; --i) {
+        const int b = (s[i / 8] >> (i & 7)) & 1;
+        for (int j = 0; j < 4; ++j) gf_select(p[j], q[j], b);
+        ed_add(q, p);
+        ed_add(p, p);
+        for (int j = 0; j < 4; ++j) gf_select(p[j], q[j], b);
+    }
+}
+
+void ed_scalarbase(Gf p[4], const unsigned char* s) {
+    Gf q[4];
+    gf_copy(q[0], ed_x);
+    gf_copy(q[1], ed_y);
+    gf_copy(q[2], gf1);
+    gf_mul(q[3], ed_x, ed_y);
+    ed_scalarmult(p, q, s);
+}
+
+// Group order L = 2^252 + 27742317777372353535851937790883648493, little-endian
+const int64_t ed_order[32] = {0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7,
+                              0xa2, 0xde, 0xf9, 0xde, 0x14, 0,    0,    0,    0,    0,    0,
+                              0,    0,    0,    0,    0,    0,    0,    0,    0,    0x10};
+
+// Reduce a 512-bit little-endian number modulo the group order L
+void ed_reduce(unsigned char* r) {
+    const int64_t* order = ed_order;
+    int64_t x[64];
+    for (int i = 0; i < 64; ++i) x[i] = r[i];
+    for (int i = 63; i >= 32; --i) {
+        int64_t carry = 0;
+        int j;
+        for (j = i - 32; j < i - 12; ++j) {
+            x[j] += carry - 16 * x[i] * order[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry * 256;
+        }
+        x[j] += carry;
+        x[i] = 0;
+    }
+    int64_t carry = 0;
+    for (int j = 0; j < 32; ++j) {
+        x[j] += carry - (x[31] >> 4) * order[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+    for (int j = 0; j < 32; ++j) x[j] -= carry * order[j];
+    for (int i = 0; i < 32; ++i) {
+        x[i + 1] += x[i] >> 8;
+        r[i] = static_cast<unsigned char>(x[i] & 255);
+    }
+}
+
+// RFC 8032 requires 0 <= s < L; s + L would otherwise verify as well
+bool ed_scalar_canonical(const unsigned char s[32]) {
+    for (int i = 31; i >= 0; --i) {
+        if (s[i] != ed_order[i]) {
+            return s[i] < ed_order[i];
+        }
+    }
+    return false;
+}
+
+// Decode a public key as the negated point, ready for [s]B - [h]A
+bool ed_unpack_negated(Gf r[4], const unsigned char p[32]) {
+    Gf t, chk, num, den, den2, den4, den6;
+    gf_copy(r[2], gf1);
+    gf_unpack(r[1], p);
+    gf_square(num, r[1]);
+    gf_mul(den, num, ed_d);
+    gf_sub(num, num, r[2]);
+    gf_add(den, r[2], den);
+    gf_square(den2, den);
+    gf_square(den4, den2);
+    gf_mul(den6, den4, den2);
+    gf_mul(t, den6, num);
+    gf_mul(t, t, den);
+    gf_pow2523(t, t);
+    gf_mul(t, t, num);
+    gf_mul(t, t, den);
+    gf_mul(t, t, den);
+    gf_mul(r[0], t, den);
+    gf_square(chk, r[0]);
+    gf_mul(chk, chk, den);
+    if (!gf_equal(chk, num)) gf_mul(r[0], r[0], ed_sqrtm1);
+    gf_square(chk, r[0]);
+    gf_mul(chk, chk, den);
+    if (!gf_equal(chk, num)) return false;
+    if (gf_parity(r[0]) == (p[31] >> 7)) gf_sub(r[0], gf0, r[0]);
+    gf_mul(r[3], r[0], r[1]);
+    return true;
+}
+
+// Standard base64 (signify key and signature lines); false on bad input
+bool base64_decode(std::string_view text, std::string& out) {
+    out.clear();
+    uint32_t acc = 0;
+    int bits = 0;
+    for (char ch : text) {
+        int v;
+        if (ch >= 'A' && ch <= 'Z') v = ch - 'A';
+        else if (ch >= 'a' && ch <= 'z') v = ch - 'a' + 26;
+        else if (ch >= '0' && ch <= '9') v = ch - '0' + 52;
+        else if (ch == '+') v = 62;
+        else if (ch == '/') v = 63;
+        else if (ch == '=' || ch == '\r') break;
+        else return false;
+        acc = (acc << 6) | static_cast<uint32_t>(v);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char>((acc >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+// "untrusted comment: ...\n<base64>\n[message]": the decoded blob and the rest
+bool signify_split(std::string_view text, std::string& blob, std::string_view& rest) {
+    static const std::string_view prefix = "untrusted comment: ";
+    if (text.substr(0, prefix.size()) != prefix) {
+        return false;
+    }
+    const size_t first = text.find('\n');
+    if (first == std::string_view::npos) {
+        return false;
+    }
+    size_t second = text.find('\n', first + 1);
+    if (second == std::string_view::npos) {
+        second = text.size();
+    }
+    rest = second < text.size() ? text.substr(second + 1) : std::string_view();
+    return base64_decode(text.substr(first + 1, second - first - 1), blob);
+}
+}  // namespace
+
+bool cpk_archive_member_sha256(const std::string& archive_path, std::unordered_map<std::string, std::string>& out) {
+    struct archive* a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_filter_all(a);
+    if (archive_read_open_filename(a, archive_path.c_str(), 1 << 16) != ARCHIVE_OK) {
+        archive_read_free(a);
+        return false;
+    }
+    struct archive_entry* entry;
+    bool ok = true;
+    int r;
+    // Hard links carry no data; they take their target's digest once it is known
+    std::vector<std::pair<std::string, std::string>> hardlinks;
+    auto member_path = [](std::string path) {
+        if (path.rfind("./", 0) == 0) {
+            path.erase(0, 2);
+        }
+        return path;
+    };
+    while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
+        if (archive_entry_hardlink(entry) != nullptr) {
+            hardlinks.emplace_back(member_path(archive_entry_pathname(entry)),
+                                   member_path(archive_entry_hardlink(entry)));
+            continue;
+        }
+        if (archive_entry_filetype(entry) != AE_IFREG) {
+            continue;
+        }
+        const std::string path = member_path(archive_entry_pathname(entry));
+        Sha256 ctx;
+        const void* block;
+        size_t size;
+        la_int64_t offset;
+        int data;
+        while ((data = archive_read_data_block(a, &block, &size, &offset)) == ARCHIVE_OK) {
+            ctx.update(static_cast<const unsigned char*>(block), size);
+        }
+        if (data != ARCHIVE_EOF) {
+            ok = false;
+            break;
+        }
+        out[path] = ctx.hex_digest();
+    }
+    archive_read_free(a);
+    for (const auto& link : hardlinks) {
+        const auto target = out.find(link.second);
+        if (target != out.end()) {
+            out[link.first] = target->second;
+        }
+    }
+    return ok && r == ARCHIVE_EOF;
+}
+
+bool cpk_ed25519_verify(const unsigned char signature[64], const unsigned char* message, size_t size,
+                        const unsigned char public_key[32]) {
+    Gf p[4], q[4];
+    if (!ed_scalar_canonical(signature + 32) || !ed_unpack_negated(q, public_key)) {
+        return false;
+    }
+    // h = SHA-512(R || A || M) mod L, then check R == [s]B - [h]A
+    Sha512 ctx;
+    ctx.update(signature, 32);
+    ctx.update(public_key, 32);
+    ctx.update(message, size);
+    unsigned char h[64];
+    ctx.digest(h);
+    ed_reduce(h);
+    ed_scalarmult(p, q, h);
+    ed_scalarbase(q, signature + 32);
+    ed_add(p, q);
+    unsigned char r[32];
+    ed_pack(r, p);
+    return std::memcmp(r, signature, 32) == 0;
+}
+
+bool cpk_crypto_selftest(std::string& failure) {
+    auto unhex = [](const char* hex, unsigned char* out, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            out[i] = static_cast<unsigned char>(std::stoi(std::string(hex + 2 * i, 2), nullptr, 16));
+        }
+    };
+    // FIPS 180-4 example "abc"
+    if (sha256_hex("abc") != "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") {
+        failure = "SHA-256 of \"abc\"";
+        return false;
+    }
+    unsigned char digest[64], expected[64];
+    Sha512 sha512;
+    sha512.update(reinterpret_cast<const unsigned char*>("abc"), 3);
+    sha512.digest(digest);
+    unhex("ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+          "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f", expected, 64);
+    if (std::memcmp(digest, expected, 64) != 0) {
+        failure = "SHA-512 of \"abc\"";
+        return false;
+    }
+    // RFC 8032 section 7.1, test 1 (empty message)
+    unsigned char public_key[32], signature[64];
+    unhex("d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a", public_key, 32);
+    unhex("e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e065224901555"
+          "fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b", signature, 64);
+    if (!cpk_ed25519_verify(signature, nullptr, 0, public_key)) {
+        failure = "Ed25519 RFC 8032 test 1";
+        return false;
+    }
+    const unsigned char other = 0x72;
+    if (cpk_ed25519_verify(signature, &other, 1, public_key)) {
+        failure = "Ed25519 accepted a signature over another message";
+        return false;
+    }
+    // Same signature with s + L: valid as a point equation, not canonical
+    int carry = 0;
+    for (int i = 0; i < 32; ++i) {
+        carry += signature[32 + i] + static_cast<int>(ed_order[i]);
+        signature[32 + i] = static_cast<unsigned char>(carry & 0xff);
+        carry >>= 8;
+    }
+    if (cpk_ed25519_verify(signature, nullptr, 0, public_key)) {
+        failure = "Ed25519 accepted a non-canonical s";
+        return false;
+    }
+    return true;
+}
+
+bool cpk_signify_read_key(const std::string& path, CpkSignifyKey& key) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string blob;
+    std::string_view rest;
+    // "Ed", 8-byte key number, 32-byte key
+    if (!signify_split(text, blob, rest) || blob.size() != 42 || blob.compare(0, 2, "Ed") != 0) {
+        return false;
+    }
+    key.path = path;
+    std::memcpy(key.keynum, blob.data() + 2, 8);
+    std::memcpy(key.key, blob.data() + 10, 32);
+    return true;
+}
+
+bool cpk_signify_verify(std::string_view signature_file, const std::vector<CpkSignifyKey>& keys,
+                        std::string_view& message, const CpkSignifyKey*& key, std::string& error) {
+    std::string blob;
+    key = nullptr;
+    // "Ed", 8-byte key number, 64-byte signature; the signed text follows
+    if (!signify_split(signature_file, blob, message) || blob.size() != 74 || blob.compare(0, 2, "Ed") != 0) {
+        error = "malformed signature";
+        return false;
+    }
+    for (const auto& candidate : keys) {
+        if (std::memcmp(candidate.keynum, blob.data() + 2, 8) == 0) {
+            key = &candidate;
+            break;
+        }
+    }
+    if (key == nullptr) {
+        const size_t end = signature_file.find('\n');
+        error = "no public key matches the signature (" + std::string(signature_file.substr(19, end - 19)) + ")";
+        return false;
+    }
+    if (!cpk_ed25519_verify(reinterpret_cast<const unsigned char*>(blob.data() + 10),
+                            reinterpret_cast<const unsigned char*>(message.data()), message.size(), key->key)) {
+        error = "signature verification failed with " + key->path;
+        return false;
+    }
+    return true;
+}
+
+// Function to parse a .cpk.info file
+bool parse_cpk_info(const std::string &info_file_path, std::string &name, std::string &version, std::string &arch, std::string &description, std::string &url, std::string &dependencies) {
+    std::ifstream infile(info_file_path);
+    if (!infile.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    bool found_valid_field = false;
+    while (std::getline(infile, line)) {
+        // Skip empty lines and comments
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        // Check if this looks like HTML (common in 404 pages)
+        if (line.find("<html") != std::string::npos || line.find("<!DOCTYPE") != std::string::npos) {
+            infile.close();
+            return false;
+        }
+
+        // Find the colon separator
+        size_t colon_pos = line.find(':');
+        if (colon_pos == std::string::npos) {
+            continue;
+        }
+
+        std::string key = line.substr(0, colon_pos);
+        std::string value = line.substr(colon_pos + 1);
+
+        // Trim whitespace from key and value
+        key = ltrim(key);
+        size_t key_end = key.find_last_not_of(" \t\r\n");
+        if (key_end != std::string::npos) {
+            key = key.substr(0, key_end + 1);
+        } else {
+            key.clear();
+        }
+        value = ltrim(value);
+        size_t value_end = value.find_last_not_of(" \t\r\n");
+        if (value_end != std::string::npos) {
+            value = value.substr(0, value_end + 1);
+        } else {
+            value.clear();
+        }
+
+        if (key == "name") {
+            name = value;
+            found_valid_field = true;
+        } else if (key == "version") {
+            version = value;
+            found_valid_field = true;
+        } else if (key == "arch") {
+            arch = value;
+            found_valid_field = true;
+        } else if (key == "description") {
+            description = value;
+            found_valid_field = true;
+        } else if (key == "url") {
+            url = value;
+            found_valid_field = true;
+        } else if (key == "dependencies") {
+            dependencies = value;
+            found_valid_field = true;
+        }
+    }
+
+    infile.close();
+    
+    // Return true only if we found at least one valid field (name and version are required)
+    return found_valid_field && !name.empty() && !version.empty();
+}
+
+std::string get_cpkindex_path() {
+    return CPK_HOME_DIR + "/CPKINDEX";
+}
+
+std::string get_cpkpack_index_path() {
+    return CPK_HOME_DIR + "/CPKPACK.idx";
+}
+
+std::string get_cpkdesc_path() {
+    return CPK_HOME_DIR + "/CPKDESC";
+}
+
+// Writable cache: CPK_HOME_DIR when writable, else ~/.cpk (never used for CPKINDEX).
+static std::string resolve_cache_dir() {
+    // Check if we can write to CPK_HOME_DIR
+    if (fs::exists(CPK_HOME_DIR) && fs::is_directory(CPK_HOME_DIR)) {
+        // Try to create a test file to check write permissions
+        std::string test_file = CPK_HOME_DIR + "/.write_test";
+        FILE *test_fp = fopen(test_file.c_str(), "w");
+        if (test_fp != nullptr) {
+            fclose(test_fp);
+            fs::remove(test_file);
+            return CPK_HOME_DIR;
+        }
+    } else {
+        // Try to create CPK_HOME_DIR if it doesn't exist
+        try {
+            fs::create_directories(CPK_HOME_DIR);
+            // Test if we can write
+            std::string test_file = CPK_HOME_DIR + "/.write_test";
+            FILE *test_fp = fopen(test_file.c_str(), "w");
+            if (test_fp != nullptr) {
+                fclose(test_fp);
+                fs::remove(test_file);
+                return CPK_HOME_DIR;
+            }
+        } catch (const std::exception& e) {
+            // Can't create or write to CPK_HOME_DIR, fall through to user cache
+        }
+    }
+
+    // If we couldn't use CPK_HOME_DIR, fallback to user cache directory (~/.cpk)
+    const char* home = std::getenv("HOME");
+    if (home != nullptr) {
+        std::string user_cache = std::string(home) + "/.cpk";
+        // Ensure the directory exists
+        try {
+            fs::create_directories(user_cache);
+            if (CPK_VERBOSE) {
+                print_message("Using user cache directory: " + user_cache, YELLOW);
+            }
+            return user_cache;
+        } catch (const std::exception& e) {
+            // If we can't create user cache dir, use CPK_HOME_DIR anyway
+            return CPK_HOME_DIR;
+        }
+    }
+
+    // If all else fails, return CPK_HOME_DIR
+    return CPK_HOME_DIR;
+}
+
+// Memoize: resolve the cache dir once so the write probe and the verbose
+// "Using user cache directory" notice happen a single time per run.
+std::string get_cache_dir() {
+    static std::string cached;
+    static bool resolved = false;
+    if (!resolved) {
+        cached = resolve_cache_dir();
+        resolved = true;
+    }
+    return cached;
+}
+
+std::string get_cache_file(const std::string &filename) {
+    std::string cache_dir = get_cache_dir();
+    return cache_dir + "/" + filename;
+}
+
+void cpk_print_missing_index_error() {
+    print_message("Package index not found or not readable. Run `sudo cpk update` first", RED);
+}
+
+bool cpk_is_privileged_process() {
+    return geteuid() == static_cast<uid_t>(0);
+}
+
+std::string resolve_cpk_metadata_read_path(const std::string& basename) {
+    const std::string sys = CPK_HOME_DIR + "/" + basename;
+    if (cpk_file_readable(sys)) {
+        return sys;
+    }
+    return get_cache_dir() + "/" + basename;
+}
+
+std::string resolve_package_extract_dir(const std::string& pkgname, const std::string& pkgver) {
+    const std::string sys = CPK_HOME_DIR + "/" + pkgname + "/" + pkgver;
+    if (fs::is_directory(sys) && fs::exists(sys + "/Pkgfile")) {
+        return sys;
+    }
+    return get_cache_dir() + "/" + pkgname + "/" + pkgver;
+}
+
+template <typename Word>
+static void split_dependency_words(std::string_view deps_str, std::vector<Word>& out) {
+    size_t i = 0;
+    while (i < deps_str.size()) {
+        while (i < deps_str.size() && std::isspace(static_cast<unsigned char>(deps_str[i]))) {
+            ++i;
+        }
+        size_t end = i;
+        while (end < deps_str.size() && !std::isspace(static_cast<unsigned char>(deps_str[end]))) {
+            ++end;
+        }
+        std::string_view tok = deps_str.substr(i, end - i);
+        while (!tok.empty() && (tok.back() == ',' || tok.back() == ';')) {
+            tok.remove_suffix(1);
+        }
+        if (!tok.empty()) {
+            out.emplace_back(tok);
+        }
+        i = end;
+    }
+}
+
+// Dependency words of one index line, stored in the index arena
+struct IndexDeps {
+    const std::string_view* words = nullptr;
+    size_t count = 0;
+
+    void copy_to(std::vector<std::string>& out) const {
+        out.assign(words, words + count);
+    }
+};
+
+// Bump allocator: hands out memory from large blocks and frees them all at
+// once on destruction (individual deallocation is a no-op)
+class IndexArena {
+public:
+    explicit IndexArena(size_t block_size) : block_size_(block_size) {}
+
+    void* allocate(size_t size, size_t align) {
+        size_t pad = (align - reinterpret_cast<uintptr_t>(cur_) % align) % align;
+        if (cur_ == nullptr || pad + size > left_) {
+            const size_t block = std::max(block_size_, size + align);
+            blocks_.emplace_back(new char[block]);
+            cur_ = blocks_.back().get();
+            left_ = block;
+            pad = (align - reinterpret_cast<uintptr_t>(cur_) % align) % align;
+        }
+        void* p = cur_ + pad;
+        cur_ += pad + size;
+        left_ -= pad + size;
+        return p;
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* cur_ = nullptr;
+    size_t left_ = 0;
+    size_t block_size_;
+};
+
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    IndexArena* arena;
+
+    explicit ArenaAllocator(IndexArena* a) : arena(a) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return arena != other.arena;
+    }
+};
+
+// One line of a port, chained to the port's next line in index order
+struct IndexRevision {
+    CpkIndexRevision line;
+    IndexDeps deps;
+    const IndexRevision* next = nullptr;
+};
+
+struct IndexPortRevisions {
+    const IndexRevision* first = nullptr;
+    IndexRevision* last = nullptr;
+    const IndexRevision* selected = nullptr;  // the line find_package() picks
+};
+
+using IndexStringSet = std::unordered_set<std::string_view, std::hash<std::string_view>,
+                                          std::equal_to<std::string_view>, ArenaAllocator<std::string_view>>;
+using IndexDepsMap = std::unordered_map<std::string_view, IndexDeps, std::hash<std::string_view>,
+                                        std::equal_to<std::string_view>,
+                                        ArenaAllocator<std::pair<const std::string_view, IndexDeps>>>;
+using IndexRevisionMap = std::unordered_map<std::string_view, IndexPortRevisions, std::hash<std::string_view>,
+                                            std::equal_to<std::string_view>,
+                                            ArenaAllocator<std::pair<const std::string_view, IndexPortRevisions>>>;
+
+// Everything derived from one CPKINDEX load: interned strings, dependency
+// arrays and the lookup tables themselves are bump-allocated from one arena.
+// The tables hold only trivially destructible views, so invalidation frees
+// the arena's blocks without visiting any node.
+struct IndexModel {
+    IndexArena arena;
+    IndexStringSet* strings;   // interned text
+    IndexDepsMap* by_package;
+    IndexDepsMap* by_port;     // per port, the line find_package() picks
+    IndexRevisionMap* revisions;  // every line per port, with its version key
+    std::vector<std::string_view, ArenaAllocator<std::string_view>>* port_names;  // each port once, in index order
+    std::string key_scratch;   // reused while computing version keys
+
+    explicit IndexModel(size_t block_size) : arena(block_size) {
+        strings = make<IndexStringSet>();
+        by_package = make<IndexDepsMap>();
+        by_port = make<IndexDepsMap>();
+        revisions = make<IndexRevisionMap>();
+        port_names = make<std::vector<std::string_view, ArenaAllocator<std::string_view>>>();
+    }
+
+    template <typename T>
+    T* make() {
+        return new (arena.allocate(sizeof(T), alignof(T))) T(typename T::allocator_type(&arena));
+    }
+
+    std::string_view intern(std::string_view text) {
+        const auto it = strings->find(text);
+        if (it != strings->end()) {
+            return *it;
+        }
+        char* copy = static_cast<char*>(arena.allocate(text.size() ? text.size() : 1, 1));
+        std::memcpy(copy, text.data(), text.size());
+        return *strings->emplace(copy, text.size()).first;
+    }
+
+    // Arena copy of text that is not worth interning (unique per line)
+    std::string_view copy(std::string_view text) {
+        char* bytes = static_cast<char*>(arena.allocate(text.size() ? text.size() : 1, 1));
+        std::memcpy(bytes, text.data(), text.size());
+        return std::string_view(bytes, text.size());
+    }
+};
+
+static IndexModel* g_cpkindex_model = nullptr;
+static std::string g_cpkindex_deps_cache_path;
+static bool g_cpkindex_deps_cache_loaded = false;
+
+void cpk_invalidate_cpkindex_deps_cache() {
+    // Only the arena is destroyed; the tables inside it are never visited
+    delete g_cpkindex_model;
+    g_cpkindex_model = nullptr;
+    g_cpkindex_deps_cache_path.clear();
+    g_cpkindex_deps_cache_loaded = false;
+    g_index_arch_loaded = false;
+}
+
+// Copy one parsed line into the model; words are its dependency words
+static void add_index_line(IndexModel& model, const CpkIndexLine& line, const std::string_view* words, size_t count) {
+    IndexDeps deps;
+    deps.count = count;
+    if (count > 0) {
+        auto* copy = static_cast<std::string_view*>(
+            model.arena.allocate(count * sizeof(std::string_view), alignof(std::string_view)));
+        for (size_t w = 0; w < count; ++w) {
+            new (&copy[w]) std::string_view(model.intern(words[w]));
+        }
+        deps.words = copy;
+    }
+    const std::string_view package = model.intern(line.package);
+    (*model.by_package)[package] = deps;
+    if (!line.name.empty()) {
+        const std::string_view port = model.intern(line.name);
+        auto* revision = new (model.arena.allocate(sizeof(IndexRevision), alignof(IndexRevision))) IndexRevision();
+        revision->line.package = package;
+        revision->line.version = model.intern(line.version);
+        revision->line.arch = model.intern(line.arch);
+        model.key_scratch.clear();
+        append_version_key(model.key_scratch, line.version);
+        revision->line.version_key = model.copy(model.key_scratch);
+        revision->deps = deps;
+        IndexPortRevisions& chain = (*model.revisions)[port];
+        if (chain.last == nullptr) {
+            chain.first = revision;
+            model.port_names->push_back(port);
+        } else {
+            chain.last->next = revision;
+        }
+        chain.last = revision;
+    }
+}
+
+// Dependencies per port from the same revision find_package() resolves the
+// port to, so install plans and deptree follow what gets installed
+static void select_port_revisions(IndexModel& model) {
+    const std::string arch = get_index_architecture();
+    for (const std::string_view port : *model.port_names) {
+        IndexPortRevisions& chain = (*model.revisions)[port];
+        const IndexRevision* best = nullptr;
+        for (const IndexRevision* revision = chain.first; revision != nullptr; revision = revision->next) {
+            if (preferred_index_revision(revision->line, best ? &best->line : nullptr, arch)) {
+                best = revision;
+            }
+        }
+        chain.selected = best;
+        model.by_port->emplace(port, best->deps);
+    }
+}
+
+// Lines of one chunk as parsed by a loader thread: views into the mapped
+// index, copied into the arena by the ordered merge
+struct ParsedIndexChunk {
+    std::vector<CpkIndexLine> lines;
+    std::vector<std::string_view> words;  // dependency words of all lines
+    std::vector<size_t> word_ends;        // per line: end of its words
+};
+
+// Smallest share of the index worth a loader thread of its own
+static const size_t INDEX_CHUNK_MIN_BYTES = 1 << 20;
+
+static void load_cpkindex_deps_cache() {
+    const std::string path = get_cpkindex_path();
+    if (g_cpkindex_deps_cache_loaded && g_cpkindex_deps_cache_path == path) {
+        return;
+    }
+    cpk_invalidate_cpkindex_deps_cache();
+    g_cpkindex_deps_cache_path = path;
+    g_cpkindex_deps_cache_loaded = true;
+
+    CpkFileBuffer buffer;
+    if (!buffer.open(path)) {
+        return;
+    }
+    const std::string_view text(buffer.data, buffer.size);
+    const size_t estimated_lines = std::count(text.begin(), text.end(), '\n') + 1;
+    g_cpkindex_model = new IndexModel(std::max<size_t>(1 << 16, text.size() / 2));
+    IndexModel& model = *g_cpkindex_model;
+    // Sized up front: bucket arrays dropped by a rehash would stay in the arena
+    model.strings->reserve(estimated_lines * 2);
+    model.by_package->reserve(estimated_lines);
+    model.by_port->reserve(estimated_lines);
+    model.revisions->reserve(estimated_lines);
+
+    // Large (aggregated) indexes are cut into newline-aligned chunks that are
+    // parsed in parallel; the merge walks the chunks in file order, so the
+    // lines of every port keep their index order exactly as in a sequential scan.
+    size_t workers = std::thread::hardware_concurrency();
+    workers = std::max<size_t>(1, std::min<size_t>(workers, text.size() / INDEX_CHUNK_MIN_BYTES));
+    if (workers == 1) {
+        std::vector<std::string_view> words;
+        cpk_for_each_index_line(text, [&](const CpkIndexLine& line) {
+            words.clear();
+            split_dependency_words(line.deps, words);
+            add_index_line(model, line, words.data(), words.size());
+        });
+        select_port_revisions(model);
+        return;
+    }
+
+    std::vector<std::string_view> chunks;
+    size_t begin = 0;
+    for (size_t i = 1; i <= workers && begin < text.size(); ++i) {
+        size_t end = std::max(begin, text.size() * i / workers);
+        end = i == workers ? std::string_view::npos : text.find('\n', end);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        chunks.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+
+    std::vector<ParsedIndexChunk> parsed(chunks.size());
+    auto parse_chunk = [&](size_t i) {
+        ParsedIndexChunk& chunk = parsed[i];
+        cpk_for_each_index_line(chunks[i], [&](const CpkIndexLine& line) {
+            chunk.lines.push_back(line);
+            split_dependency_words(line.deps, chunk.words);
+            chunk.word_ends.push_back(chunk.words.size());
+        });
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < chunks.size(); ++i) {
+        threads.emplace_back(parse_chunk, i);
+    }
+    parse_chunk(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (auto& chunk : parsed) {
+        size_t word = 0;
+        for (size_t i = 0; i < chunk.lines.size(); ++i) {
+            add_index_line(model, chunk.lines[i], chunk.words.data() + word, chunk.word_ends[i] - word);
+            word = chunk.word_ends[i];
+        }
+        chunk = ParsedIndexChunk();  // release as the merge goes
+    }
+    select_port_revisions(model);
+}
+
+void cpk_preload_index_deps_cache() {
+    load_cpkindex_deps_cache();
+}
+
+bool lookup_cpkindex_deps_by_port(const std::string& port_name, std::vector<std::string>& out) {
+    load_cpkindex_deps_cache();
+    if (g_cpkindex_model == nullptr) {
+        return false;
+    }
+    const auto it = g_cpkindex_model->by_port->find(port_name);
+    if (it == g_cpkindex_model->by_port->end()) {
+        return false;
+    }
+    it->second.copy_to(out);
+    return true;
+}
+
+bool cpk_index_port_revisions(std::string_view port, std::vector<CpkIndexRevision>& out) {
+    out.clear();
+    load_cpkindex_deps_cache();
+    if (g_cpkindex_model == nullptr) {
+        return false;
+    }
+    const auto it = g_cpkindex_model->revisions->find(port);
+    if (it != g_cpkindex_model->revisions->end()) {
+        for (const IndexRevision* revision = it->second.first; revision != nullptr; revision = revision->next) {
+            out.push_back(revision->line);
+        }
+    }
+    return true;
+}
+
+bool cpk_index_selected_revision(std::string_view port, CpkIndexRevision& out) {
+    load_cpkindex_deps_cache();
+    if (g_cpkindex_model == nullptr) {
+        return false;
+    }
+    const auto it = g_cpkindex_model->revisions->find(port);
+    if (it == g_cpkindex_model->revisions->end()) {
+        return false;
+    }
+    out = it->second.selected->line;
+    return true;
+}
+
+bool cpk_index_selected_revisions(std::vector<std::pair<std::string_view, CpkIndexRevision>>& out) {
+    out.clear();
+    load_cpkindex_deps_cache();
+    if (g_cpkindex_model == nullptr) {
+        return false;
+    }
+    out.reserve(g_cpkindex_model->port_names->size());
+    for (const std::string_view port : *g_cpkindex_model->port_names) {
+        out.emplace_back(port, (*g_cpkindex_model->revisions)[port].selected->line);
+    }
+    return true;
+}
+
+bool lookup_cpkindex_deps(const std::string& package_line, std::vector<std::string>& out) {
+    load_cpkindex_deps_cache();
+    if (g_cpkindex_model == nullptr) {
+        return false;
+    }
+    const auto it = g_cpkindex_model->by_package->find(package_line);
+    if (it == g_cpkindex_model->by_package->end()) {
+        return false;
+    }
+    it->second.copy_to(out);
+    return true;
+}
+
+// CPKCLOSURE.idx layout (host byte order):
+//   header | nodes (sorted by name) | components * words bitsets | strings
+struct ClosureIndexHeader {
+    char magic[8];
+    int64_t index_size;
+    int64_t index_mtime;
+    char index_sha256[64];
+    uint32_t nodes;
+    uint32_t components;
+    uint32_t words;
+    uint32_t strings;
+};
+
+static const char CLOSURE_MAGIC[8] = {'C', 'P', 'K', 'C', 'L', 'O', '1', '\0'};
+
+// Per-port bitsets grow with the square of the port count; past this the
+// closure is left to the on-demand graph walks
+static const size_t CLOSURE_INDEX_MAX_BYTES = size_t(256) << 20;
+
+static std::string closure_index_path() {
+    return CPK_HOME_DIR + "/CPKCLOSURE.idx";
+}
+
+static void cpkindex_stamp(int64_t& size, int64_t& mtime) {
+    struct stat st;
+    if (stat(get_cpkindex_path().c_str(), &st) == 0) {
+        size = st.st_size;
+        mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    } else {
+        size = -1;
+        mtime = 0;
+    }
+}
+
+static std::string serialize_closure_index() {
+    load_cpkindex_deps_cache();
+    if (g_cpkindex_model == nullptr) {
+        return std::string();
+    }
+    const IndexModel& model = *g_cpkindex_model;
+    const size_t ports = model.port_names->size();
+    if (ports * ((ports + 63) / 64) * sizeof(uint64_t) > CLOSURE_INDEX_MAX_BYTES) {
+        if (CPK_VERBOSE) {
+            print_message("Index too large for a closure cache (" + std::to_string(ports) + " ports)", YELLOW);
+        }
+        return std::string();
+    }
+
+    // Ports plus dependency names that no index line provides, sorted by name
+    std::vector<std::string_view> names(model.port_names->begin(), model.port_names->end());
+    for (const auto& entry : *model.by_port) {
+        names.insert(names.end(), entry.second.words, entry.second.words + entry.second.count);
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    const size_t n = names.size();
+    const size_t words = (n + 63) / 64;
+    std::unordered_map<std::string_view, size_t> ids;
+    ids.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        ids.emplace(names[i], i);
+    }
+    std::vector<std::vector<size_t>> edges(n);
+    std::vector<uint32_t> in_index(n, 0);
+    for (const auto& entry : *model.by_port) {
+        const size_t id = ids[entry.first];
+        in_index[id] = 1;
+        for (size_t w = 0; w < entry.second.count; ++w) {
+            edges[id].push_back(ids[entry.second.words[w]]);
         }
+    }
 
-        if (key == "name") {
-            name = value;
-            found_valid_field = true;
-        } else if (key == "version") {
-            version = value;
-            found_valid_field = true;
-        } else if (key == "arch") {
-            arch = value;
-            found_valid_field = true;
-        } else if (key == "description") {
-            description = value;
-            found_valid_field = true;
-        } else if (key == "url") {
-            url = value;
-            found_valid_field = true;
-        } else if (key == "dependencies") {
-            dependencies = value;
-            found_valid_field = true;
+    std::vector<size_t> component;
+    const std::vector<std::vector<size_t>> component_members = cpk_graph_components(edges, component);
+    const size_t components = component_members.size();
+    if (components * words * sizeof(uint64_t) > CLOSURE_INDEX_MAX_BYTES) {
+        if (CPK_VERBOSE) {
+            print_message("Index too large for a closure cache (" + std::to_string(n) + " names)", YELLOW);
         }
+        return std::string();
     }
 
-    infile.close();
-    
-    // Return true only if we found at least one valid field (name and version are required)
-    return found_valid_field && !name.empty() && !version.empty();
+    ClosureIndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CLOSURE_MAGIC, sizeof(CLOSURE_MAGIC));
+    cpkindex_stamp(header.index_size, header.index_mtime);
+    const std::string digest = calculate_sha256(get_cpkindex_path());
+    std::memcpy(header.index_sha256, digest.data(), std::min(digest.size(), sizeof(header.index_sha256)));
+    header.nodes = static_cast<uint32_t>(n);
+    header.components = static_cast<uint32_t>(components);
+    header.words = static_cast<uint32_t>(words);
+
+    std::string strings;
+    std::vector<CpkClosureIndex::Node> nodes(n);
+    for (size_t i = 0; i < n; ++i) {
+        nodes[i] = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(names[i].size()),
+                    static_cast<uint32_t>(component[i]), in_index[i]};
+        strings.append(names[i]);
+    }
+    header.strings = static_cast<uint32_t>(strings.size());
+
+    const size_t bits_offset = sizeof(header) + n * sizeof(CpkClosureIndex::Node);
+    std::string out(bits_offset + components * words * sizeof(uint64_t), '\0');
+    std::memcpy(&out[0], &header, sizeof(header));
+    std::memcpy(&out[sizeof(header)], nodes.data(), n * sizeof(CpkClosureIndex::Node));
+    cpk_for_each_component_closure(edges, component_members, component, [&](size_t c, const std::vector<uint64_t>& bits) {
+        std::memcpy(&out[bits_offset + c * words * sizeof(uint64_t)], bits.data(), words * sizeof(uint64_t));
+    });
+    out += strings;
+    return out;
 }
 
-std::string get_cpkindex_path() {
-    return CPK_HOME_DIR + "/CPKINDEX";
+// Replace an index file through a rename so readers never map a partial one
+static bool write_index_file(const std::string& path, const std::string& bytes) {
+    const std::string tmp = path + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    out.close();
+    if (!out) {
+        fs::remove(tmp);
+        return false;
+    }
+    fs::rename(tmp, path);
+    return true;
 }
 
-// Writable cache: CPK_HOME_DIR when writable, else ~/.cpk (never used for CPKINDEX).
-static std::string resolve_cache_dir() {
-    // Check if we can write to CPK_HOME_DIR
-    if (fs::exists(CPK_HOME_DIR) && fs::is_directory(CPK_HOME_DIR)) {
-        // Try to create a test file to check write permissions
-        std::string test_file = CPK_HOME_DIR + "/.write_test";
-        FILE *test_fp = fopen(test_file.c_str(), "w");
-        if (test_fp != nullptr) {
-            fclose(test_fp);
-            fs::remove(test_file);
-            return CPK_HOME_DIR;
-        }
-    } else {
-        // Try to create CPK_HOME_DIR if it doesn't exist
-        try {
-            fs::create_directories(CPK_HOME_DIR);
-            // Test if we can write
-            std::string test_file = CPK_HOME_DIR + "/.write_test";
-            FILE *test_fp = fopen(test_file.c_str(), "w");
-            if (test_fp != nullptr) {
-                fclose(test_fp);
-                fs::remove(test_file);
-                return CPK_HOME_DIR;
+bool build_cpk_closure_index() {
+    const std::string bytes = serialize_closure_index();
+    if (bytes.empty()) {
+        fs::remove(closure_index_path());
+        return false;
+    }
+    return write_index_file(closure_index_path(), bytes);
+}
+
+CpkClosureIndex::~CpkClosureIndex() {
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+bool CpkClosureIndex::attach(const char* data, size_t size) {
+    if (size < sizeof(ClosureIndexHeader)) {
+        return false;
+    }
+    const ClosureIndexHeader* header = reinterpret_cast<const ClosureIndexHeader*>(data);
+    if (std::memcmp(header->magic, CLOSURE_MAGIC, sizeof(CLOSURE_MAGIC)) != 0) {
+        return false;
+    }
+    const size_t expected = sizeof(ClosureIndexHeader) + size_t(header->nodes) * sizeof(Node) +
+                            size_t(header->components) * header->words * sizeof(uint64_t) + header->strings;
+    if (size != expected) {
+        return false;
+    }
+    count = header->nodes;
+    words = header->words;
+    nodes = reinterpret_cast<const Node*>(data + sizeof(ClosureIndexHeader));
+    bits = reinterpret_cast<const uint64_t*>(nodes + count);
+    strings = reinterpret_cast<const char*>(bits + size_t(header->components) * words);
+    return true;
+}
+
+bool CpkClosureIndex::open() {
+    const std::string path = closure_index_path();
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                mapping = map;
+                mapping_size = static_cast<size_t>(st.st_size);
             }
-        } catch (const std::exception& e) {
-            // Can't create or write to CPK_HOME_DIR, fall through to user cache
         }
+        close(fd);
     }
-
-    // If we couldn't use CPK_HOME_DIR, fallback to user cache directory (~/.cpk)
-    const char* home = std::getenv("HOME");
-    if (home != nullptr) {
-        std::string user_cache = std::string(home) + "/.cpk";
-        // Ensure the directory exists
-        try {
-            fs::create_directories(user_cache);
-            if (CPK_VERBOSE) {
-                print_message("Using user cache directory: " + user_cache, YELLOW);
+    if (mapping != nullptr && attach(static_cast<const char*>(mapping), mapping_size)) {
+        // Same size and mtime as when built, or (e.g. after an update that
+        // fetched identical bytes) the same content hash
+        const ClosureIndexHeader* header = static_cast<const ClosureIndexHeader*>(mapping);
+        int64_t index_size, index_mtime;
+        cpkindex_stamp(index_size, index_mtime);
+        if (index_size == header->index_size && index_mtime == header->index_mtime) {
+            return true;
+        }
+        if (index_size == header->index_size &&
+            calculate_sha256(get_cpkindex_path()) == std::string(header->index_sha256, sizeof(header->index_sha256))) {
+            // Re-stamp so later queries skip the hash again
+            if (access(CPK_HOME_DIR.c_str(), W_OK) == 0) {
+                std::string restamped(static_cast<const char*>(mapping), mapping_size);
+                reinterpret_cast<ClosureIndexHeader*>(&restamped[0])->index_mtime = index_mtime;
+                write_index_file(closure_index_path(), restamped);
             }
-            return user_cache;
-        } catch (const std::exception& e) {
-            // If we can't create user cache dir, use CPK_HOME_DIR anyway
-            return CPK_HOME_DIR;
+            return true;
         }
     }
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+    }
 
-    // If all else fails, return CPK_HOME_DIR
-    return CPK_HOME_DIR;
+    // Missing or stale: rebuild, and keep it for the next query when cpk_home_dir is writable
+    owned = serialize_closure_index();
+    if (owned.empty()) {
+        return false;
+    }
+    if (access(CPK_HOME_DIR.c_str(), W_OK) == 0) {
+        write_index_file(closure_index_path(), owned);
+    }
+    return attach(owned.data(), owned.size());
 }
 
-// Memoize: resolve the cache dir once so the write probe and the verbose
-// "Using user cache directory" notice happen a single time per run.
-std::string get_cache_dir() {
-    static std::string cached;
-    static bool resolved = false;
-    if (!resolved) {
-        cached = resolve_cache_dir();
-        resolved = true;
+bool CpkClosureIndex::find(std::string_view port, size_t& id) const {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (name(mid) < port) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    return cached;
+    if (lo < count && name(lo) == port) {
+        id = lo;
+        return true;
+    }
+    return false;
 }
 
-std::string get_cache_file(const std::string &filename) {
-    std::string cache_dir = get_cache_dir();
-    return cache_dir + "/" + filename;
+void CpkClosureIndex::closure(size_t id, std::vector<uint64_t>& out) const {
+    const uint64_t* row = bits + nodes[id].component * words;
+    out.assign(row, row + words);
+    out[id / 64] &= ~(uint64_t(1) << (id % 64));
 }
 
-void cpk_print_missing_index_error() {
-    print_message("Package index not found or not readable. Run `sudo cpk update` first", RED);
+size_t CpkClosureIndex::closure_size(size_t id) const {
+    const uint64_t* row = bits + nodes[id].component * words;
+    size_t total = 0;
+    for (size_t i = 0; i < words; ++i) {
+        total += static_cast<size_t>(__builtin_popcountll(row[i]));
+    }
+    return total - ((row[id / 64] >> (id % 64)) & 1);
 }
 
-bool cpk_is_privileged_process() {
-    return geteuid() == static_cast<uid_t>(0);
+std::vector<uint64_t> CpkClosureIndex::name_set(const std::vector<std::string>& names) const {
+    std::vector<uint64_t> out(words, 0);
+    size_t id;
+    for (const auto& port : names) {
+        if (find(port, id)) {
+            out[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+    return out;
 }
 
-std::string resolve_cpk_metadata_read_path(const std::string& basename) {
-    const std::string sys = CPK_HOME_DIR + "/" + basename;
-    if (cpk_file_readable(sys)) {
-        return sys;
-    }
-    return get_cache_dir() + "/" + basename;
+// CPKOWNERS.idx layout (host byte order):
+//   header | packages (sorted by name) | paths (sorted by path, then package) | strings
+// The strings start with the root the table describes; a path shared by
+// several packages (directories) is stored once.
+struct OwnerIndexHeader {
+    char magic[8];
+    int64_t db_size;
+    int64_t db_mtime;
+    uint32_t packages;
+    uint32_t paths;
+    uint32_t strings;
+    uint32_t root_size;
+};
+
+static const char OWNER_MAGIC[8] = {'C', 'P', 'K', 'O', 'W', 'N', '1', '\0'};
+
+static std::string owner_index_path() {
+    return CPK_HOME_DIR + "/CPKOWNERS.idx";
 }
 
-std::string resolve_package_extract_dir(const std::string& pkgname, const std::string& pkgver) {
-    const std::string sys = CPK_HOME_DIR + "/" + pkgname + "/" + pkgver;
-    if (fs::is_directory(sys) && fs::exists(sys + "/Pkgfile")) {
-        return sys;
+static void pkg_db_stamp(const std::string& root, int64_t& size, int64_t& mtime) {
+    struct stat st;
+    if (stat((fs::path(root) / "var/lib/pkg/db").c_str(), &st) == 0) {
+        size = st.st_size;
+        mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    } else {
+        size = -1;
+        mtime = 0;
     }
-    return get_cache_dir() + "/" + pkgname + "/" + pkgver;
 }
 
-static void split_dependency_words(const std::string& deps_str, std::vector<std::string>& out) {
-    std::istringstream iss(deps_str);
-    std::string tok;
-    while (iss >> tok) {
-        while (!tok.empty() && (tok.back() == ',' || tok.back() == ';')) {
-            tok.pop_back();
+static std::string serialize_owner_index(const std::string& root) {
+    OwnerIndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, OWNER_MAGIC, sizeof(OWNER_MAGIC));
+    // Stamp before reading so a commit racing the read leaves the index stale, not wrong
+    pkg_db_stamp(root, header.db_size, header.db_mtime);
+    std::vector<CpkInstalledPackage> records;
+    if (!cpk_read_pkg_db(root, records)) {
+        return std::string();
+    }
+    std::sort(records.begin(), records.end(),
+              [](const CpkInstalledPackage& a, const CpkInstalledPackage& b) { return a.name < b.name; });
+
+    std::string strings = root;
+    std::vector<CpkOwnerIndex::Package> packages(records.size());
+    std::vector<std::pair<std::string_view, uint32_t>> entries;
+    for (size_t id = 0; id < records.size(); ++id) {
+        const CpkInstalledPackage& record = records[id];
+        packages[id] = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(record.name.size()),
+                        static_cast<uint32_t>(strings.size() + record.name.size()),
+                        static_cast<uint32_t>(record.version.size())};
+        strings += record.name;
+        strings += record.version;
+        for (const auto& file : record.files) {
+            entries.emplace_back(file, static_cast<uint32_t>(id));
         }
-        if (!tok.empty()) {
-            out.push_back(tok);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<CpkOwnerIndex::Path> paths(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (i > 0 && entries[i].first == entries[i - 1].first) {
+            paths[i] = {paths[i - 1].offset, paths[i - 1].size, entries[i].second};
+            continue;
         }
+        paths[i] = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(entries[i].first.size()),
+                    entries[i].second};
+        strings.append(entries[i].first);
     }
+    if (strings.size() > UINT32_MAX || paths.size() > UINT32_MAX) {
+        return std::string();
+    }
+    header.packages = static_cast<uint32_t>(packages.size());
+    header.paths = static_cast<uint32_t>(paths.size());
+    header.strings = static_cast<uint32_t>(strings.size());
+    header.root_size = static_cast<uint32_t>(root.size());
+
+    std::string out;
+    out.reserve(sizeof(header) + packages.size() * sizeof(CpkOwnerIndex::Package) +
+                paths.size() * sizeof(CpkOwnerIndex::Path) + strings.size());
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(packages.data()), packages.size() * sizeof(CpkOwnerIndex::Package));
+    out.append(reinterpret_cast<const char*>(paths.data()), paths.size() * sizeof(CpkOwnerIndex::Path));
+    out += strings;
+    return out;
 }
 
-static std::unordered_map<std::string, std::vector<std::string>> g_cpkindex_deps_cache;
-static std::unordered_map<std::string, std::vector<std::string>> g_cpkindex_deps_by_port;
-static std::string g_cpkindex_deps_cache_path;
-static bool g_cpkindex_deps_cache_loaded = false;
+CpkOwnerIndex::~CpkOwnerIndex() {
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    }
+}
 
-void cpk_invalidate_cpkindex_deps_cache() {
-    g_cpkindex_deps_cache.clear();
-    g_cpkindex_deps_by_port.clear();
-    g_cpkindex_deps_cache_path.clear();
-    g_cpkindex_deps_cache_loaded = false;
+bool CpkOwnerIndex::attach(const char* data, size_t size) {
+    if (size < sizeof(OwnerIndexHeader)) {
+        return false;
+    }
+    const OwnerIndexHeader* header = reinterpret_cast<const OwnerIndexHeader*>(data);
+    if (std::memcmp(header->magic, OWNER_MAGIC, sizeof(OWNER_MAGIC)) != 0) {
+        return false;
+    }
+    const size_t expected = sizeof(OwnerIndexHeader) + size_t(header->packages) * sizeof(Package) +
+                            size_t(header->paths) * sizeof(Path) + header->strings;
+    if (size != expected || header->root_size > header->strings) {
+        return false;
+    }
+    package_count = header->packages;
+    path_count = header->paths;
+    packages = reinterpret_cast<const Package*>(data + sizeof(OwnerIndexHeader));
+    paths = reinterpret_cast<const Path*>(packages + package_count);
+    strings = reinterpret_cast<const char*>(paths + path_count);
+    return true;
 }
 
-static void load_cpkindex_deps_cache() {
-    const std::string path = get_cpkindex_path();
-    if (g_cpkindex_deps_cache_loaded && g_cpkindex_deps_cache_path == path) {
-        return;
+bool CpkOwnerIndex::open(const std::string& root) {
+    const std::string path = owner_index_path();
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* map = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                mapping = map;
+                mapping_size = static_cast<size_t>(st.st_size);
+            }
+        }
+        close(fd);
+    }
+    if (mapping != nullptr && attach(static_cast<const char*>(mapping), mapping_size)) {
+        const OwnerIndexHeader* header = static_cast<const OwnerIndexHeader*>(mapping);
+        int64_t db_size, db_mtime;
+        pkg_db_stamp(root, db_size, db_mtime);
+        if (db_size >= 0 && db_size == header->db_size && db_mtime == header->db_mtime &&
+            std::string_view(strings, header->root_size) == root) {
+            return true;
+        }
+    }
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
     }
-    cpk_invalidate_cpkindex_deps_cache();
-    g_cpkindex_deps_cache_path = path;
-    g_cpkindex_deps_cache_loaded = true;
 
-    std::ifstream in(path);
-    if (!in.is_open()) {
-        return;
+    // Missing or stale: rebuild, and keep it for the next lookup when cpk_home_dir is writable
+    owned = serialize_owner_index(root);
+    if (owned.empty()) {
+        return false;
+    }
+    if (access(CPK_HOME_DIR.c_str(), W_OK) == 0) {
+        write_index_file(path, owned);
     }
+    return attach(owned.data(), owned.size());
+}
 
-    std::string line;
-    while (std::getline(in, line)) {
-        const std::string trimmed = cpk_trim_index_line(line);
-        if (!cpk_index_line_valid(trimmed)) {
-            continue;
+void CpkOwnerIndex::owners(std::string_view file, std::vector<size_t>& out) const {
+    size_t lo = 0, hi = path_count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (path(mid) < file) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        const std::string pkg = cpk_index_line_package(trimmed);
-        std::vector<std::string> deps;
-        split_dependency_words(cpk_index_line_deps(trimmed), deps);
-        g_cpkindex_deps_cache[pkg] = std::move(deps);
-        const size_t hash = pkg.find('#');
-        if (hash != std::string::npos && hash > 0) {
-            const std::string port = pkg.substr(0, hash);
-            if (g_cpkindex_deps_by_port.find(port) == g_cpkindex_deps_by_port.end()) {
-                g_cpkindex_deps_by_port[port] = g_cpkindex_deps_cache[pkg];
-            }
+    }
+    for (; lo < path_count && path(lo) == file; ++lo) {
+        out.push_back(paths[lo].package);
+    }
+}
+
+// Optimal string alignment distance (Levenshtein plus adjacent transpositions)
+// between the pattern encoded in peq (length m <= 64) and text, using Hyyrö's
+// bit-parallel extension of Myers' algorithm: one column of the DP matrix per
+// text character. Returns max_distance + 1 as soon as the bound cannot be met.
+static int bounded_osa_distance(const uint64_t (&peq)[256], size_t m, std::string_view text, int max_distance) {
+    const int n = static_cast<int>(text.size());
+    int score = static_cast<int>(m);
+    if (std::abs(n - score) > max_distance) {
+        return max_distance + 1;
+    }
+    const uint64_t last = 1ULL << (m - 1);
+    uint64_t pv = ~0ULL;
+    uint64_t mv = 0;
+    uint64_t d0_prev = 0;
+    uint64_t eq_prev = 0;
+    for (int j = 0; j < n; ++j) {
+        const uint64_t eq = peq[static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(text[j])))];
+        const uint64_t tr = (((~d0_prev) & eq) << 1) & eq_prev;
+        const uint64_t d0 = (((eq & pv) + pv) ^ pv) | eq | mv | tr;
+        uint64_t hp = mv | ~(d0 | pv);
+        uint64_t hn = d0 & pv;
+        if (hp & last) {
+            ++score;
+        } else if (hn & last) {
+            --score;
         }
+        // The last row can drop by at most one per remaining text character
+        if (score - (n - j - 1) > max_distance) {
+            return max_distance + 1;
+        }
+        hp = (hp << 1) | 1;
+        hn <<= 1;
+        pv = hn | ~(d0 | hp);
+        mv = hp & d0;
+        d0_prev = d0;
+        eq_prev = eq;
     }
+    return score;
 }
 
-void cpk_preload_index_deps_cache() {
-    load_cpkindex_deps_cache();
+// Plain DP fallback for names longer than a machine word
+static int bounded_osa_distance_dp(std::string_view a, std::string_view b, int max_distance) {
+    const size_t n = a.size();
+    const size_t m = b.size();
+    if (std::abs(static_cast<int>(n) - static_cast<int>(m)) > max_distance) {
+        return max_distance + 1;
+    }
+    std::vector<int> prev2(m + 1), prev(m + 1), cur(m + 1);
+    for (size_t j = 0; j <= m; ++j) {
+        prev[j] = static_cast<int>(j);
+    }
+    for (size_t i = 1; i <= n; ++i) {
+        cur[0] = static_cast<int>(i);
+        int row_min = cur[0];
+        for (size_t j = 1; j <= m; ++j) {
+            const int cost = std::tolower(static_cast<unsigned char>(a[i - 1])) ==
+                             std::tolower(static_cast<unsigned char>(b[j - 1])) ? 0 : 1;
+            cur[j] = std::min({prev[j] + 1, cur[j - 1] + 1, prev[j - 1] + cost});
+            if (i > 1 && j > 1 && std::tolower(static_cast<unsigned char>(a[i - 1])) == std::tolower(static_cast<unsigned char>(b[j - 2])) &&
+                std::tolower(static_cast<unsigned char>(a[i - 2])) == std::tolower(static_cast<unsigned char>(b[j - 1]))) {
+                cur[j] = std::min(cur[j], prev2[j - 2] + 1);
+            }
+            row_min = std::min(row_min, cur[j]);
+        }
+        if (row_min > max_distance) {
+            return max_distance + 1;
+        }
+        prev2.swap(prev);
+        prev.swap(cur);
+    }
+    return prev[m];
 }
 
-bool lookup_cpkindex_deps_by_port(const std::string& port_name, std::vector<std::string>& out) {
+std::vector<std::string> cpk_fuzzy_port_matches(const std::string& name, size_t limit, int max_distance) {
+    std::vector<std::string> matches;
+    if (name.empty() || limit == 0) {
+        return matches;
+    }
+    if (max_distance < 0) {
+        max_distance = name.size() <= 4 ? 1 : (name.size() <= 8 ? 2 : 3);
+    }
     load_cpkindex_deps_cache();
-    const auto it = g_cpkindex_deps_by_port.find(port_name);
-    if (it == g_cpkindex_deps_by_port.end()) {
-        return false;
+
+    uint64_t peq[256] = {};
+    const bool bit_parallel = name.size() <= 64;
+    if (bit_parallel) {
+        for (size_t i = 0; i < name.size(); ++i) {
+            peq[static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(name[i])))] |= 1ULL << i;
+        }
     }
-    out = it->second;
-    return true;
+
+    std::vector<std::pair<int, std::string_view>> scored;
+    if (g_cpkindex_model == nullptr) {
+        return matches;
+    }
+    for (const std::string_view port : *g_cpkindex_model->port_names) {
+        const int distance = bit_parallel ? bounded_osa_distance(peq, name.size(), port, max_distance)
+                                          : bounded_osa_distance_dp(name, port, max_distance);
+        if (distance <= max_distance) {
+            scored.emplace_back(distance, port);
+        }
+    }
+    std::sort(scored.begin(), scored.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first < b.first : a.second < b.second;
+    });
+    for (size_t i = 0; i < scored.size() && i < limit; ++i) {
+        matches.emplace_back(scored[i].second);
+    }
+    return matches;
 }
 
-bool lookup_cpkindex_deps(const std::string& package_line, std::vector<std::string>& out) {
+void cpk_print_did_you_mean(const std::string& name) {
+    const std::string port = name.substr(0, name.find('#'));
     load_cpkindex_deps_cache();
-    const auto it = g_cpkindex_deps_cache.find(package_line);
-    if (it == g_cpkindex_deps_cache.end()) {
-        return false;
+    if (g_cpkindex_model != nullptr && g_cpkindex_model->by_port->count(port)) {
+        return;  // the port exists; only the requested version is missing
     }
-    out = it->second;
-    return true;
+    const std::vector<std::string> matches = cpk_fuzzy_port_matches(port, 3);
+    if (matches.empty()) {
+        return;
+    }
+    std::string text = "Did you mean: ";
+    for (size_t i = 0; i < matches.size(); ++i) {
+        text += (i ? ", " : "") + matches[i];
+    }
+    print_message(text + "?", YELLOW);
 }
 
 // spec: repository name / name#version / or path to a .cpk file
@@ -1507,6 +4510,7 @@ bool get_package_dependency_names(const std::string& spec, std::vector<std::stri
 
     if (!find_package(spec, package, pkgname, pkgver, pkgarch)) {
         print_message("Package not in index: " + spec, RED);
+        cpk_print_did_you_mean(spec);
         return false;
     }
 
@@ -1516,4 +4520,167 @@ bool get_package_dependency_names(const std::string& spec, std::vector<std::stri
 
     print_message("Invalid CPKINDEX entry for \"" + package + "\"", RED);
     return false;
-}
\ No newline at end of file
+}
+
+// Tarjan's SCC algorithm, iterative. Components are completed only after
+// every component they depend on, so emission order is an install order.
+std::vector<std::vector<size_t>> cpk_graph_components(const std::vector<std::vector<size_t>>& edges, std::vector<size_t>& component) {
+    const size_t n = edges.size();
+    const size_t unvisited = static_cast<size_t>(-1);
+    std::vector<size_t> index(n, unvisited), lowlink(n, 0);
+    component.assign(n, unvisited);
+    std::vector<bool> on_stack(n, false);
+    std::vector<size_t> stack;
+    std::vector<std::pair<size_t, size_t>> call;  // (node, next edge)
+    std::vector<std::vector<size_t>> components;
+    size_t next_index = 0;
+    for (size_t start = 0; start < n; ++start) {
+        if (index[start] != unvisited) {
+            continue;
+        }
+        call.emplace_back(start, 0);
+        while (!call.empty()) {
+            const size_t v = call.back().first;
+            size_t& edge = call.back().second;
+            if (edge == 0 && index[v] == unvisited) {
+                index[v] = lowlink[v] = next_index++;
+                stack.push_back(v);
+                on_stack[v] = true;
+            }
+            if (edge < edges[v].size()) {
+                const size_t w = edges[v][edge++];
+                if (index[w] == unvisited) {
+                    call.emplace_back(w, 0);
+                } else if (on_stack[w]) {
+                    lowlink[v] = std::min(lowlink[v], index[w]);
+                }
+                continue;
+            }
+            if (lowlink[v] == index[v]) {
+                std::vector<size_t> members;
+                size_t w;
+                do {
+                    w = stack.back();
+                    stack.pop_back();
+                    on_stack[w] = false;
+                    component[w] = components.size();
+                    members.push_back(w);
+                } while (w != v);
+                components.push_back(std::move(members));
+            }
+            call.pop_back();
+            if (!call.empty()) {
+                const size_t parent = call.back().first;
+                lowlink[parent] = std::min(lowlink[parent], lowlink[v]);
+            }
+        }
+    }
+    return components;
+}
+
+bool cpk_plan_install(const std::vector<std::string>& roots, CpkInstallPlan& plan) {
+    plan = CpkInstallPlan();
+
+    // Resolve the closure breadth-first into an adjacency list (edge: package -> dependency)
+    std::vector<std::string> nodes;
+    std::vector<std::vector<size_t>> edges;
+    std::unordered_map<std::string, size_t> node_ids;
+    std::vector<bool> resolved;
+    auto node_id = [&](const std::string& spec) {
+        const auto it = node_ids.find(spec);
+        if (it != node_ids.end()) {
+            return it->second;
+        }
+        node_ids.emplace(spec, nodes.size());
+        nodes.push_back(spec);
+        edges.emplace_back();
+        resolved.push_back(true);
+        return nodes.size() - 1;
+    };
+
+    for (const auto& root : roots) {
+        node_id(root);
+    }
+    const size_t root_count = nodes.size();
+    for (size_t id = 0; id < root_count; ++id) {
+        const std::string root = nodes[id];
+        std::vector<std::string> deps;
+        const bool local = fs::exists(root) && fs::is_regular_file(root);
+        if (!local && root.find('#') == std::string::npos && !lookup_cpkindex_deps_by_port(root, deps)) {
+            std::string package, pkgname, pkgver, pkgarch;
+            find_package(root, package, pkgname, pkgver, pkgarch, true);
+            return false;
+        }
+        if ((local || root.find('#') != std::string::npos) && !get_package_dependency_names(root, deps)) {
+            print_message("Failed to read dependency metadata for \"" + root + "\" while resolving the install plan.", RED);
+            return false;
+        }
+        for (const auto& dep : deps) {
+            const size_t dep_id = node_id(dep);
+            edges[id].push_back(dep_id);
+        }
+    }
+    // Dependency names are port names (never paths); a lookup is a hash probe
+    for (size_t id = root_count; id < nodes.size(); ++id) {
+        std::vector<std::string> deps;
+        if (!lookup_cpkindex_deps_by_port(nodes[id], deps) &&
+            (nodes[id].find('#') == std::string::npos || !get_package_dependency_names(nodes[id], deps))) {
+            print_message("Warning: dependency \"" + nodes[id] + "\" is not in the package index (skipping; often a virtual or footprint name).", YELLOW);
+            plan.skipped.push_back(nodes[id]);
+            resolved[id] = false;
+            continue;
+        }
+        for (const auto& dep : deps) {
+            const size_t dep_id = node_id(dep);
+            edges[id].push_back(dep_id);
+        }
+    }
+
+    std::vector<size_t> component;
+    const std::vector<std::vector<size_t>> components = cpk_graph_components(edges, component);
+
+    // Level of a component: one above its deepest dependency outside itself
+    std::vector<size_t> component_level(components.size(), 0);
+    for (size_t c = 0; c < components.size(); ++c) {
+        bool self_loop = false;
+        for (size_t v : components[c]) {
+            for (size_t w : edges[v]) {
+                if (!resolved[w]) {
+                    continue;
+                }
+                if (component[w] != c) {
+                    component_level[c] = std::max(component_level[c], component_level[component[w]] + 1);
+                } else if (w == v) {
+                    self_loop = true;
+                }
+            }
+        }
+        if (components[c].size() > 1 || self_loop) {
+            std::vector<std::string> cycle;
+            for (auto it = components[c].rbegin(); it != components[c].rend(); ++it) {
+                cycle.push_back(nodes[*it]);
+            }
+            plan.cycles.push_back(std::move(cycle));
+        }
+        // Members were popped deepest first, which is the order a DFS finishes them in
+        for (size_t v : components[c]) {
+            if (!resolved[v]) {
+                continue;
+            }
+            plan.order.push_back(nodes[v]);
+            if (plan.levels.size() <= component_level[c]) {
+                plan.levels.resize(component_level[c] + 1);
+            }
+            plan.levels[component_level[c]].push_back(nodes[v]);
+        }
+    }
+
+    for (const auto& cycle : plan.cycles) {
+        std::string text = "Warning: dependency cycle: ";
+        for (const auto& member : cycle) {
+            text += member + " -> ";
+        }
+        print_message(text + cycle.front() + " (installing in discovery order)", YELLOW);
+    }
+    return true;
+}
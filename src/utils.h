@@ -2,9 +2,15 @@
 #define UTILS_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <unordered_map>
+#include <cstdint>
 #include "fs_compat.h"
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
 
 extern const std::string RED;
 extern const std::string GREEN;
@@ -21,8 +27,10 @@ std::string url_decode(const std::string& value);
 std::string cpk_repo_join(const std::string& path_component);
 std::string ltrim(const std::string& str);
 
-// Compare versions semantically
+// Compare "version[-release]" strings semantically (release breaks ties numerically)
 int compare_versions(const std::string& v1, const std::string& v2);
+// Byte string ordered like compare_versions(); compute once, then compare keys directly
+std::string cpk_version_key(std::string_view version);
 
 static size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream);
 bool download_file(const std::string& url, const std::string &file_path, bool overwrite = false);
@@ -43,34 +51,379 @@ std::string find_pkg_file(const std::string& directory, const std::string& pkgna
 bool find_package(const std::string& package_name, std::string& package, std::string& pkgname, std::string& pkgver, std::string& pkgarch, bool report_missing = false);
 bool parse_cpk_filename(const std::string& filepath, std::string& pkgname, std::string& pkgver, std::string& pkgarch);
 bool get_package_dependency_names(const std::string& spec, std::vector<std::string>& out);
+// Dependency closure of one or more specs (repository name, name#version or
+// path to a .cpk), resolved against the in-memory index graph
+struct CpkInstallPlan {
+    std::vector<std::string> order;                // dependencies before dependents
+    std::vector<std::vector<std::string>> levels;  // level n depends only on levels < n
+    std::vector<std::vector<std::string>> cycles;  // dependency cycles (strongly connected components)
+    std::vector<std::string> skipped;              // dependencies missing from the index
+};
+// False if a root cannot be resolved; missing transitive dependencies are
+// skipped with a warning (often virtual or footprint names) and cycles are
+// reported but installed in discovery order
+bool cpk_plan_install(const std::vector<std::string>& roots, CpkInstallPlan& plan);
+// Strongly connected components of a graph given as adjacency lists; each
+// component comes after every component it has edges into, and component[v]
+// is the position of v's component in the result
+std::vector<std::vector<size_t>> cpk_graph_components(const std::vector<std::vector<size_t>>& edges, std::vector<size_t>& component);
+// Transitive closure folded over the components from cpk_graph_components(),
+// dependencies first: fn(c, bits) gets the bitset (bit v of word v / 64) of
+// every node reachable from component c by at least one edge, so members of
+// a cycle include themselves. Each bitset is released once every edge into
+// its component has been folded in.
+template <typename Fn>
+void cpk_for_each_component_closure(const std::vector<std::vector<size_t>>& edges,
+                                    const std::vector<std::vector<size_t>>& components,
+                                    const std::vector<size_t>& component, Fn&& fn) {
+    const size_t n = edges.size();
+    const size_t words = (n + 63) / 64;
+    std::vector<size_t> pending_uses(components.size(), 0);
+    for (size_t v = 0; v < n; ++v) {
+        for (size_t w : edges[v]) {
+            if (component[w] != component[v]) {
+                ++pending_uses[component[w]];
+            }
+        }
+    }
+    std::vector<std::vector<uint64_t>> reach(components.size());
+    for (size_t c = 0; c < components.size(); ++c) {
+        std::vector<uint64_t>& bits = reach[c];
+        bits.assign(words, 0);
+        for (size_t v : components[c]) {
+            for (size_t w : edges[v]) {
+                bits[w / 64] |= uint64_t(1) << (w % 64);
+                if (component[w] == c) {
+                    continue;
+                }
+                std::vector<uint64_t>& dep_bits = reach[component[w]];
+                for (size_t i = 0; i < words; ++i) {
+                    bits[i] |= dep_bits[i];
+                }
+                if (--pending_uses[component[w]] == 0) {
+                    std::vector<uint64_t>().swap(dep_bits);
+                }
+            }
+        }
+        if (components[c].size() > 1) {
+            for (size_t v : components[c]) {
+                bits[v / 64] |= uint64_t(1) << (v % 64);
+            }
+        }
+        fn(c, static_cast<const std::vector<uint64_t>&>(bits));
+        if (pending_uses[c] == 0) {
+            std::vector<uint64_t>().swap(bits);
+        }
+    }
+}
+// Dependency closure of every port in CPKINDEX as one reachability bitset per
+// strongly connected component, kept in CPKCLOSURE.idx (mapped read-only) and
+// rebuilt when the SHA-256 of CPKINDEX changes. Node ids are positions in the
+// name-sorted list of ports and dependency names.
+struct CpkClosureIndex {
+    struct Node {
+        uint32_t name_offset;
+        uint32_t name_size;
+        uint32_t component;
+        uint32_t in_index;  // 0 for dependency names no index line provides
+    };
+
+    std::string owned;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    size_t count = 0;  // nodes
+    size_t words = 0;  // uint64_t per bitset
+    const Node* nodes = nullptr;
+    const uint64_t* bits = nullptr;
+    const char* strings = nullptr;
+
+    CpkClosureIndex() = default;
+    CpkClosureIndex(const CpkClosureIndex&) = delete;
+    CpkClosureIndex& operator=(const CpkClosureIndex&) = delete;
+    ~CpkClosureIndex();
+    // False when CPKINDEX is missing or too large for per-port bitsets
+    bool open();
+
+    std::string_view name(size_t id) const {
+        return std::string_view(strings + nodes[id].name_offset, nodes[id].name_size);
+    }
+    bool find(std::string_view port, size_t& id) const;
+    // Everything id depends on, directly or not (never id itself)
+    void closure(size_t id, std::vector<uint64_t>& out) const;
+    size_t closure_size(size_t id) const;
+    bool depends_on(size_t id, size_t dep) const {
+        return id != dep && (bits[nodes[id].component * words + dep / 64] >> (dep % 64)) & 1;
+    }
+    // Bitset of the given names (names outside the index are ignored)
+    std::vector<uint64_t> name_set(const std::vector<std::string>& names) const;
+
+    bool attach(const char* data, size_t size);
+};
+// Rebuild CPKCLOSURE.idx for the current CPKINDEX (after cpk update)
+bool build_cpk_closure_index();
 bool is_package_installed(const std::string& package_name);
 int get_number_of_packages();
 bool change_directory(const std::string& path);
 void print_fmt_header(const std::string& header_text);
 void print_fmt_lines(const std::string& text);
+// Append text to out as a quoted JSON string
+void cpk_append_json_string(std::string& out, std::string_view text);
 std::vector<std::string> find_public_keys(const std::string& directory);
 void ensure_directory(const fs::path &dir);
 std::vector<std::string> get_local_files(const std::vector<std::string> &sources);
 void copy_files(const fs::path &source_dir, const fs::path &dest_dir, const std::vector<std::string> &files);
-void package_files(const std::string &name, const std::string &version, const std::string &release, const std::string &arch, const fs::path &output_dir);
-void generate_cpk_index(const fs::path &repo_dir);
-// CPKINDEX line format (required): "name#ver-rel.arch.cpk: dep1 dep2" (deps may be empty)
-bool cpk_index_line_valid(const std::string& index_line);
-std::string cpk_index_line_package(const std::string& index_line);
-std::string cpk_index_line_deps(const std::string& index_line);
+// Output settings for package_files(): compression filter and reproducible entries
+struct CpkArchiveOptions {
+    std::string compress = "none";  // none, zstd or xz
+    int level = -1;                 // codec default when < 0
+    int threads = 0;                // codec default when 0
+    bool reproducible = false;      // sorted entries, fixed mtime (SOURCE_DATE_EPOCH or 0), uid/gid 0
+};
+bool cpk_archive_compress_supported(const std::string& compress);
+bool package_files(const std::string &name, const std::string &version, const std::string &release, const std::string &arch, const fs::path &output_dir, const CpkArchiveOptions &options = CpkArchiveOptions());
+// keep > 0: list only the newest keep revisions per port/arch, moving the rest to attic_dir if set
+void generate_cpk_index(const fs::path &repo_dir, int keep = 0, const fs::path &attic_dir = fs::path());
+// Repository pack (cpk index --pack): CPKPACK holds .cpk payloads back to back and
+// CPKPACK.idx lists "<name#ver-rel.arch.cpk> <offset> <size> <sha256>" per member
+struct CpkPackMember {
+    std::string package;
+    unsigned long long offset = 0;
+    unsigned long long size = 0;
+    std::string sha256;
+};
+bool read_cpk_pack_index(const std::string& path, std::vector<CpkPackMember>& members);
+bool generate_cpk_pack(const fs::path &repo_dir);
+// Fetch the given .cpk files into the cache with byte-range requests against the
+// repository pack; returns how many were fetched and verified
+int fetch_pack_members(const std::vector<std::string>& packages);
+// Download size of each given .cpk: from CPKPACK.idx when it lists the file, else
+// from parallel HEAD requests; packages whose size is unknown are left out
+std::unordered_map<std::string, unsigned long long> cpk_package_download_sizes(const std::vector<std::string>& packages);
+// 1536 -> "1.5KiB" (no blanks, so it fits a print_fmt_lines() column)
+std::string cpk_format_bytes(unsigned long long bytes);
+// CPKINDEX line format (required): "name#ver-rel.arch.cpk: dep1 dep2" (deps may be empty).
+// Fields are views into the buffer the line was parsed from; name, version and
+// arch are empty when the package file name does not follow that pattern.
+struct CpkIndexLine {
+    std::string_view package;  // name#ver-rel.arch.cpk
+    std::string_view name;
+    std::string_view version;  // ver-rel
+    std::string_view arch;
+    std::string_view deps;
+};
+// Single pass over one line (surrounding blanks and CR allowed); false for
+// empty, comment and malformed lines
+bool cpk_parse_index_line(std::string_view line, CpkIndexLine& out);
+
+// Read-only view of a whole file: mmap'ed, or read into memory when mapping fails
+struct CpkFileBuffer {
+    const char* data = nullptr;
+    size_t size = 0;
+    void* mapping = nullptr;
+    std::string contents;
+
+    CpkFileBuffer() = default;
+    CpkFileBuffer(const CpkFileBuffer&) = delete;
+    CpkFileBuffer& operator=(const CpkFileBuffer&) = delete;
+    ~CpkFileBuffer();
+    bool open(const std::string& path);
+};
+
+// Call fn(const CpkIndexLine&) for each valid line in text, scanning with memchr
+template <typename Fn>
+void cpk_for_each_index_line(std::string_view text, Fn&& fn) {
+    const char* p = text.data();
+    const char* end = text.data() + text.size();
+    CpkIndexLine line;
+    while (p < end) {
+        const char* nl = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+        const char* line_end = nl ? nl : end;
+        if (cpk_parse_index_line(std::string_view(p, static_cast<size_t>(line_end - p)), line)) {
+            fn(static_cast<const CpkIndexLine&>(line));
+        }
+        p = line_end + 1;
+    }
+}
+
+// Same for a whole index file (CPKINDEX, a shard or CPKDESC); false if unreadable
+template <typename Fn>
+bool cpk_for_each_index_line(const std::string& path, Fn&& fn) {
+    CpkFileBuffer buffer;
+    if (!buffer.open(path)) {
+        return false;
+    }
+    cpk_for_each_index_line(std::string_view(buffer.data, buffer.size), fn);
+    return true;
+}
+
 bool lookup_cpkindex_deps(const std::string& package_line, std::vector<std::string>& out);
 bool lookup_cpkindex_deps_by_port(const std::string& port_name, std::vector<std::string>& out);
 void cpk_preload_index_deps_cache();
+// One CPKINDEX line of a port as held by the loaded index; the views stay
+// valid until cpk_invalidate_cpkindex_deps_cache()
+struct CpkIndexRevision {
+    std::string_view package;
+    std::string_view version;
+    std::string_view arch;
+    std::string_view version_key;  // cpk_version_key(version), computed once at load
+};
+// Lines of a port in index order; false only when CPKINDEX cannot be read
+bool cpk_index_port_revisions(std::string_view port, std::vector<CpkIndexRevision>& out);
+// The line find_package() resolves an unpinned port name to (index architecture
+// first, then the newest version); false when the port is not listed
+bool cpk_index_selected_revision(std::string_view port, CpkIndexRevision& out);
+// That line for every port, each port once in index order; false only when
+// CPKINDEX cannot be read
+bool cpk_index_selected_revisions(std::vector<std::pair<std::string_view, CpkIndexRevision>>& out);
 void cpk_invalidate_cpkindex_deps_cache();
+// Up to limit CPKINDEX port names within max_distance (-1: scaled to the name length)
+// of name by Damerau-Levenshtein (optimal string alignment) distance, nearest first
+std::vector<std::string> cpk_fuzzy_port_matches(const std::string& name, size_t limit, int max_distance = -1);
+// Print "Did you mean: ..." for a port name missing from CPKINDEX (nothing if no close match)
+void cpk_print_did_you_mean(const std::string& name);
 std::string get_system_architecture();
+std::string get_index_architecture();
 std::vector<std::string> get_installed_packages();
+// One record of the pkgutils database (<root>/var/lib/pkg/db); file paths are
+// relative to the root, directories end in "/"
+struct CpkInstalledPackage {
+    std::string name;
+    std::string version;
+    std::vector<std::string> files;
+};
+// Read the database under root (CPK_INSTALL_ROOT); false if it is unreadable
+bool cpk_read_pkg_db(const std::string& root, std::vector<CpkInstalledPackage>& out);
+// Exclusive flock(2) on <root>/var/lib/pkg, the lock pkgadd and pkgrm take;
+// held until the object goes away
+struct CpkPkgDbLock {
+    int fd = -1;
+
+    CpkPkgDbLock() = default;
+    CpkPkgDbLock(const CpkPkgDbLock&) = delete;
+    CpkPkgDbLock& operator=(const CpkPkgDbLock&) = delete;
+    ~CpkPkgDbLock();
+    bool acquire(const std::string& root, std::string& error);
+};
+// Commit packages as the new database the way pkgutils does: write
+// db.incomplete_transaction, fsync, keep the old db as db.backup, rename.
+// Records are written sorted by name with their files sorted.
+bool cpk_write_pkg_db(const std::string& root, std::vector<CpkInstalledPackage>& packages, std::string& error);
+// One archive (name#version.pkg.tar.*) of a native install transaction
+struct CpkNativePackage {
+    std::string archive;
+    std::string pre_install;  // script run right before this package is extracted
+    bool upgrade = false;
+};
+// pkgadd without the fork: under the db lock, check every package for file
+// conflicts first, then extract them in order honoring <root>/etc/pkgadd.conf
+// and rewrite the database once. Installs nothing if any package conflicts.
+// Each pre_install script runs just before its own package is extracted.
+// When extraction fails midway, the files the failing package created are
+// removed and the database is still committed for the first applied packages.
+bool cpk_native_install(const std::string& root, const std::vector<CpkNativePackage>& packages, size_t& applied);
+// pkgrm for several packages at once: under the db lock, delete the files of
+// names no other package lists and rewrite the database once
+bool cpk_native_remove(const std::string& root, const std::vector<std::string>& names);
+// Owners of every path in <root>/var/lib/pkg/db as one path-sorted table with
+// a package column, kept in CPKOWNERS.idx (mapped read-only) and rebuilt when
+// the database size or mtime, or the root, differs from when it was built
+struct CpkOwnerIndex {
+    struct Package {
+        uint32_t name_offset;
+        uint32_t name_size;
+        uint32_t version_offset;
+        uint32_t version_size;
+    };
+    struct Path {
+        uint32_t offset;
+        uint32_t size;
+        uint32_t package;
+    };
+
+    std::string owned;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    size_t package_count = 0;
+    size_t path_count = 0;
+    const Package* packages = nullptr;
+    const Path* paths = nullptr;
+    const char* strings = nullptr;
+
+    CpkOwnerIndex() = default;
+    CpkOwnerIndex(const CpkOwnerIndex&) = delete;
+    CpkOwnerIndex& operator=(const CpkOwnerIndex&) = delete;
+    ~CpkOwnerIndex();
+    // False when the database under root cannot be read
+    bool open(const std::string& root);
+
+    std::string_view package_name(size_t id) const {
+        return std::string_view(strings + packages[id].name_offset, packages[id].name_size);
+    }
+    std::string_view package_version(size_t id) const {
+        return std::string_view(strings + packages[id].version_offset, packages[id].version_size);
+    }
+    std::string_view path(size_t i) const {
+        return std::string_view(strings + paths[i].offset, paths[i].size);
+    }
+    // Ids of the packages listing path (root-relative as in the db, directories
+    // ending in "/"), appended to out in name order
+    void owners(std::string_view path, std::vector<size_t>& out) const;
+
+    bool attach(const char* data, size_t size);
+};
+// Call fn(item) for every item, spread over up to jobs threads (the caller's included)
+template <typename T, typename Fn>
+void cpk_parallel_for_each(std::vector<T>& items, size_t jobs, Fn&& fn) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < items.size(); i = next++) {
+            fn(items[i]);
+        }
+    };
+    jobs = std::max<size_t>(1, std::min(jobs, items.size()));
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < jobs; ++t) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
 std::string calculate_sha256(const std::string &file_path);
+std::string calculate_sha256_at(int dir_fd, const std::string &rel_path);
+std::string sha256_hex(const std::string& data);
+// SHA-256 of every regular member of a package archive (pkg.tar.*), keyed by
+// its path without a leading "./"; false if the archive cannot be read
+bool cpk_archive_member_sha256(const std::string& archive_path, std::unordered_map<std::string, std::string>& out);
+// Ed25519 (RFC 8032) check of a 64-byte signature over message with a 32-byte public key
+bool cpk_ed25519_verify(const unsigned char signature[64], const unsigned char* message, size_t size,
+                        const unsigned char public_key[32]);
+// Known-answer checks of SHA-256, SHA-512 and Ed25519; failure names the one that failed
+bool cpk_crypto_selftest(std::string& failure);
+// signify(1) public key (/etc/ports/*.pub); keynum is the fingerprint signify
+// also writes into every signature made with the key
+struct CpkSignifyKey {
+    std::string path;
+    unsigned char keynum[8];
+    unsigned char key[32];
+};
+bool cpk_signify_read_key(const std::string& path, CpkSignifyKey& key);
+// Check a signature with embedded message (signify -S -e, as in port
+// .signature files) using the key whose number it names. On success message
+// views the signed text inside signature_file; otherwise error says why.
+bool cpk_signify_verify(std::string_view signature_file, const std::vector<CpkSignifyKey>& keys,
+                        std::string_view& message, const CpkSignifyKey*& key, std::string& error);
 bool parse_cpk_info(const std::string &info_file_path, std::string &name, std::string &version, std::string &arch, std::string &description, std::string &url, std::string &dependencies);
 // Writable cache (~/.cpk when CPK_HOME_DIR is not writable): .info, .cpk downloads, extracted trees.
 std::string get_cache_dir();
 std::string get_cache_file(const std::string &filename);
 // System package index (cpk_home_dir/CPKINDEX); read-only commands use this path only.
 std::string get_cpkindex_path();
+// Offset table of the repository pack (cpk_home_dir/CPKPACK.idx), fetched by cpk update when published
+std::string get_cpkpack_index_path();
+// Optional package descriptions (cpk_home_dir/CPKDESC), "<package>: <description>" per line
+std::string get_cpkdesc_path();
 void cpk_print_missing_index_error();
 // True if running as root (privileged commands).
 bool cpk_is_privileged_process();